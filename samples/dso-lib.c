@@ -0,0 +1,22 @@
+/*
+ * Multiverse DSO, its variable is also used by the executable (dso.c)
+ * and it uses one of the executable's
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse, section(".data"))) int lib_config = 1;
+extern __attribute__((multiverse)) int exe_config;
+
+void __attribute__((multiverse)) lib_func()
+{
+    if (exe_config)
+        puts("exe_config = true");
+    else
+        puts("exe_config = false");
+}
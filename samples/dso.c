@@ -0,0 +1,32 @@
+/*
+ * Executable sharing multiverse variables with dso-lib.c
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse, section(".data"))) int exe_config = 0;
+extern __attribute__((multiverse)) int lib_config;
+
+void lib_func();
+
+void __attribute__((multiverse)) exe_func()
+{
+    if (lib_config)
+        puts("lib_config = true");
+    else
+        puts("lib_config = false");
+}
+
+int main()
+{
+    multiverse_init();
+    exe_func();
+    lib_func();
+
+    return 0;
+}
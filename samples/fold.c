@@ -0,0 +1,37 @@
+/*
+ * Enum values that behave the same, their variants compile to
+ * identical bodies
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+typedef enum {LOG_OFF, LOG_QUIET, LOG_VERBOSE} log_level;
+
+__attribute__((multiverse)) log_level level;
+
+void __attribute__((multiverse)) log_msg(const char *msg)
+{
+    if (level == LOG_VERBOSE)
+        puts(msg);
+}
+
+int main()
+{
+    multiverse_init();
+    log_msg("hello");
+
+    return 0;
+}
+
+#ifdef SHIFTED
+/* relinked with one more symbol, see watch_shifted */
+void unused_after(void)
+{
+    puts("unused");
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Multiverse functions called through a table of function pointers
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int mode;
+
+int __attribute__((multiverse)) scale(int x) {
+    if (mode)
+        return x * 2;
+    return x;
+}
+
+int __attribute__((multiverse)) offset(int x) {
+    if (mode)
+        return x + 1;
+    return x;
+}
+
+int (*ops[])(int) = { scale, offset };
+
+int main()
+{
+    multiverse_init();
+    for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        printf("%d\n", ops[i](20));
+
+    return 0;
+}
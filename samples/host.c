@@ -0,0 +1,33 @@
+/*
+ * Variables named like host facts (bintail --auto-config), initialized
+ * unlike the facts of samples/host. cores is bound by host/host.map.
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int has_avx2 = 0;
+__attribute__((multiverse)) int has_avx512f = 1;
+__attribute__((multiverse)) int ncpus = 1;
+__attribute__((multiverse)) int kernel_major = 1;
+__attribute__((multiverse)) int config = 2;
+__attribute__((multiverse)) int cores = 1;
+
+int __attribute__((multiverse)) lanes() {
+    if (has_avx2)
+        return 8;
+    return 4;
+}
+
+int main()
+{
+    multiverse_init();
+    printf("has_avx2=%d has_avx512f=%d ncpus=%d kernel_major=%d config=%d cores=%d lanes=%d\n",
+            has_avx2, has_avx512f, ncpus, kernel_major, config, cores, lanes());
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Long running executable, tailored while it runs (bintail --pid).
+ * live.pid appears once it is initialized.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int config;
+__attribute__((multiverse, section(".data"))) _Bool verbose = 1; // 1 byte
+
+void __attribute__((multiverse)) func() {
+    if (config)
+        puts("true");
+    else
+        puts("false");
+}
+
+void __attribute__((multiverse)) note(int i) {
+    if (verbose && i == 0)
+        puts("start");
+}
+
+int main()
+{
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY); // bintail is no parent
+    multiverse_init();
+    FILE *pid = fopen("live.pid.tmp", "w");
+    fprintf(pid, "%d\n", getpid());
+    fclose(pid);
+    rename("live.pid.tmp", "live.pid");
+    for (int i = 0; i < 40; i++) {
+        note(i);
+        func();
+        fflush(stdout);
+        usleep(25000);
+    }
+
+    return 0;
+}
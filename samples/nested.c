@@ -0,0 +1,33 @@
+/*
+ * Multiverse function calling another one from its variants
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int outer_mode;
+__attribute__((multiverse)) int inner_mode;
+
+int __attribute__((multiverse, noinline)) inner() {
+    if (inner_mode)
+        return 11;
+    return 22;
+}
+
+int __attribute__((multiverse)) outer(int x) {
+    if (outer_mode)
+        return inner() + x;
+    return inner() * x;
+}
+
+int main()
+{
+    multiverse_init();
+    printf("%d\n", outer(5));
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdexcept>
+#include <gelf.h>
+
+#include <bintail/bintail.h>
+
+using namespace std;
+
+#ifndef DT_RELR
+#define DT_RELR 36
+#endif
+#ifndef SHT_RELR
+#define SHT_RELR 19
+#endif
+
+/* .dynamic entries holding addresses */
+static bool is_dyn_ptr(int64_t tag) {
+    switch (tag) {
+    case DT_PLTGOT: case DT_HASH: case DT_STRTAB: case DT_SYMTAB: case DT_RELA:
+    case DT_INIT: case DT_FINI: case DT_REL: case DT_DEBUG: case DT_JMPREL:
+    case DT_INIT_ARRAY: case DT_FINI_ARRAY: case DT_PREINIT_ARRAY: case DT_RELR:
+    case DT_GNU_HASH: case DT_VERSYM: case DT_VERDEF: case DT_VERNEED:
+    case DT_TLSDESC_PLT: case DT_TLSDESC_GOT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* 8 byte word at vaddr in an output section, nullptr if not in file */
+static uint64_t* word_at(Elf *e, uint64_t vaddr) {
+    GElf_Shdr shdr;
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(e, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        if (!(shdr.sh_flags & SHF_ALLOC) || shdr.sh_type == SHT_NOBITS
+                || vaddr < shdr.sh_addr || vaddr + 8 > shdr.sh_addr + shdr.sh_size)
+            continue;
+        auto d = elf_getdata(scn, nullptr);
+        if (d == nullptr || d->d_buf == nullptr)
+            return nullptr;
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+        return reinterpret_cast<uint64_t*>(static_cast<char*>(d->d_buf) + (vaddr - shdr.sh_addr));
+    }
+    return nullptr;
+}
+
+static void add_word(Elf *e, uint64_t vaddr, uint64_t delta) {
+    auto w = word_at(e, vaddr);
+    if (w != nullptr && *w != 0)
+        *w += delta;
+}
+
+/*
+ * Move a position independent image by delta in memory: absolute
+ * addresses in .dynamic, relocations, symbols and words ld.so adjusts
+ * in place (lazy GOT entries, RELR). Code is pc relative.
+ */
+static void rebase(Elf *e, uint64_t delta) {
+    GElf_Shdr shdr;
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(e, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        auto d = elf_getdata(scn, nullptr);
+        if (d == nullptr || d->d_buf == nullptr || shdr.sh_entsize == 0)
+            continue;
+        auto n = d->d_size / shdr.sh_entsize;
+        switch (shdr.sh_type) {
+        case SHT_DYNAMIC:
+            for (auto i=0u; i < n; i++) {
+                GElf_Dyn dyn;
+                gelf_getdyn(d, i, &dyn);
+                if (!is_dyn_ptr(dyn.d_tag) || dyn.d_un.d_ptr == 0)
+                    continue;
+                if (dyn.d_tag == DT_PLTGOT) // GOT[0]: _DYNAMIC
+                    add_word(e, dyn.d_un.d_ptr, delta);
+                dyn.d_un.d_ptr += delta;
+                gelf_update_dyn(d, i, &dyn);
+            }
+            break;
+        case SHT_RELA:
+            if (!(shdr.sh_flags & SHF_ALLOC))
+                break;
+            for (auto i=0u; i < n; i++) {
+                GElf_Rela rela;
+                gelf_getrela(d, i, &rela);
+                auto type = GELF_R_TYPE(rela.r_info);
+                if (type == R_X86_64_JUMP_SLOT) // lazy binding adds the load bias
+                    add_word(e, rela.r_offset, delta);
+                if (type == R_X86_64_RELATIVE || type == R_X86_64_IRELATIVE)
+                    rela.r_addend += delta;
+                rela.r_offset += delta;
+                gelf_update_rela(d, i, &rela);
+            }
+            break;
+        case SHT_RELR: {
+            auto relr = static_cast<uint64_t*>(d->d_buf);
+            uint64_t where = 0;
+            for (auto i=0u; i < n; i++) {
+                if ((relr[i] & 1) == 0) {
+                    add_word(e, relr[i], delta);
+                    where = relr[i] + 8;
+                    relr[i] += delta;
+                    continue;
+                }
+                for (auto bits = relr[i] >> 1, a = where; bits != 0; bits >>= 1, a += 8)
+                    if (bits & 1)
+                        add_word(e, a, delta);
+                where += 63 * 8;
+            }
+            break;
+        }
+        case SHT_SYMTAB:
+        case SHT_DYNSYM:
+            for (auto i=0u; i < n; i++) {
+                GElf_Sym sym;
+                GElf_Shdr target;
+                gelf_getsym(d, i, &sym);
+                if (sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE
+                        || GELF_ST_TYPE(sym.st_info) == STT_TLS)
+                    continue;
+                auto tscn = elf_getscn(e, sym.st_shndx);
+                if (tscn == nullptr || !(gelf_getshdr(tscn, &target)->sh_flags & SHF_ALLOC))
+                    continue;
+                sym.st_value += delta;
+                gelf_update_sym(d, i, &sym);
+            }
+            break;
+        default:
+            continue;
+        }
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+    }
+}
+
+/**
+ * Lay out the executable segment for huge pages: file offset and vaddr
+ * aligned to align. Position independent images are moved as a whole
+ * in memory, the file gets padding before the segment. Executables keep
+ * their addresses, only the file offset becomes congruent to the vaddr.
+ */
+void Bintail::align_text(uint64_t align) {
+    size_t phdr_num;
+    GElf_Phdr text, phdr;
+    elf_getphdrnum(e_out, &phdr_num);
+    auto text_ndx = phdr_num;
+    for (auto i=0u; i < phdr_num && text_ndx == phdr_num; i++) {
+        gelf_getphdr(e_out, i, &phdr);
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            text = phdr;
+            text_ndx = i;
+        }
+    }
+    if (text_ndx == phdr_num)
+        throw std::runtime_error("No executable segment");
+
+    auto round = [align](uint64_t x) { return (x + align-1) & ~(align-1); };
+    uint64_t d_off, d_addr = 0;
+    if (ehdr_out.e_type == ET_DYN) {
+        d_off = round(text.p_offset) - text.p_offset;
+        d_addr = round(text.p_vaddr) - text.p_vaddr;
+    } else {
+        d_off = (text.p_vaddr - text.p_offset) & (align-1);
+    }
+    auto from = text.p_offset;
+    if (from == 0 && d_off != 0)
+        throw std::runtime_error("Executable segment contains the ELF header");
+
+    if (d_addr != 0)
+        rebase(e_out, d_addr);
+
+    for (auto i=0u; i < phdr_num; i++) {
+        gelf_getphdr(e_out, i, &phdr);
+        if (phdr.p_type == PT_GNU_STACK)
+            continue;
+        if (phdr.p_offset >= from)
+            phdr.p_offset += d_off;
+        phdr.p_vaddr += d_addr;
+        phdr.p_paddr += d_addr;
+        if (i == text_ndx)
+            phdr.p_align = max(phdr.p_align, align);
+        gelf_update_phdr(e_out, i, &phdr);
+    }
+
+    GElf_Shdr shdr;
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(e_out, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_offset >= from)
+            shdr.sh_offset += d_off;
+        if (shdr.sh_flags & SHF_ALLOC)
+            shdr.sh_addr += d_addr;
+        gelf_update_shdr(scn, &shdr);
+    }
+    ehdr_out.e_shoff += d_off;
+    ehdr_out.e_entry += d_addr;
+}
@@ -3,17 +3,23 @@
 #include <set>
 #include <iomanip>
 #include <memory>
-#include <err.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
 #include <stdio.h>
 #include <cstdlib>
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <gelf.h>
 #include <regex>
+#include <sstream>
 
 #include <bintail/bintail.h>
 #include "mvelem.h"
+#include "undo.h"
 
 using namespace std;
 
@@ -36,31 +42,78 @@ static std::optional<Elf_Scn*> get_scn(vector<struct sec> &secs, const char* nam
         return it->scn;
 }
 
+static Elf_Scn* need_scn(vector<struct sec> &secs, const char* name, const string &error) {
+    auto scn = get_scn(secs, name);
+    if (!scn.has_value())
+        throw std::runtime_error(error);
+    return scn.value();
+}
+
+/*
+ * f(chunk, begin, end) for fixed-size chunks of [0, n) on all cores,
+ * callers merge per-chunk results in chunk order
+ */
+template<typename F>
+static void chunked(size_t n, size_t chunk, F f) {
+    auto n_chunks = (n + chunk - 1) / chunk;
+    atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t c; (c = next++) < n_chunks;)
+            f(c, c * chunk, min(n, (c+1) * chunk));
+    };
+    vector<thread> pool;
+    for (auto t=1u; t < min<size_t>(thread::hardware_concurrency(), n_chunks); t++)
+        pool.emplace_back(work);
+    work();
+    for (auto& t : pool)
+        t.join();
+}
+
 Bintail::~Bintail() {
-    elf_end(e_out);
-    close(outfd);
+    reset();
     elf_end(e_in);
     close(infd);
 }
 
-Bintail::Bintail(const char *infile) {
+Bintail::Bintail(const char *infile, Bintail *prev)
+    :outfd{-1}, e_out{nullptr}, reloc_scn_out{nullptr}, symtab_scn_out{nullptr},
+     prev_model{prev} {
     /* init libelf state */ 
     if (elf_version(EV_CURRENT) == EV_NONE)
-        errx(1, "libelf init failed");
+        throw std::runtime_error("libelf init failed");
     if ((infd = open(infile, O_RDONLY)) == -1) 
-        errx(1, "open %s failed. %s", infile, strerror(errno));
-    if ((e_in = elf_begin(infd, ELF_C_READ, NULL)) == nullptr)
-        errx(1, "elf_begin infile failed.");
-
-    /* EHDR */
-    gelf_getehdr(e_in, &ehdr_in);
+        throw std::runtime_error("open "s + infile + " failed. " + strerror(errno));
+    if ((e_in = elf_begin(infd, ELF_C_READ, NULL)) == nullptr) {
+        close(infd);
+        throw std::runtime_error("elf_begin infile failed.");
+    }
+    /* bad inputs throw without leaking the fd, e.g. in --fleet */
+    try {
+        load();
+    } catch (...) {
+        elf_end(e_in);
+        close(infd);
+        throw;
+    }
+    prev_model = nullptr;
+}
 
-    /* Read sections */
+/*
+ * Section table and section contents of e_in. Parsed again by relink()
+ * for an input whose model is unchanged.
+ */
+void Bintail::load_sections() {
     Elf_Scn *scn = nullptr;
     GElf_Shdr shdr;
     size_t shstrndx;
+
+    secs.clear();
+    scn_handler.clear();
+    gelf_getehdr(e_in, &ehdr_in);
     elf_getshdrstrndx(e_in, &shstrndx);
     while((scn = elf_nextscn(e_in, scn)) != nullptr) {
+        if (scn == undo_scn_in)
+            continue;
         struct sec s;
         gelf_getshdr(scn, &shdr);
         s.scn = scn;
@@ -70,36 +123,33 @@ Bintail::Bintail(const char *infile) {
     }
 
 
-    symtab_scn = get_scn(secs, ".symtab").value();
-    if (symtab_scn == nullptr)
-        throw std::runtime_error("Need symtab for multiverse boundries.");
+    symtab_scn = need_scn(secs, ".symtab", "Need symtab for multiverse boundries.");
 
     /* Must exist */
-    reloc_scn_in = get_scn(secs, ".rela.dyn").value(); // also reachable over DYNAMIC section
+    auto missing = "Section missing, cannot be tailored: "s;
+    reloc_scn_in = need_scn(secs, ".rela.dyn", missing + ".rela.dyn"); // also reachable over DYNAMIC section
 
-    Elf_Scn *rodata_scn = get_scn(secs, ".rodata").value();
+    Elf_Scn *rodata_scn = need_scn(secs, ".rodata", missing + ".rodata");
     rodata.load (rodata_scn);
     scn_handler[rodata_scn] = &rodata;
 
-    Elf_Scn *data_scn = get_scn(secs, ".data").value();
+    Elf_Scn *data_scn = need_scn(secs, ".data", missing + ".data");
     data.load(data_scn);
     scn_handler[data_scn] = &data;
 
-    Elf_Scn *dynamic_scn = get_scn(secs, ".dynamic").value();
+    Elf_Scn *dynamic_scn = need_scn(secs, ".dynamic", missing + ".dynamic");
     dynamic.load(dynamic_scn);
     scn_handler[dynamic_scn] = &dynamic;
 
-    Elf_Scn *text_scn = get_scn(secs, ".text").value();
+    Elf_Scn *text_scn = need_scn(secs, ".text", missing + ".text");
     text.load(text_scn);
     scn_handler[text_scn] = &text;
 
-    Elf_Scn *bss_scn = get_scn(secs, ".bss").value();
+    Elf_Scn *bss_scn = need_scn(secs, ".bss", missing + ".bss");
     bss.load(bss_scn);
     scn_handler[bss_scn] = &bss;
 
-    Elf_Scn *mvvar_scn = get_scn(secs, "__multiverse_var_").value();
-    if (mvvar_scn == nullptr) 
-        throw std::runtime_error("Executable has no multiverse variables.\n");
+    Elf_Scn *mvvar_scn = need_scn(secs, "__multiverse_var_", "Executable has no multiverse variables.");
     mvvar.load(mvvar_scn);
     scn_handler[mvvar_scn] = &mvvar;
 
@@ -119,13 +169,44 @@ Bintail::Bintail(const char *infile) {
         mvdata.load(mvdata_scn.value());
         scn_handler[mvdata_scn.value()] = &mvdata;
     }
+}
+
+void Bintail::load() {
+    restore_input();
+    load_sections();
+
+    GElf_Shdr shdr;
+    auto sym_words = resolve_local_syms();
 
-    /* read info sections */
+    /* read info sections, symbol relocated words resolved in the copies */
     auto mvvar_infos = mvvar.read();
     auto mvcs_infos = mvcs.read();
     auto mvfn_infos = mvfn.read();
-    for (auto e : *mvvar_infos)
-        vars.push_back(make_unique<MVVar>(e, &rodata, &data));
+    auto resolve = [&](auto &infos, Section &s) {
+        if (s.scn_in == nullptr || sym_words.empty())
+            return;
+        gelf_getshdr(s.scn_in, &shdr);
+        for (auto i=0ul; i < infos.size(); i++)
+            for (auto off=0ul; off + 8 <= sizeof(infos[i]); off += 8) {
+                auto w = sym_words.find(shdr.sh_addr + i*sizeof(infos[i]) + off);
+                if (w != sym_words.end())
+                    memcpy(reinterpret_cast<byte*>(&infos[i]) + off, &w->second.value, 8);
+            }
+    };
+    resolve(*mvvar_infos, mvvar);
+    resolve(*mvcs_infos, mvcs);
+    resolve(*mvfn_infos, mvfn);
+    for (auto i=0ul; i < mvvar_infos->size(); i++) {
+        auto v = make_unique<MVVar>((*mvvar_infos)[i], &rodata, &data);
+        gelf_getshdr(mvvar.scn_in, &shdr);
+        auto w = sym_words.find(shdr.sh_addr + i*sizeof(mv_info_var)
+                + offsetof(mv_info_var, variable_location));
+        if (w != sym_words.end()) {
+            v->sym_info = w->second.r_info;
+            v->sym_addend = w->second.r_addend;
+        }
+        vars.push_back(move(v));
+    }
     for (auto e : *mvcs_infos)
         pps.push_back(make_unique<MVPP>(e, &text));
     for (auto e : *mvfn_infos) {
@@ -136,80 +217,334 @@ Bintail::Bintail(const char *infile) {
         pps.push_back(move(pp));
     }
 
-    /* multiverse_init equivalent */
+    /* multiverse_init equivalent, linked by address */
     // find var & save ptr to it
     //    add fn to var.functions_head
     for (auto& fn : fns)
-        for (auto& var: vars)
-            fn->probe_var(var.get());
+        for (auto& m : fn->variants())
+            for (auto& a : m->get_assigns()) {
+                auto w = sym_words.find(a->slot);
+                if (w != sym_words.end())
+                    a->resolve_sym(w->second.value, w->second.r_info, w->second.r_addend);
+            }
+    unordered_map<uint64_t, MVVar*> var_at;
+    for (auto& var: vars)
+        var_at.emplace(var->location(), var.get());
+    for (auto& fn : fns)
+        fn->link_vars(var_at);
 
     // 1. Find function
     // 2. Create patchpoint
     // 3. Append pp to fn ll
-    for (auto& pp : pps)
-        for (auto& fn : fns) {
-            if (fn->location() != pp->function_body )
-                continue;
-            fn->add_pp(pp.get());
-            pp->set_fn(fn.get());
-        }
+    unordered_map<uint64_t, MVFn*> fn_at;
+    for (auto& fn : fns)
+        fn_at.emplace(fn->location(), fn.get());
+    for (auto& pp : pps) {
+        auto it = fn_at.find(pp->function_body);
+        if (it == fn_at.end())
+            continue;
+        it->second->add_pp(pp.get());
+        pp->set_fn(it->second);
+    }
 
-    /* Keep symbols the same (refs to index) */
-    GElf_Sym sym;
+    /* name or name.multiverse.<assignments> */
+    unordered_map<string, MVFn*> fn_named;
+    for (auto& fn : fns)
+        fn_named.emplace(fn->get_name(), fn.get());
+
+    /* Keep symbols the same (refs to index), per chunk the ones of
+     * interest: variants & section boundaries */
+    const size_t chunk = 1 << 16;
+    struct sym_part {
+        vector<pair<size_t, MVFn*>> variants;
+        vector<size_t> bounds;
+    };
     Elf_Data * d2 = elf_getdata(symtab_scn, nullptr);
     gelf_getshdr(symtab_scn, &shdr);
-    for (size_t i=0; i < d2->d_size / shdr.sh_entsize; i++) {
-        gelf_getsym(d2, i, &sym);
-        struct symbol s;
-        s.sym = sym;
-        s.name = elf_strptr(e_in, shdr.sh_link, sym.st_name);
-        syms.push_back(s);
-    }
+    auto strtab = elf_getdata(elf_getscn(e_in, shdr.sh_link), nullptr);
+    auto n_syms = d2->d_size / shdr.sh_entsize;
+    syms.resize(n_syms);
+    vector<sym_part> sym_parts((n_syms + chunk - 1) / chunk);
+    chunked(n_syms, chunk, [&](size_t c, size_t begin, size_t end) {
+        auto& part = sym_parts[c];
+        auto names = static_cast<const char*>(strtab->d_buf);
+        for (auto i = begin; i < end; i++) {
+            auto& s = syms[i];
+            gelf_getsym(d2, i, &s.sym);
+            if (s.sym.st_name < strtab->d_size)
+                s.name = names + s.sym.st_name;
+            auto it = fn_named.find(s.name.substr(0, s.name.find(".multiverse.")));
+            if (it != fn_named.end())
+                part.variants.push_back({i, it->second});
+            if (s.name.compare(0, 9, "__start__") == 0 || s.name.compare(0, 8, "__stop__") == 0)
+                part.bounds.push_back(i);
+        }
+    });
+    vector<struct symbol> bounds;
+    for (auto& part : sym_parts)
+        for (auto i : part.bounds)
+            bounds.push_back(syms[i]);
     try {
-    mvvar.start_ptr = sym_value(syms, "__start___multiverse_var_ptr");
-    mvvar.stop_ptr  = sym_value(syms, "__stop___multiverse_var_ptr");
-    mvfn.start_ptr  = sym_value(syms, "__start___multiverse_fn_ptr");
-    mvfn.stop_ptr   = sym_value(syms, "__stop___multiverse_fn_ptr");
-    mvcs.start_ptr  = sym_value(syms, "__start___multiverse_callsite_ptr");
-    mvcs.stop_ptr   = sym_value(syms, "__stop___multiverse_callsite_ptr");
+    mvvar.start_ptr = sym_value(bounds, "__start___multiverse_var_ptr");
+    mvvar.stop_ptr  = sym_value(bounds, "__stop___multiverse_var_ptr");
+    mvfn.start_ptr  = sym_value(bounds, "__start___multiverse_fn_ptr");
+    mvfn.stop_ptr   = sym_value(bounds, "__stop___multiverse_fn_ptr");
+    mvcs.start_ptr  = sym_value(bounds, "__start___multiverse_callsite_ptr");
+    mvcs.stop_ptr   = sym_value(bounds, "__stop___multiverse_callsite_ptr");
     } catch (...) {
-        cout << "Symbols missing, cannot be tailored\n";
-        close(infd);
-        exit(0);
+        throw std::runtime_error("Symbols missing, cannot be tailored");
     }
 
     int boundary_sz;
-    boundary_sz = sym_value(syms, "__stop___multiverse_var_") - sym_value(syms, "__start___multiverse_var_");
-    cout << " var=" << boundary_sz / sizeof(struct mv_info_var) << " ";
-    boundary_sz = sym_value(syms, "__stop___multiverse_fn_") - sym_value(syms, "__start___multiverse_fn_");
-    cout << " fn=" << boundary_sz  / sizeof(struct mv_info_fn) << " ";
-    boundary_sz = sym_value(syms, "__stop___multiverse_callsite_") - sym_value(syms, "__start___multiverse_callsite_");
-    cout << " cs=" << boundary_sz / sizeof(struct mv_info_callsite)  << " ";
+    boundary_sz = sym_value(bounds, "__stop___multiverse_var_") - sym_value(bounds, "__start___multiverse_var_");
+    cerr << " var=" << boundary_sz / sizeof(struct mv_info_var) << " ";
+    boundary_sz = sym_value(bounds, "__stop___multiverse_fn_") - sym_value(bounds, "__start___multiverse_fn_");
+    cerr << " fn=" << boundary_sz  / sizeof(struct mv_info_fn) << " ";
+    boundary_sz = sym_value(bounds, "__stop___multiverse_callsite_") - sym_value(bounds, "__start___multiverse_callsite_");
+    cerr << " cs=" << boundary_sz / sizeof(struct mv_info_callsite)  << " ";
+
+    for (auto& part : sym_parts)
+        for (auto [i, fn] : part.variants)
+            fn->probe_sym(syms[i]);
 
-    for (auto& sym : syms)
-        for (auto& fn : fns)
-            fn->probe_sym(sym);
+    /* Inlined entries end before callsites in the generic body */
+    map<uint64_t, MVFn*> fn_body;
+    for (auto& fn : fns)
+        fn_body.emplace(fn->location(), fn.get());
+    for (auto& pp : pps) {
+        if (pp->pp.type == PP_TYPE_X86_JUMP)
+            continue;
+        auto it = fn_body.upper_bound(pp->pp.location);
+        if (it != fn_body.begin() && pp->pp.location < prev(it)->first + prev(it)->second->size())
+            prev(it)->second->limit_entry(pp->pp.location);
+    }
+
+    /* per chunk relocations by owning info section, rest to rela_other */
+    MVSection* owners[] = { &mvvar, &mvfn, &mvcs, &mvdata };
+    struct rela_part {
+        vector<GElf_Rela> owned[size(owners)];
+        vector<GElf_Rela> other;
+    };
+    gelf_getshdr(reloc_scn_in, &shdr);
+    auto d = elf_getdata(reloc_scn_in, nullptr);
+    auto n_relas = d->d_size / shdr.sh_entsize;
+    vector<rela_part> rela_parts((n_relas + chunk - 1) / chunk);
+    chunked(n_relas, chunk, [&](size_t c, size_t begin, size_t end) {
+        auto& part = rela_parts[c];
+        GElf_Rela rela;
+        for (auto i = begin; i < end; i++) {
+            gelf_getrela(d, i, &rela);
+            auto claims = 0u;
+            for (auto o=0u; o < size(owners); o++)
+                claims += owners[o]->claim_rela(rela, part.owned[o]);
+            if (claims == 0)
+                part.other.push_back(rela);
+        }
+    });
+    for (auto& part : rela_parts) {
+        for (auto o=0u; o < size(owners); o++)
+            owners[o]->relocs.insert(owners[o]->relocs.end(), part.owned[o].begin(), part.owned[o].end());
+        rela_other.insert(rela_other.end(), part.other.begin(), part.other.end());
+    }
+    data_relocs_in = data.relocs;
+    rela_other_in = rela_other;
+
+    link_imports();
+    fold_variants();
+    syms_in = syms;
+}
+
+/*
+ * Relinked input with the same model: multiverse sections, symbols,
+ * relocations & the text apply() writes are byte identical, at the same
+ * addresses. Anything else needs a new Bintail.
+ */
+bool Bintail::same_model(Elf *e) {
+    GElf_Ehdr ehdr;
+    size_t shstrndx;
+    if (gelf_getehdr(e, &ehdr) == nullptr || ehdr.e_type != ehdr_in.e_type
+            || elf_getshdrstrndx(e, &shstrndx) != 0)
+        return false;
+    vector<struct sec> new_secs;
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(e, scn)) != nullptr) {
+        struct sec s;
+        gelf_getshdr(scn, &s.shdr);
+        s.scn = scn;
+        s.name = elf_strptr(e, shstrndx, s.shdr.sh_name);
+        if (s.name == UNDO_NOTE_SCN)
+            return false; // restored by load()
+        new_secs.push_back(s);
+    }
+    auto find = [](vector<struct sec> &in, const char *name) {
+        auto it = find_if(in.begin(), in.end(), [name](auto& s) { return s.name == name; });
+        return it == in.end() ? nullptr : &*it;
+    };
+    auto same_bytes = [](const struct sec *a, const struct sec *b) {
+        if (a == nullptr || b == nullptr)
+            return a == b;
+        if (a->shdr.sh_addr != b->shdr.sh_addr || a->shdr.sh_size != b->shdr.sh_size)
+            return false;
+        if (a->shdr.sh_type == SHT_NOBITS || b->shdr.sh_type == SHT_NOBITS)
+            return a->shdr.sh_type == b->shdr.sh_type;
+        auto da = elf_getdata(a->scn, nullptr), db = elf_getdata(b->scn, nullptr);
+        return da->d_size == db->d_size && memcmp(da->d_buf, db->d_buf, da->d_size) == 0;
+    };
+    for (auto name : { "__multiverse_var_", "__multiverse_fn_", "__multiverse_callsite_",
+            "__multiverse_data_", ".symtab", ".strtab", ".rela.dyn", ".dynsym",
+            ".dynstr", ".dynamic" })
+        if (!same_bytes(find(secs, name), find(new_secs, name)))
+            return false;
+
+    /* same place, contents compared where the model read them */
+    map<string, const struct sec*> placed;
+    for (auto name : { ".rodata", ".data", ".text", ".bss" }) {
+        auto a = find(secs, name), b = find(new_secs, name);
+        if (a == nullptr || b == nullptr || a->shdr.sh_addr != b->shdr.sh_addr
+                || a->shdr.sh_size != b->shdr.sh_size)
+            return false;
+        placed[name] = b;
+    }
+    auto same_at = [&](Section &s, const char *name, uint64_t addr, uint64_t len) {
+        auto b = placed[name];
+        if (addr < b->shdr.sh_addr || addr + len > b->shdr.sh_addr + b->shdr.sh_size)
+            return false;
+        auto d = elf_getdata(b->scn, nullptr);
+        return memcmp(s.in_buf(addr), static_cast<const byte*>(d->d_buf)
+                + (addr - b->shdr.sh_addr), len) == 0;
+    };
+    vector<pair<uint64_t, uint64_t>> ranges;
+    for (auto& fn : fns)
+        fn->footprint(ranges);
+    for (auto [start, end] : ranges)
+        if (!same_at(text, ".text", start, end - start))
+            return false;
+    for (auto& v : vars)
+        if (!v->imported && v->in_data && !same_at(data, ".data", v->location(), v->var.variable_width))
+            return false;
+    for (auto& v : vars)
+        if (!v->imported && rodata.inside(v->var.name)
+                && !same_at(rodata, ".rodata", v->var.name, v->name().size() + 1))
+            return false;
+    for (auto& fn : fns)
+        if (rodata.inside(fn->fn.name)
+                && !same_at(rodata, ".rodata", fn->fn.name, fn->get_name().size() + 1))
+            return false;
+    return true;
+}
+
+/*
+ * Keep the model for a relinked infile if same_model(), only the
+ * section contents are read again. False leaves this one untouched.
+ */
+bool Bintail::relink(const char *infile) {
+    if (undo_in != nullptr || e_out != nullptr)
+        return false;
+    int fd;
+    Elf *e;
+    if ((fd = open(infile, O_RDONLY)) == -1)
+        throw std::runtime_error("open "s + infile + " failed. " + strerror(errno));
+    if ((e = elf_begin(fd, ELF_C_READ, NULL)) == nullptr) {
+        close(fd);
+        throw std::runtime_error("elf_begin infile failed.");
+    }
+    if (!same_model(e)) {
+        elf_end(e);
+        close(fd);
+        return false;
+    }
+    elf_end(e_in);
+    close(infd);
+    e_in = e;
+    infd = fd;
+    load_sections();
+    return true;
+}
+
+/*
+ * DSOs refer to default visibility symbols with R_X86_64_64, the info
+ * sections hold 0 there. The local definition is the value the model
+ * reads, variables & assignments keep the symbol relocation, so an
+ * interposing definition (copy relocation) still wins at run time.
+ * Undefined ones are imports, see link_imports.
+ */
+map<uint64_t, Bintail::sym_word> Bintail::resolve_local_syms() {
+    GElf_Shdr shdr;
+    GElf_Sym sym;
+    auto dynsym_scn = get_scn(secs, ".dynsym");
+    if (dynsym_scn.has_value()) {
+        gelf_getshdr(dynsym_scn.value(), &shdr);
+        auto d = elf_getdata(dynsym_scn.value(), nullptr);
+        for (size_t i=0; i < d->d_size / shdr.sh_entsize; i++) {
+            gelf_getsym(d, i, &sym);
+            dynsyms.push_back({sym, elf_strptr(e_in, shdr.sh_link, sym.st_name)});
+        }
+    }
 
     GElf_Rela rela;
     gelf_getshdr(reloc_scn_in, &shdr);
     auto d = elf_getdata(reloc_scn_in, nullptr);
+    MVSection* mv_scns[] = { &mvvar, &mvfn, &mvcs, &mvdata };
+    map<uint64_t, sym_word> words;
     for (size_t i=0; i < d->d_size / shdr.sh_entsize; i++) {
         gelf_getrela(d, i, &rela);
-        auto claims = 0u;
-        claims += mvvar.probe_rela(&rela);
-        claims += mvfn.probe_rela(&rela);
-        claims += mvcs.probe_rela(&rela);
-        claims += mvdata.probe_rela(&rela);
-        if (claims == 0)
-            rela_other.push_back(rela);
+        auto ndx = GELF_R_SYM(rela.r_info);
+        if (GELF_R_TYPE(rela.r_info) != R_X86_64_64 || ndx == 0 || ndx >= dynsyms.size()
+                || dynsyms[ndx].sym.st_shndx == SHN_UNDEF)
+            continue;
+        for (auto scn : mv_scns)
+            if (scn->scn_in != nullptr && scn->inside(rela.r_offset))
+                words[rela.r_offset] = {dynsyms[ndx].sym.st_value + rela.r_addend,
+                    rela.r_info, rela.r_addend};
     }
+    return words;
 }
 
-void Bintail::change(string change_str) {
-    smatch m;
-    regex_search(change_str, m, regex(R"((\w+)=(\d+))"));
-    auto var_name = m.str(1);
-    auto value = stoi(m.str(2));
+/*
+ * Assignments to variables of other modules: relocated against a
+ * dynamic symbol (DSO) or a copy in .bss (executable). Linked to an
+ * imported var of that name, see ModuleSet.
+ */
+void Bintail::link_imports() {
+    unordered_map<uint64_t, uint64_t> sym_reloc; // slot -> r_info
+    for (auto& r : mvdata.relocs)
+        if (GELF_R_SYM(r.r_info) != 0)
+            sym_reloc.emplace(r.r_offset, r.r_info);
+    unordered_map<uint64_t, const string*> object_at;
+    for (auto& s : syms)
+        if (GELF_ST_TYPE(s.sym.st_info) == STT_OBJECT && s.sym.st_shndx != SHN_UNDEF)
+            object_at.emplace(s.sym.st_value, &s.name);
+
+    unordered_map<string, MVVar*> imported;
+    for (auto& fn : fns)
+        for (auto& m : fn->variants())
+            for (auto& a : m->get_assigns()) {
+                if (a->var != nullptr)
+                    continue;
+                string name;
+                auto r = sym_reloc.find(a->slot);
+                auto o = object_at.find(a->location());
+                if (r != sym_reloc.end() && GELF_R_SYM(r->second) < dynsyms.size()) {
+                    a->sym_info = r->second;
+                    name = dynsyms[GELF_R_SYM(r->second)].name;
+                } else if (o != object_at.end()) {
+                    name = *o->second;
+                } else {
+                    stringstream err;
+                    err << "No variable at 0x" << hex << a->location() << " for " << fn->get_name();
+                    throw std::runtime_error(err.str());
+                }
+                auto& var = imported[name];
+                if (var == nullptr) {
+                    vars.push_back(make_shared<MVVar>(name));
+                    var = vars.back().get();
+                }
+                a->link_var(var);
+                var->link_fn(fn.get());
+            }
+}
+
+void Bintail::change(const string &var_name, int64_t value) {
     for (auto& v : vars)
         if (var_name == v->name())
             v->set_value(value, &data);
@@ -225,18 +560,253 @@ void Bintail::apply(string change_str, bool guard) {
     auto var_name = m.str(1);
     for (auto& e : vars)
         if (var_name == e->name())
-            e->apply(&text, guard);
+            e->frozen = true;
+    apply_frozen(guard);
 }
 
 void Bintail::apply_all(bool guard) {
     for (auto& v : vars)
-        v->apply(&text, guard);
+        v->frozen = true;
+    apply_frozen(guard);
+}
+
+/* Freeze every requested var first, patch & guard in the final state */
+void Bintail::apply_config(const Config &cfg) {
+    for (auto& [var, value] : cfg.changes)
+        change(var, value);
+    for (auto& e : cfg.apply)
+        for (auto& v : vars)
+            if (e == v->name())
+                v->frozen = true;
+    if (cfg.apply_all)
+        for (auto& v : vars)
+            v->frozen = true;
+    apply_frozen(cfg.guard);
+}
+
+/* Worklist: each fn of a frozen var once, in model order */
+void Bintail::apply_frozen(bool guard) {
+    guarded = guard;
+    if (keep_pending) {
+        keep_pending = false;
+        keep_tailored(guard);
+    }
+    unordered_set<MVFn*> work;
+    for (auto& v : vars)
+        if (v->frozen)
+            work.insert(v->functions().cbegin(), v->functions().cend());
+    for (auto& fn : fns)
+        if (!fn->is_fixed() && work.count(fn.get()))
+            fn->apply(&text, guard);
+    specialize_calls();
+    if (guard)
+        for (auto& b : folded)
+            text.fill(b.location, byte{0xcc}, b.size);
+    retarget_fptrs();
+}
+
+/* 8 byte word at vaddr in an output section with file data */
+uint64_t* Bintail::out_word(uint64_t vaddr) {
+    GElf_Shdr shdr;
+    for (auto& [in, out] : scn_map) {
+        gelf_getshdr(in, &shdr);
+        if (out == nullptr || !(shdr.sh_flags & SHF_ALLOC) || shdr.sh_type == SHT_NOBITS
+                || vaddr < shdr.sh_addr || vaddr + 8 > shdr.sh_addr + shdr.sh_size)
+            continue;
+        auto d = elf_getdata(out, nullptr);
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+        return reinterpret_cast<uint64_t*>(static_cast<char*>(d->d_buf) + (vaddr - shdr.sh_addr));
+    }
+    return nullptr;
+}
+
+/*
+ * Pointers to fixed functions in data (callback tables, vtables) go to
+ * the selected variant instead of through the entry jump. PIE: addends
+ * of RELATIVE relocations, non-PIE: words with an R_X86_64_64 from
+ * --emit-relocs, without those words of data objects in .data,
+ * .data.rel.ro & .init_array. Other equal words are no pointers.
+ */
+void Bintail::retarget_fptrs() {
+    unordered_map<uint64_t, uint64_t> variant_of;
+    for (auto& fn : fns) {
+        if (!fn->is_fixed())
+            continue;
+        auto pfn = fn->select();
+        if (pfn != nullptr)
+            variant_of.emplace(fn->location(), pfn->location());
+    }
+    if (variant_of.empty())
+        return;
+
+    if (ehdr_in.e_type == ET_DYN) {
+        for (auto& r : rela_other) {
+            auto it = variant_of.find(r.r_addend);
+            if (r.r_info != R_X86_64_RELATIVE || it == variant_of.end())
+                continue;
+            auto w = out_word(r.r_offset);
+            if (w != nullptr && *w == it->first) // --apply-dynamic-relocs
+                *w = it->second;
+            r.r_addend = it->second;
+        }
+        return;
+    }
+
+    /* candidate words by section index */
+    unordered_map<size_t, vector<uint64_t>> words;
+    unordered_set<size_t> relocated;
+    for (auto& sec : secs) {
+        if (sec.shdr.sh_type != SHT_RELA || (sec.shdr.sh_flags & SHF_ALLOC))
+            continue;
+        relocated.insert(sec.shdr.sh_info);
+        auto d = elf_getdata(sec.scn, nullptr);
+        GElf_Rela rela;
+        for (size_t i=0; i < d->d_size / sec.shdr.sh_entsize; i++) {
+            gelf_getrela(d, i, &rela);
+            if (GELF_R_TYPE(rela.r_info) == R_X86_64_64)
+                words[sec.shdr.sh_info].push_back(rela.r_offset);
+        }
+    }
+    const set<string> tables{ ".data", ".data.rel.ro", ".init_array" };
+    for (auto& sec : secs) {
+        auto ndx = elf_ndxscn(sec.scn);
+        if (relocated.count(ndx) || !tables.count(sec.name))
+            continue;
+        for (auto& sym : syms) {
+            if (GELF_ST_TYPE(sym.sym.st_info) != STT_OBJECT || sym.sym.st_shndx != ndx)
+                continue;
+            auto first = (sym.sym.st_value + 7) & ~7ul;
+            for (auto a = first; a + 8 <= sym.sym.st_value + sym.sym.st_size; a += 8)
+                words[ndx].push_back(a);
+        }
+    }
+
+    GElf_Shdr shdr;
+    Elf_Scn* mv_scns[] = { mvvar.scn_in, mvfn.scn_in, mvcs.scn_in, mvdata.scn_in };
+    for (auto& [in, out] : scn_map) {
+        gelf_getshdr(in, &shdr);
+        auto it = words.find(elf_ndxscn(in));
+        if (out == nullptr || it == words.end() || shdr.sh_type != SHT_PROGBITS
+                || find(begin(mv_scns), end(mv_scns), in) != end(mv_scns))
+            continue;
+        auto d = elf_getdata(out, nullptr);
+        for (auto a : it->second) {
+            if (a < shdr.sh_addr || a + 8 > shdr.sh_addr + shdr.sh_size)
+                continue;
+            auto w = reinterpret_cast<uint64_t*>(static_cast<char*>(d->d_buf) + (a - shdr.sh_addr));
+            auto v = variant_of.find(*w);
+            if (v == variant_of.end())
+                continue;
+            *w = v->second;
+            elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+        }
+    }
+}
+
+/* apply_config on the model: values & frozen vars, text untouched */
+void Bintail::freeze(const Config &cfg) {
+    for (auto& [var, value] : cfg.changes)
+        for (auto& v : vars)
+            if (var == v->name())
+                v->_value = value;
+    for (auto& v : vars)
+        if (cfg.apply_all || find(cfg.apply.cbegin(), cfg.apply.cend(), v->name()) != cfg.apply.cend())
+            v->frozen = true;
+}
+
+vector<string> Config::parse(const string &line) {
+    vector<string> args;
+    istringstream in{line};
+    string tok;
+    while (in >> tok) {
+        if (tok == "-s" || tok == "-a") {
+            string val;
+            if (!(in >> val))
+                throw std::runtime_error("Option "s + tok + " expects an argument");
+            if (tok == "-a") {
+                apply.push_back(val);
+                continue;
+            }
+            smatch m;
+            if (!regex_match(val, m, regex(R"((\w+)=(\d+))")))
+                throw std::runtime_error("Option -s expects var=value, not " + val);
+            changes.push_back({m.str(1), stoll(m.str(2))});
+        } else if (tok == "-A") {
+            apply_all = true;
+        } else if (tok == "-g") {
+            guard = false;
+        } else if (tok == "-u") {
+            undo = true;
+        } else if (tok == "-H") {
+            huge_text = true;
+        } else if (tok[0] == '-' && tok.size() > 1) {
+            throw std::runtime_error("Unknown option "s + tok);
+        } else {
+            args.push_back(tok);
+        }
+    }
+    return args;
+}
+
+string Config::canonical() const {
+    map<string, int64_t> values; // last -s wins
+    for (auto& [var, value] : changes)
+        values[var] = value;
+    ostringstream out;
+    for (auto& [var, value] : values)
+        out << "-s " << var << "=" << value << "\n";
+    if (apply_all) {
+        out << "-A\n";
+    } else {
+        for (auto& var : set<string>(apply.cbegin(), apply.cend()))
+            out << "-a " << var << "\n";
+    }
+    if (!guard)
+        out << "-g\n";
+    if (huge_text)
+        out << "-H\n";
+    if (undo)
+        out << "-u\n";
+    return out.str();
+}
+
+/**
+ * Drop output state, the model is as freshly loaded afterwards.
+ * Allows tailoring one parsed input several times.
+ */
+void Bintail::reset() {
+    if (e_out != nullptr)
+        elf_end(e_out);
+    if (outfd != -1)
+        close(outfd);
+    e_out = nullptr;
+    outfd = -1;
+    out_bufs.clear();
+    scn_map.clear();
+
+    for (auto& [scn, sec] : scn_handler)
+        sec->set_out_scn(nullptr);
+    reloc_scn_out = nullptr;
+    symtab_scn_out = nullptr;
+    mvinfo_area.reset();
+
+    data.relocs = data_relocs_in;
+    rela_other = rela_other_in;
+    syms = syms_in;
+    guarded = false;
+    keep_pending = false;
+    specialized.clear();
+    for (auto& v : vars)
+        v->reset();
+    for (auto& f : fns)
+        f->reset();
 }
 
 /**
  * Regenerate rela & sym table & update .dynamic info
+ *  keep_size - input size, R_X86_64_NONE behind (-u)
  */
-void Bintail::update_relocs_sym() {
+void Bintail::update_relocs_sym(bool keep_size) {
     vector<GElf_Rela>* rvv[] = { 
         &data.relocs,
         &mvvar.relocs,
@@ -248,20 +818,38 @@ void Bintail::update_relocs_sym() {
 
     GElf_Shdr shdr, sym_shdr;
     gelf_getshdr(reloc_scn_out, &shdr);
-    gelf_getshdr(symtab_scn, &sym_shdr);
+    gelf_getshdr(symtab_scn_out, &sym_shdr);
     auto d = elf_getdata(reloc_scn_out, nullptr);
-    auto d2 = elf_getdata(symtab_scn, nullptr);
+    auto d2 = elf_getdata(symtab_scn_out, nullptr);
 
-    // RELOCS
-    int i = 0;
+    // RELOCS, DT_RELACOUNT: RELATIVE ones first, by offset as ld sorts them if kept
+    vector<GElf_Rela> relas;
     int cnt = 0;
-    for (auto v : rvv) 
-        for (auto r : *v) {
-            if (r.r_info == R_X86_64_RELATIVE)
-                cnt++;
-            if (!gelf_update_rela (d, i++, &r))
-                throw std::runtime_error("Error: gelf_update_rela() "s + elf_errmsg(elf_errno()));
-        }
+    for (auto relative : { true, false }) {
+        for (auto v : rvv)
+            for (auto r : *v)
+                if ((r.r_info == R_X86_64_RELATIVE) == relative)
+                    relas.push_back(r);
+        if (relative)
+            cnt = relas.size();
+    }
+    if (keep_size) {
+        stable_sort(relas.begin(), relas.begin() + cnt, [](auto& a, auto& b)
+                { return a.r_offset < b.r_offset; });
+        auto n_in = shdr.sh_size / sizeof(GElf_Rela);
+        if (relas.size() > n_in)
+            throw std::runtime_error(".rela.dyn grows, cannot keep the input layout");
+        relas.resize(n_in, GElf_Rela{});
+    }
+    if (relas.size() * sizeof(GElf_Rela) > d->d_size) { // moved by layout()
+        out_bufs.emplace_back(relas.size() * sizeof(GElf_Rela));
+        d->d_buf = out_bufs.back().data();
+        d->d_size = out_bufs.back().size();
+    }
+    int i = 0;
+    for (auto& r : relas)
+        if (!gelf_update_rela (d, i++, &r))
+            throw std::runtime_error("Error: gelf_update_rela() "s + elf_errmsg(elf_errno()));
 
     assert(sizeof(GElf_Rela) == shdr.sh_entsize);
     shdr.sh_size = i * sizeof(GElf_Rela);
@@ -280,7 +868,7 @@ void Bintail::update_relocs_sym() {
     i = 0;
     for (auto s : syms) {
         if (!gelf_update_sym(d2, i++, &s.sym))
-            cout << "Error: gelf_update_sym() "
+            cerr << "Error: gelf_update_sym() "
                 << elf_errmsg(elf_errno()) << endl;
     }
 
@@ -291,17 +879,29 @@ void Bintail::update_relocs_sym() {
     elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
     elf_flagdata(d2, ELF_C_SET, ELF_F_DIRTY);
     gelf_update_shdr(reloc_scn_out, &shdr);
-    gelf_update_shdr(symtab_scn, &sym_shdr);
+    gelf_update_shdr(symtab_scn_out, &sym_shdr);
     elf_flagshdr(reloc_scn_out, ELF_C_SET, ELF_F_DIRTY);
-    elf_flagshdr(symtab_scn, ELF_C_SET, ELF_F_DIRTY);
+    elf_flagshdr(symtab_scn_out, ELF_C_SET, ELF_F_DIRTY);
 }
 
 /* Create file until MVInfo data */
 void Bintail::init_write(const char *outfile, bool apply_all) {
-    if ((outfd = open(outfile, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IXUSR)) == -1) 
-        errx(1, "open %s failed. %s", outfile, strerror(errno));
+    int fd;
+    struct stat st;
+    /* hardlinked (e.g. from an output cache): replace, don't write through */
+    if (stat(outfile, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+        unlink(outfile);
+    if ((fd = open(outfile, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IXUSR)) == -1) 
+        throw std::runtime_error("open "s + outfile + " failed. " + strerror(errno));
+    init_write(fd, apply_all);
+}
+
+/* Takes ownership of fd */
+void Bintail::init_write(int fd, bool apply_all) {
+    reset();
+    outfd = fd;
     if ((e_out = elf_begin(outfd, ELF_C_WRITE, NULL)) == nullptr)
-        errx(1, "elf_begin outfile failed.");
+        throw std::runtime_error("elf_begin outfile failed.");
 
      // Manual layout: Sections in segments have to be relocated manualy
     elf_flagelf(e_out, ELF_C_SET, ELF_F_LAYOUT);
@@ -344,23 +944,29 @@ void Bintail::init_write(const char *outfile, bool apply_all) {
     removed_scns = 0;
     elf_getshdrstrndx(e_in, &shstrndx);
     while((scn_in = elf_nextscn(e_in, scn_in)) != nullptr) {
+        if (scn_in == undo_scn_in)
+            continue;
         gelf_getshdr(scn_in, &shdr_in);
         auto it = scn_handler.find(scn_in);
         if (it != scn_handler.end()) {
             auto sec = it->second;
             if (sec->is_needed(apply_all == false) == false) {
                 removed_scns++;
+                scn_map.emplace_back(scn_in, nullptr);
                 continue;
             }
             if ((scn_out = elf_newscn(e_out)) == nullptr)
-                errx(1, "elf_newscn failed.");
+                throw std::runtime_error("elf_newscn failed.");
             sec->set_out_scn(scn_out);
         } else {
             if ((scn_out = elf_newscn(e_out)) == nullptr)
-                errx(1, "elf_newscn failed.");
+                throw std::runtime_error("elf_newscn failed.");
         }
         if (scn_in == reloc_scn_in)
             reloc_scn_out = scn_out;
+        if (scn_in == symtab_scn)
+            symtab_scn_out = scn_out;
+        scn_map.emplace_back(scn_in, scn_out);
 
         /* Copy scn shdr & data */
         gelf_getshdr(scn_out, &shdr_out);
@@ -371,46 +977,250 @@ void Bintail::init_write(const char *outfile, bool apply_all) {
 
         data_in = elf_getdata(scn_in, nullptr);
         if ((data_out = elf_newdata(scn_out)) == nullptr)
-            errx(1, "elf_newdata failed.");
-        *data_out = *data_in; // malloc & memcpy ???
+            throw std::runtime_error("elf_newdata failed.");
+        *data_out = *data_in;
+        /* Own copy, input stays untouched for the next init_write */
+        if (data_in->d_buf != nullptr) {
+            auto buf = static_cast<byte*>(data_in->d_buf);
+            out_bufs.emplace_back(buf, buf + data_in->d_size);
+            data_out->d_buf = out_bufs.back().data();
+        }
     }
+    keep_pending = undo_in != nullptr;
 }
 
-void Bintail::write() {
-    mvinfo_area->generate(&data);
+void Bintail::write(bool undo, bool huge_text) {
+    if (undo && huge_text)
+        throw std::runtime_error("-u keeps the input layout, -H moves .text");
+    mvinfo_area->generate(&data, undo);
 
-    update_relocs_sym();
+    if (guarded && !undo) // symbols stay for the undo note
+        gc_syms();
+    update_relocs_sym(undo);
+    layout();
     dynamic.write();
 
-    auto area_end = mvinfo_area->end_offset();
-    auto shift = bss.new_sz() - bss.old_sz();
+    ehdr_out.e_shstrndx -= removed_scns;
+    ehdr_out.e_shnum -= removed_scns;
+    cerr << " shift=" << int64_t(ehdr_in.e_shoff - ehdr_out.e_shoff) << "\n";
+    if (huge_text)
+        align_text(2ul << 20); // x86-64 huge page
+    if (undo)
+        add_undo_note();
+    gelf_update_ehdr(e_out, &ehdr_out);
+
+    elf_fill(0xcccccccc); // asm(int 0x3) // ToDo(Felix): .dynamic fill
+    if (elf_update(e_out, ELF_C_WRITE) < 0)
+        throw std::runtime_error("elf_update(write) failed. "s + elf_errmsg(elf_errno()));
+}
 
-    /* shift sections after area */
+/*
+ * Tailored output with undo note: the input is restored in place, in
+ * the read buffers of e_in. Tailored .text stays with the note.
+ */
+void Bintail::restore_input() {
+    size_t shstrndx;
     GElf_Shdr shdr;
     Elf_Scn *scn = nullptr;
-    while ((scn = elf_nextscn(e_out, scn))) {
+    elf_getshdrstrndx(e_in, &shstrndx);
+    while ((scn = elf_nextscn(e_in, scn)) != nullptr) {
         gelf_getshdr(scn, &shdr);
-        if (shdr.sh_offset < area_end || scn == bss.scn_out)
-            continue;
-        shdr.sh_offset -= shift;
-        gelf_update_shdr(scn, &shdr);
-        //elf_flagshdr(scn, ELF_C_SET, ELF_F_DIRTY);
-        //auto d = elf_getdata(scn, nullptr);
-        //elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+        if (shdr.sh_type == SHT_NOTE && elf_strptr(e_in, shstrndx, shdr.sh_name) == UNDO_NOTE_SCN ""s)
+            break;
     }
+    auto note = make_unique<UndoNote>();
+    if (scn == nullptr || !UndoNote::parse(scn, *note))
+        return;
 
-    ehdr_out.e_shstrndx -= removed_scns;
-    ehdr_out.e_shnum -= removed_scns;
-    // Section table after sections, adjust for bss (growth in mem, 0 in file)
-    ehdr_out.e_shoff -= shift;
-    cout << " shift=" << shift << "\n";
-    gelf_update_ehdr(e_out, &ehdr_out);
+    note->restore(e_in);
+    provenance = note->provenance;
+    undo_scn_in = scn;
+    undo_in = move(note);
+}
 
-    elf_fill(0xcccccccc); // asm(int 0x3) // ToDo(Felix): .dynamic fill
-    if (elf_update(e_out, ELF_C_WRITE) < 0) {
-        cout << elf_errmsg(elf_errno()) << endl;
-        errx(1, "elf_update(write) failed.");
+/* Original bytes of all changes, allows tailoring the output again */
+void Bintail::add_undo_note() {
+    string prov = "bintail " BINTAIL_VERSION ":";
+    for (auto& v : vars)
+        if (v->frozen)
+            prov += " " + v->name() + "=" + to_string(v->value());
+
+    UndoNote note;
+    note.record(e_in, scn_map, prov);
+    note.guard = guarded;
+    for (auto& v : vars)
+        note.vars.push_back({v->frozen, v->value()});
+    for (auto i=0u; i < fns.size(); i++)
+        if (fns[i]->is_fixed())
+            note.fixed.push_back(i);
+    note.owners = text_owners(note.text_ranges());
+    add_section(UNDO_NOTE_SCN, SHT_NOTE, 4, note.serialize());
+}
+
+/*
+ * Functions whose apply may write into each range (sorted): generic
+ * body & entry, variants, callsites, folded bodies and calls specialized
+ * to them.
+ */
+vector<vector<uint32_t>> Bintail::text_owners(const vector<pair<uint64_t, uint64_t>> &ranges) {
+    struct print { uint64_t start, end; uint32_t fn; };
+    vector<print> prints;
+    unordered_map<MVFn*, uint32_t> index;
+    vector<pair<uint64_t, uint64_t>> fp;
+    for (auto i=0u; i < fns.size(); i++) {
+        index.emplace(fns[i].get(), i);
+        fp.clear();
+        fns[i]->footprint(fp);
+        for (auto [start, end] : fp)
+            prints.push_back({start, end, i});
+    }
+    for (auto& b : folded)
+        prints.push_back({b.location, b.location + b.size, index[b.fn]});
+    for (auto [site, callee] : specialized)
+        prints.push_back({site, site + 5, index[callee]});
+    sort(prints.begin(), prints.end(), [](auto& a, auto& b) { return a.start < b.start; });
+
+    /* sweep, ranges by start */
+    vector<vector<uint32_t>> owners(ranges.size());
+    vector<const print*> open;
+    auto next = prints.cbegin();
+    for (auto r=0u; r < ranges.size(); r++) {
+        auto [start, end] = ranges[r];
+        for (; next != prints.cend() && next->start < end; next++)
+            open.push_back(&*next);
+        open.erase(remove_if(open.begin(), open.end(), [start=start](auto p)
+                    { return p->end <= start; }), open.end());
+        set<uint32_t> own;
+        for (auto p : open)
+            own.insert(p->fn);
+        owners[r].assign(own.cbegin(), own.cend());
+    }
+    return owners;
+}
+
+/*
+ * Re-tailoring: functions fixed in the note with the same variables &
+ * guard take their tailored bytes back and count as applied, the others
+ * are applied on the restored input. A range shared with a function
+ * that changes is left to all of its owners, ones that are not fixed
+ * in either tailoring don't write.
+ */
+void Bintail::keep_tailored(bool guard) {
+    auto& note = *undo_in;
+    if (note.guard != guard || note.vars.size() != vars.size())
+        return;
+    auto ranges = note.text_ranges();
+    if (any_of(note.owners.cbegin(), note.owners.cend(), [](auto& o) { return o.empty(); }))
+        return; // not written by apply, don't know
+
+    unordered_map<MVVar*, size_t> var_index;
+    for (auto i=0u; i < vars.size(); i++)
+        var_index.emplace(vars[i].get(), i);
+    auto same = [&](MVVar *v) {
+        auto& s = note.vars[var_index[v]];
+        return bool(s.frozen) == v->frozen && s.value == v->value();
+    };
+    vector<bool> keep(fns.size(), false), idle(fns.size());
+    for (auto i=0u; i < fns.size(); i++)
+        idle[i] = fns[i]->select() == nullptr;
+    for (auto i : note.fixed) {
+        if (i >= fns.size())
+            return;
+        idle[i] = false;
+        keep[i] = true;
+        for (auto& m : fns[i]->variants())
+            for (auto& a : m->get_assigns())
+                if (a->var != nullptr && !same(a->var))
+                    keep[i] = false;
+    }
+
+    for (auto changed = true; changed;) {
+        changed = false;
+        for (auto& own : note.owners) {
+            if (all_of(own.cbegin(), own.cend(), [&](auto i) { return keep[i] || idle[i]; }))
+                continue;
+            for (auto i : own)
+                if (keep[i]) {
+                    keep[i] = false;
+                    changed = true;
+                }
+        }
     }
+
+    for (auto r=0u; r < ranges.size(); r++) {
+        auto& own = note.owners[r];
+        if (none_of(own.cbegin(), own.cend(), [&](auto i) { return keep[i]; }))
+            continue;
+        auto& b = note.tailored[r];
+        copy(b.cbegin(), b.cend(), text.out_buf(ranges[r].first));
+    }
+    for (auto i=0u; i < fns.size(); i++)
+        if (keep[i])
+            fns[i]->frozen = true;
+}
+
+/*
+ * Append non-alloc section after all others, .shstrtab grows and moves
+ * to the end as well. Section header table follows.
+ */
+Elf_Scn* Bintail::add_section(const string &name, GElf_Word type, uint64_t align, vector<byte> &&buf) {
+    GElf_Shdr shdr;
+    uint64_t end = 0;
+    auto str_scn = elf_getscn(e_out, ehdr_out.e_shstrndx);
+    Elf_Scn *scn = nullptr;
+    while ((scn = elf_nextscn(e_out, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_type != SHT_NOBITS && scn != str_scn)
+            end = max(end, shdr.sh_offset + shdr.sh_size);
+    }
+
+    /* name */
+    auto d = elf_getdata(str_scn, nullptr);
+    auto str = static_cast<const byte*>(d->d_buf);
+    vector<byte> strtab(str, str + d->d_size);
+    auto name_off = strtab.size();
+    auto name_b = reinterpret_cast<const byte*>(name.c_str());
+    strtab.insert(strtab.end(), name_b, name_b + name.size() + 1);
+    out_bufs.push_back(move(strtab));
+    d->d_buf = out_bufs.back().data();
+    d->d_size = out_bufs.back().size();
+    elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+
+    gelf_getshdr(str_scn, &shdr);
+    shdr.sh_offset = end;
+    shdr.sh_size = d->d_size;
+    gelf_update_shdr(str_scn, &shdr);
+    end += shdr.sh_size;
+
+    /* section */
+    if ((scn = elf_newscn(e_out)) == nullptr)
+        throw std::runtime_error("elf_newscn failed.");
+    if ((d = elf_newdata(scn)) == nullptr)
+        throw std::runtime_error("elf_newdata failed.");
+    out_bufs.push_back(move(buf));
+    d->d_buf = out_bufs.back().data();
+    d->d_size = out_bufs.back().size();
+    d->d_type = ELF_T_BYTE;
+    d->d_align = align;
+    d->d_off = 0;
+    d->d_version = EV_CURRENT;
+
+    gelf_getshdr(scn, &shdr);
+    shdr.sh_name = name_off;
+    shdr.sh_type = type;
+    shdr.sh_flags = 0;
+    shdr.sh_addr = 0;
+    shdr.sh_offset = (end + align-1) & ~(align-1);
+    shdr.sh_size = d->d_size;
+    shdr.sh_link = 0;
+    shdr.sh_info = 0;
+    shdr.sh_addralign = align;
+    shdr.sh_entsize = 0;
+    gelf_update_shdr(scn, &shdr);
+
+    ehdr_out.e_shnum++;
+    ehdr_out.e_shoff = (shdr.sh_offset + shdr.sh_size + 7) & ~7ul;
+    return scn;
 }
 
 /*
@@ -464,6 +1274,8 @@ void Bintail::print_dyn() {
 }
 
 void Bintail::print() {
+    if (!provenance.empty())
+        cout << "Restored from undo note (" << provenance << ")\n";
     for (auto& var : vars)
         var->print();
 }
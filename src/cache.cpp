@@ -0,0 +1,213 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "cache.h"
+#include "sha256.h"
+
+using namespace std;
+
+static void make_dir(const string &path) {
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+        throw std::runtime_error("mkdir "s + path + " failed. " + strerror(errno));
+}
+
+/* flock for stats & eviction */
+class DirLock {
+public:
+    DirLock(const string &dir) {
+        if ((fd = open((dir + "/lock").c_str(), O_RDWR|O_CREAT, 0644)) == -1)
+            throw std::runtime_error("open "s + dir + "/lock failed. " + strerror(errno));
+        flock(fd, LOCK_EX);
+    }
+    ~DirLock() { close(fd); }
+private:
+    int fd;
+};
+
+OutputCache::OutputCache(const string &_dir, uint64_t _max_size)
+    :dir{_dir}, max_size{_max_size} {
+    make_dir(dir);
+    make_dir(dir + "/tmp");
+}
+
+string OutputCache::key(const char *infile, const Config &cfg) {
+    Sha256 sha;
+    auto head = "bintail " BINTAIL_VERSION "\n" + Sha256::file(infile) + "\n" + cfg.canonical();
+    sha.update(head.data(), head.size());
+    return sha.hex();
+}
+
+string OutputCache::entry(const string &key) {
+    return dir + "/" + key.substr(0, 2) + "/" + key;
+}
+
+bool OutputCache::fetch(const string &key, const char *outfile) {
+    auto path = entry(key);
+    int src;
+    if ((src = open(path.c_str(), O_RDONLY)) == -1) {
+        count(false);
+        return false;
+    }
+    place(path, src, outfile);
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0); // recently used
+    count(true);
+    return true;
+}
+
+/* Reflink, hardlink or copy entry to outfile. Atomic by rename. */
+void OutputCache::place(const string &path, int src, const char *outfile) {
+    auto tmp = string(outfile) + ".XXXXXX";
+    int dst = mkstemp(tmp.data());
+    if (dst == -1) {
+        close(src);
+        throw std::runtime_error("mkstemp "s + tmp + " failed. " + strerror(errno));
+    }
+    auto placed = ioctl(dst, FICLONE, src) == 0;
+    if (placed) {
+        fchmod(dst, S_IRWXU);
+    } else {
+        unlink(tmp.c_str());
+        placed = link(path.c_str(), tmp.c_str()) == 0;
+    }
+    if (!placed) { // other fs, copy
+        struct stat st;
+        close(dst);
+        if ((dst = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU)) == -1
+                || fstat(src, &st) == -1
+                || sendfile(dst, src, nullptr, st.st_size) != st.st_size) {
+            auto msg = "copy "s + path + " failed. " + strerror(errno);
+            close(src);
+            if (dst != -1)
+                close(dst);
+            unlink(tmp.c_str());
+            throw std::runtime_error(msg);
+        }
+    }
+    close(src);
+    close(dst);
+    if (rename(tmp.c_str(), outfile) == -1) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("rename "s + outfile + " failed. " + strerror(errno));
+    }
+}
+
+int OutputCache::create(string &tmp) {
+    tmp = dir + "/tmp/XXXXXX";
+    int fd = mkstemp(tmp.data());
+    if (fd == -1)
+        throw std::runtime_error("mkstemp "s + tmp + " failed. " + strerror(errno));
+    return fd;
+}
+
+/* Entries are read-only, hardlinked outputs must not write through */
+void OutputCache::publish(const string &tmp, const string &key, const char *outfile) {
+    auto path = entry(key);
+    make_dir(dir + "/" + key.substr(0, 2));
+    chmod(tmp.c_str(), S_IRUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+    if (rename(tmp.c_str(), path.c_str()) == -1) {
+        unlink(tmp.c_str());
+        throw std::runtime_error("rename "s + tmp + " failed. " + strerror(errno));
+    }
+    int src;
+    if ((src = open(path.c_str(), O_RDONLY)) == -1)
+        throw std::runtime_error("open "s + path + " failed. " + strerror(errno));
+    place(path, src, outfile);
+    evict();
+}
+
+static void read_stats(const string &dir, uint64_t &hits, uint64_t &misses) {
+    ifstream in{dir + "/stats"};
+    string name;
+    uint64_t n;
+    hits = misses = 0;
+    while (in >> name >> n)
+        (name == "hits" ? hits : misses) = n;
+}
+
+void OutputCache::count(bool hit) {
+    DirLock l{dir};
+    uint64_t hits, misses;
+    read_stats(dir, hits, misses);
+    (hit ? hits : misses)++;
+    ofstream out{dir + "/stats", ios::trunc};
+    out << "hits " << hits << "\nmisses " << misses << "\n";
+}
+
+static bool is_hex(const char *name, size_t len) {
+    return strlen(name) == len && strspn(name, "0123456789abcdef") == len;
+}
+
+/* entries: (mtime, size, path), only dir/xx/<key> */
+static vector<tuple<struct timespec, uint64_t, string>> entries(const string &dir) {
+    vector<tuple<struct timespec, uint64_t, string>> v;
+    auto d = opendir(dir.c_str());
+    if (d == nullptr)
+        return v;
+    while (auto sub = readdir(d)) {
+        if (!is_hex(sub->d_name, 2))
+            continue;
+        auto subdir = dir + "/" + sub->d_name;
+        auto sd = opendir(subdir.c_str());
+        if (sd == nullptr)
+            continue;
+        while (auto e = readdir(sd)) {
+            struct stat st;
+            auto path = subdir + "/" + e->d_name;
+            if (!is_hex(e->d_name, 64) || lstat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+                continue;
+            v.emplace_back(st.st_mtim, st.st_size, path);
+        }
+        closedir(sd);
+    }
+    closedir(d);
+    return v;
+}
+
+/* Least recently used first until below max_size */
+void OutputCache::evict() {
+    DirLock l{dir};
+    auto v = entries(dir);
+    uint64_t total = 0;
+    for (auto& e : v)
+        total += get<1>(e);
+    if (total <= max_size)
+        return;
+    sort(v.begin(), v.end(), [](auto& a, auto& b) {
+            auto& ta = get<0>(a);
+            auto& tb = get<0>(b);
+            return tie(ta.tv_sec, ta.tv_nsec) < tie(tb.tv_sec, tb.tv_nsec); });
+    for (auto& [mtime, size, path] : v) {
+        if (total <= max_size)
+            break;
+        if (unlink(path.c_str()) == 0)
+            total -= size;
+    }
+}
+
+void OutputCache::print_stats() {
+    uint64_t hits, misses, total = 0;
+    {
+        DirLock l{dir};
+        read_stats(dir, hits, misses);
+    }
+    auto v = entries(dir);
+    for (auto& e : v)
+        total += get<1>(e);
+    cout << "Cache " << dir << ":\n"
+         << "\thits: " << hits << "\n"
+         << "\tmisses: " << misses << "\n"
+         << "\tentries: " << v.size() << "\n"
+         << "\tsize: " << total << "/" << max_size << " bytes\n";
+}
@@ -0,0 +1,37 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <string>
+#include <cstdint>
+
+#include <bintail/bintail.h>
+
+/*
+ * On-disk cache of tailored outputs.
+ *
+ * Key: sha256 of bintail version, input content and the canonical
+ * configuration. Entries live in dir/xx/<key>, are published by rename
+ * and placed by reflink, hardlink or copy. Least recently used entries
+ * are evicted once the cache exceeds max_size bytes. Hit/miss counters
+ * are kept in dir/stats.
+ */
+class OutputCache {
+public:
+    OutputCache(const std::string &dir, uint64_t max_size);
+
+    std::string key(const char *infile, const Config &cfg);
+    bool fetch(const std::string &key, const char *outfile); // hit
+    int create(std::string &tmp);                            // miss: fd to tailor into
+    void publish(const std::string &tmp, const std::string &key, const char *outfile);
+    void print_stats();
+
+private:
+    std::string entry(const std::string &key);
+    void place(const std::string &path, int src, const char *outfile);
+    void count(bool hit);
+    void evict();
+
+    std::string dir;
+    uint64_t max_size;
+};
+#endif
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <map>
+#include <string.h>
+#include <unistd.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+#include "dump.h"
+
+using namespace std;
+
+unique_ptr<ModelWriter> ModelWriter::create(const string &format, int fd) {
+    if (format == "json")
+        return make_unique<JsonWriter>(fd);
+    if (format == "cbor")
+        return make_unique<CborWriter>(fd);
+    throw std::runtime_error("Unknown dump format " + format + ", expected json or cbor");
+}
+
+void ModelWriter::put(const void *p, size_t n) {
+    if (buf.size() + n > buf.capacity())
+        flush();
+    auto c = static_cast<const char*>(p);
+    buf.insert(buf.end(), c, c + n);
+}
+
+void ModelWriter::flush() {
+    for (size_t done = 0; done < buf.size();) {
+        auto n = ::write(fd, buf.data() + done, buf.size() - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error("Writing dump failed. "s + strerror(errno));
+        done += n;
+    }
+    buf.clear();
+}
+
+//-----------------------------------------------------------------------------
+void JsonWriter::sep() {
+    if (after_key) {
+        after_key = false;
+        return;
+    }
+    if (!first.empty() && !first.back())
+        put(uint8_t(','));
+    if (!first.empty())
+        first.back() = false;
+}
+
+void JsonWriter::text(const string &s) {
+    put(uint8_t('"'));
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            put(uint8_t('\\'));
+            put(c);
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            put(esc, 6);
+        } else {
+            put(c);
+        }
+    }
+    put(uint8_t('"'));
+}
+
+void JsonWriter::map(size_t) {
+    sep();
+    put(uint8_t('{'));
+    closers.push_back('}');
+    first.push_back(true);
+}
+
+void JsonWriter::array(size_t) {
+    sep();
+    put(uint8_t('['));
+    closers.push_back(']');
+    first.push_back(true);
+}
+
+void JsonWriter::end() {
+    put(uint8_t(closers.back()));
+    closers.pop_back();
+    first.pop_back();
+    if (closers.empty())
+        put(uint8_t('\n'));
+}
+
+void JsonWriter::key(const string &k) {
+    sep();
+    text(k);
+    put(uint8_t(':'));
+    after_key = true;
+}
+
+void JsonWriter::str(const string &s) {
+    sep();
+    text(s);
+}
+
+void JsonWriter::num(int64_t v) {
+    sep();
+    auto s = to_string(v);
+    put(s.data(), s.size());
+}
+
+void JsonWriter::unum(uint64_t v) {
+    sep();
+    auto s = to_string(v);
+    put(s.data(), s.size());
+}
+
+void JsonWriter::boolean(bool b) {
+    sep();
+    put(b ? "true" : "false", b ? 4 : 5);
+}
+
+void JsonWriter::null() {
+    sep();
+    put("null", 4);
+}
+
+//-----------------------------------------------------------------------------
+void CborWriter::head(uint8_t major, uint64_t v) {
+    major <<= 5;
+    if (v < 24) {
+        put(uint8_t(major | v));
+        return;
+    }
+    auto bytes = v <= 0xff ? 1 : v <= 0xffff ? 2 : v <= 0xffffffff ? 4 : 8;
+    put(uint8_t(major | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27)));
+    for (auto i = bytes - 1; i >= 0; i--) // big endian
+        put(uint8_t(v >> (8*i)));
+}
+
+void CborWriter::map(size_t n) { head(5, n); }
+void CborWriter::array(size_t n) { head(4, n); }
+
+void CborWriter::str(const string &s) {
+    head(3, s.size());
+    put(s.data(), s.size());
+}
+
+void CborWriter::num(int64_t v) {
+    if (v < 0)
+        head(1, uint64_t(-1 - v));
+    else
+        head(0, v);
+}
+
+void CborWriter::unum(uint64_t v) { head(0, v); }
+
+//-----------------------------------------------------------------------------
+static const char* mvfn_type(mvfn_type_t t) {
+    return t == MVFN_TYPE_NONE ? "none" :
+        t == MVFN_TYPE_NOP ? "nop" :
+        t == MVFN_TYPE_CONSTANT ? "constant" :
+        t == MVFN_TYPE_CLI ? "cli" :
+        t == MVFN_TYPE_STI ? "sti" : "unknown";
+}
+
+static const char* pp_type(mv_info_patchpoint_type t) {
+    return t == PP_TYPE_X86_CALL ? "call" :
+        t == PP_TYPE_X86_CALL_INDIRECT ? "call_indirect" :
+        t == PP_TYPE_X86_JUMP ? "jump" : "invalid";
+}
+
+/**
+ * Model as one map: variables (functions by index), functions with
+ * variants, their assignments (variable by index) & patchpoints.
+ */
+void Bintail::dump(ModelWriter &w) {
+    unordered_map<MVVar*, size_t> var_ndx;
+    unordered_map<MVFn*, size_t> fn_ndx;
+    map<MVFn*, vector<MVPP*>> fn_pps;
+    for (auto i=0u; i < vars.size(); i++)
+        var_ndx[vars[i].get()] = i;
+    for (auto i=0u; i < fns.size(); i++)
+        fn_ndx[fns[i].get()] = i;
+    for (auto& pp : pps)
+        fn_pps[pp->_fn].push_back(pp.get());
+
+    w.map(provenance.empty() ? 3 : 4);
+    w.key("pic");
+    w.boolean(ehdr_in.e_type == ET_DYN);
+    if (!provenance.empty()) {
+        w.key("restored");
+        w.str(provenance);
+    }
+
+    w.key("variables");
+    w.array(vars.size());
+    for (auto& v : vars) {
+        w.map(7);
+        w.key("name");
+        w.str(v->name());
+        w.key("location");
+        w.unum(v->location());
+        w.key("width");
+        w.unum(v->var.variable_width);
+        w.key("signed");
+        w.boolean(v->var.flag_signed);
+        w.key("imported");
+        w.boolean(v->imported);
+        w.key("value");
+        w.num(v->value());
+        vector<size_t> users;
+        for (auto fn : v->functions())
+            users.push_back(fn_ndx.at(fn));
+        sort(users.begin(), users.end());
+        w.key("functions");
+        w.array(users.size());
+        for (auto i : users)
+            w.unum(i);
+        w.end();
+        w.end();
+    }
+    w.end();
+
+    w.key("functions");
+    w.array(fns.size());
+    for (auto& fn : fns) {
+        w.map(5);
+        w.key("name");
+        w.str(fn->get_name());
+        w.key("location");
+        w.unum(fn->location());
+        w.key("size");
+        w.unum(fn->size());
+
+        w.key("variants");
+        w.array(fn->n_mvfns());
+        for (auto& m : fn->variants()) {
+            w.map(5);
+            w.key("location");
+            w.unum(m->location());
+            w.key("size");
+            w.unum(m->size());
+            w.key("type");
+            w.str(mvfn_type(m->mvfn.type));
+            w.key("constant");
+            w.unum(m->mvfn.constant);
+            w.key("assignments");
+            w.array(m->n_assigns());
+            for (auto& a : m->get_assigns()) {
+                w.map(3);
+                w.key("variable");
+                if (a->var == nullptr)
+                    w.null();
+                else
+                    w.unum(var_ndx.at(a->var));
+                w.key("lower");
+                w.unum(a->lower());
+                w.key("upper");
+                w.unum(a->upper());
+                w.end();
+            }
+            w.end();
+            w.end();
+        }
+        w.end();
+
+        auto& fpps = fn_pps[fn.get()];
+        w.key("patchpoints");
+        w.array(fpps.size());
+        for (auto pp : fpps) {
+            w.map(2);
+            w.key("type");
+            w.str(pp_type(pp->pp.type));
+            w.key("location");
+            w.unum(pp->pp.location);
+            w.end();
+        }
+        w.end();
+        w.end();
+    }
+    w.end();
+    w.end();
+    w.flush();
+}
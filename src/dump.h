@@ -0,0 +1,74 @@
+#ifndef __DUMP_H
+#define __DUMP_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+/*
+ * Streaming writer of nested maps & arrays to an fd, buffered. Sizes
+ * are given up front (CBOR uses definite lengths), every container is
+ * closed by end(). In a map, key() precedes each value.
+ */
+class ModelWriter {
+public:
+    static std::unique_ptr<ModelWriter> create(const std::string &format, int fd);
+    ModelWriter(int _fd) :fd{_fd} { buf.reserve(1 << 16); }
+    virtual ~ModelWriter() {}
+
+    virtual void map(size_t n) = 0;
+    virtual void array(size_t n) = 0;
+    virtual void end() = 0;
+    virtual void key(const std::string &k) = 0;
+    virtual void str(const std::string &s) = 0;
+    virtual void num(int64_t v) = 0;
+    virtual void unum(uint64_t v) = 0;
+    virtual void boolean(bool b) = 0;
+    virtual void null() = 0;
+    void flush();
+protected:
+    void put(const void *p, size_t n);
+    void put(uint8_t c) { put(&c, 1); }
+private:
+    int fd;
+    std::vector<char> buf;
+};
+
+class JsonWriter : public ModelWriter {
+public:
+    using ModelWriter::ModelWriter;
+    void map(size_t n);
+    void array(size_t n);
+    void end();
+    void key(const std::string &k);
+    void str(const std::string &s);
+    void num(int64_t v);
+    void unum(uint64_t v);
+    void boolean(bool b);
+    void null();
+private:
+    void sep();
+    void text(const std::string &s);
+    std::string closers;     // per open container
+    std::vector<bool> first; // no comma yet
+    bool after_key = false;
+};
+
+/* RFC 8949 */
+class CborWriter : public ModelWriter {
+public:
+    using ModelWriter::ModelWriter;
+    void map(size_t n);
+    void array(size_t n);
+    void end() {}
+    void key(const std::string &k) { str(k); }
+    void str(const std::string &s);
+    void num(int64_t v);
+    void unum(uint64_t v);
+    void boolean(bool b) { put(uint8_t(b ? 0xf5 : 0xf4)); }
+    void null() { put(uint8_t(0xf6)); }
+private:
+    void head(uint8_t major, uint64_t v);
+};
+#endif
@@ -0,0 +1,123 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+void CostTable::load(const char *file) {
+    map<string, unsigned*> fields = {
+        { "call", &call }, { "call_indirect", &call_indirect },
+        { "jmp", &jmp }, { "ret", &ret }, { "nop", &nop },
+        { "mov", &mov }, { "cli", &cli }, { "sti", &sti },
+    };
+    ifstream in{file};
+    if (!in)
+        throw std::runtime_error("open "s + file + " failed");
+    string line;
+    while (getline(in, line)) {
+        istringstream l{line.substr(0, line.find('#'))};
+        string insn;
+        unsigned cycles;
+        if (!(l >> insn))
+            continue;
+        auto f = fields.find(insn);
+        if (f == fields.end() || !(l >> cycles))
+            throw std::runtime_error("Bad cost entry: " + line);
+        *f->second = cycles;
+    }
+}
+
+/* mv_info_* bytes and relocations of non frozen entities */
+struct meta_size {
+    uint64_t bytes = 0;
+    uint64_t relocs = 0;
+};
+
+static void print_savings(const Savings &s) {
+    cout << dec << s.calls << " call, " << s.nops << " nop, "
+         << s.consts << " constant, " << s.irqs << " cli/sti";
+    if (s.callsites() > 0)
+        cout << ", saved " << s.cycles / s.callsites() << " cycles/call";
+    cout << "\n";
+}
+
+/**
+ * Dry-run of apply_config: which variants get selected and what the
+ * patched callsites, guards and remaining metadata look like. Works on
+ * the model only, no output is created.
+ */
+void Bintail::estimate(const Config &cfg, const CostTable &costs) {
+    freeze(cfg);
+
+    map<MVFn*, Savings> fn_savings;
+    Savings total;
+    for (auto& fn : fns) {
+        auto& s = fn_savings[fn.get()];
+        fn->estimate(s, costs, &text);
+        total.add(s);
+    }
+
+    /* Remaining info & relocations, all = before tailoring */
+    bool fpic = (ehdr_in.e_type == ET_DYN);
+    auto meta = [&](bool all) {
+        meta_size m;
+        m.relocs = fpic ? 6 : 0; // start/stop ptrs
+        for (auto& fn : fns) {
+            if (!all && fn_savings[fn.get()].fns > 0)
+                continue;
+            m.bytes += sizeof(mv_info_fn) + fn->n_mvfns() * sizeof(mv_info_mvfn)
+                + fn->n_assigns() * sizeof(mv_info_assignment)
+                + fn->n_callsites() * sizeof(mv_info_callsite);
+            if (fpic)
+                m.relocs += MVFn::info_relocs + fn->n_mvfns() * MVmvfn::info_relocs
+                    + fn->n_assigns() * MVassign::info_relocs
+                    + fn->n_callsites() * MVPP::info_relocs;
+        }
+        for (auto& v : vars) {
+            if (!all && v->frozen)
+                continue;
+            m.bytes += sizeof(mv_info_var);
+            if (fpic)
+                m.relocs += MVVar::info_relocs;
+        }
+        return m;
+    };
+    auto before = meta(true);
+    auto after = meta(false);
+
+    cout << ANSI_COLOR_YELLOW "Estimate:\n" ANSI_COLOR_RESET
+         << "\tfunctions frozen: " << dec << total.fns << "/" << fns.size() << "\n"
+         << "\tcallsites: ";
+    print_savings(total);
+    cout << "\tjmp trampolines: " << total.jumps << "\n"
+         << "\tguarded: 0x" << hex << total.guarded << " bytes\n"
+         << "\tmetadata: 0x" << before.bytes << " -> 0x" << after.bytes << " bytes\n"
+         << "\trelocations: " << dec << before.relocs << " -> " << after.relocs << "\n";
+
+    cout << ANSI_COLOR_YELLOW "Variables:\n" ANSI_COLOR_RESET;
+    for (auto& v : vars) {
+        if (!v->frozen)
+            continue;
+        Savings s;
+        for (auto fn : v->functions())
+            s.add(fn_savings[fn]);
+        cout << "\t" << v->name() << "=" << dec << v->value() << ": "
+             << s.fns << "/" << v->functions().size() << " fns, ";
+        print_savings(s);
+    }
+
+    cout << ANSI_COLOR_YELLOW "Functions:\n" ANSI_COLOR_RESET;
+    for (auto& fn : fns) {
+        auto& s = fn_savings[fn.get()];
+        if (s.fns == 0)
+            continue;
+        cout << "\t" << fn->get_name() << ": guarded 0x" << hex << s.guarded << ", ";
+        print_savings(s);
+    }
+
+    reset();
+}
@@ -0,0 +1,309 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <cstring>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+/*
+ * Read-only model for enumeration: per function the variants that can
+ * be chosen by the explored variables, with the effect of choosing them
+ * precomputed.
+ */
+struct xvariant {
+    Savings savings;
+    uint64_t code;
+};
+
+struct xfn {
+    size_t ndx;              // in fns
+    vector<unsigned> xvars;  // explored vars its variants depend on
+    vector<int> variant_of;  // model variant -> variants, -1: never chosen
+    vector<xvariant> variants;
+    unsigned dyn_pps;  // not frozen: patchpoints stay dynamic
+    uint64_t dyn_code; //             generic & all variants live
+};
+
+/* higher cycles & inlined, lower dyn_pps & code is better */
+struct xscore {
+    int64_t cycles = 0;
+    unsigned inlined = 0;
+    unsigned dyn_pps = 0;
+    uint64_t code = 0;
+
+    bool dominates(const xscore &o) const {
+        return cycles >= o.cycles && inlined >= o.inlined
+            && dyn_pps <= o.dyn_pps && code <= o.code
+            && tie(cycles, inlined, o.dyn_pps, o.code) != tie(o.cycles, o.inlined, dyn_pps, code);
+    }
+};
+
+struct xresult {
+    uint64_t index;  // first config with this selection
+    uint64_t count;  // configs with identical selection
+    xscore score;
+
+    void add(const xresult &o) {
+        count *= o.count;
+        score.cycles += o.score.cycles;
+        score.inlined += o.score.inlined;
+        score.dyn_pps += o.score.dyn_pps;
+        score.code += o.score.code;
+    }
+};
+
+/* functions sharing explored vars, enumerated independently */
+struct xgroup {
+    vector<unsigned> xvars;  // in xvars
+    vector<unsigned> xfns;   // in xfns
+    uint64_t space = 1;
+    vector<xresult> pareto;  // index: config of xvars
+};
+
+/* not dominated by another one, ties stay */
+static vector<xresult> pareto_of(vector<xresult> results) {
+    sort(results.begin(), results.end(), [](auto& a, auto& b) {
+            return tie(b.score.cycles, b.score.inlined, a.score.dyn_pps, a.score.code, a.index)
+                < tie(a.score.cycles, a.score.inlined, b.score.dyn_pps, b.score.code, b.index); });
+    vector<xresult> pareto;
+    for (auto& r : results)
+        if (none_of(pareto.cbegin(), pareto.cend(), [&](auto& p) { return p.score.dominates(r.score); }))
+            pareto.push_back(r);
+    return pareto;
+}
+
+/**
+ * Enumerate the value combinations of the selected variables (-a/-A)
+ * and print the pareto-optimal selections. Functions fall into groups
+ * sharing no explored variable; scores add up over groups, so each group
+ * is enumerated on its own, reduced to its pareto set and only those
+ * are combined. Selections identical for every function are grouped.
+ */
+void Bintail::explore(const Config &cfg, const CostTable &costs, unsigned threads) {
+    /* explored vars & their domains (values named by assignments) */
+    vector<MVVar*> xvars;
+    vector<unsigned> xpos; // in vars
+    map<MVVar*, unsigned> xndx;
+    vector<int64_t> model_values(vars.size());
+    vector<bool> frozen(vars.size());
+    for (auto i=0u; i < vars.size(); i++) {
+        auto& v = vars[i];
+        model_values[i] = v->value();
+        if (cfg.apply_all || find(cfg.apply.cbegin(), cfg.apply.cend(), v->name()) != cfg.apply.cend()) {
+            xndx[v.get()] = xvars.size();
+            xvars.push_back(v.get());
+            xpos.push_back(i);
+            frozen[i] = true;
+        }
+    }
+    vector<vector<int64_t>> domains(xvars.size());
+
+    vector<xfn> xfns;
+    for (auto n=0u; n < fns.size(); n++) {
+        auto& fn = fns[n];
+        xfn f;
+        f.ndx = n;
+        f.dyn_pps = fn->n_pps();
+        f.dyn_code = fn->size();
+        for (auto& m : fn->variants()) {
+            f.dyn_code += m->size();
+            xvariant xv;
+            auto explored = true;
+            for (auto& a : m->get_assigns()) {
+                auto it = xndx.find(a->var);
+                if (a->var == nullptr || it == xndx.end()) {
+                    explored = false;
+                    break;
+                }
+                domains[it->second].push_back(a->lower());
+                f.xvars.push_back(it->second);
+            }
+            f.variant_of.push_back(explored ? f.variants.size() : -1);
+            if (!explored)
+                continue; // needs a dynamic variable, never chosen
+            fn->estimate(m.get(), xv.savings, costs, &text);
+            xv.code = m->size() + 5;
+            f.variants.push_back(move(xv));
+        }
+        sort(f.xvars.begin(), f.xvars.end());
+        f.xvars.erase(unique(f.xvars.begin(), f.xvars.end()), f.xvars.end());
+        if (!f.variants.empty())
+            xfns.push_back(move(f));
+    }
+
+    uint64_t space = 1;
+    for (auto i=0u; i < xvars.size(); i++) {
+        auto& d = domains[i];
+        sort(d.begin(), d.end());
+        d.erase(unique(d.begin(), d.end()), d.end());
+        if (d.empty())
+            d.push_back(xvars[i]->value());
+        if (space > (1ul << 62) / d.size())
+            throw std::runtime_error("Configuration space too large");
+        space *= d.size();
+    }
+
+    /* union of the vars of each function */
+    vector<unsigned> root(xvars.size());
+    for (auto i=0u; i < root.size(); i++)
+        root[i] = i;
+    auto find_root = [&](unsigned v) {
+        while (root[v] != v)
+            v = root[v] = root[root[v]];
+        return v;
+    };
+    for (auto& f : xfns)
+        for (auto v : f.xvars)
+            root[find_root(v)] = find_root(f.xvars.front());
+    vector<xgroup> groups;
+    map<unsigned, size_t> group_of; // root -> groups
+    for (auto i=0u; i < xfns.size(); i++) {
+        auto& f = xfns[i];
+        if (f.xvars.empty()) { // no explored var, one selection
+            groups.emplace_back();
+            groups.back().xfns.push_back(i);
+            continue;
+        }
+        auto [it, fresh] = group_of.try_emplace(find_root(f.xvars.front()), groups.size());
+        if (fresh)
+            groups.emplace_back();
+        groups[it->second].xfns.push_back(i);
+    }
+    for (auto v=0u; v < xvars.size(); v++) {
+        auto it = group_of.find(find_root(v));
+        if (it == group_of.end())
+            continue; // no function depends on it
+        auto& g = groups[it->second];
+        g.xvars.push_back(v);
+        if (g.space > (1ul << 40) / domains[v].size())
+            throw std::runtime_error("Configuration space too large");
+        g.space *= domains[v].size();
+    }
+
+    /* values by index in vars, vars of group g */
+    auto decode = [&](const xgroup &g, uint64_t index, vector<int64_t> &values) {
+        for (auto v : g.xvars) {
+            values[xpos[v]] = domains[v][index % domains[v].size()];
+            index /= domains[v].size();
+        }
+    };
+    auto values_in = model_values; // outside of groups: first value
+    for (auto v=0u; v < xvars.size(); v++)
+        values_in[xpos[v]] = domains[v].front();
+
+    /* per group: enumerate in chunks, per thread grouping by selection */
+    auto& table = decisions();
+    const uint64_t chunk = 4096;
+    uint64_t distinct = 1;
+    for (auto& g : groups) {
+        atomic<uint64_t> next{0};
+        vector<unordered_map<string, xresult>> partial(max<uint64_t>(min<uint64_t>(threads,
+                        (g.space + chunk - 1) / chunk), 1));
+        auto work = [&](unsigned t) {
+            auto& sel = partial[t];
+            auto values = values_in;
+            vector<int> choice;
+            string sig(g.xfns.size() * sizeof(uint16_t), '\0');
+            for (uint64_t start; (start = next.fetch_add(chunk)) < g.space;) {
+                for (auto index = start; index < min(start + chunk, g.space); index++) {
+                    decode(g, index, values);
+                    table.resolve(values, frozen, choice);
+                    xscore score;
+                    for (auto i=0u; i < g.xfns.size(); i++) {
+                        auto& f = xfns[g.xfns[i]];
+                        /* 0 = dynamic, i+1 = variant i */
+                        uint16_t c = choice[f.ndx] < 0 ? 0 : f.variant_of[choice[f.ndx]] + 1;
+                        memcpy(&sig[i * sizeof(c)], &c, sizeof(c));
+                        if (c == 0) {
+                            score.dyn_pps += f.dyn_pps;
+                            score.code += f.dyn_code;
+                            continue;
+                        }
+                        auto& v = f.variants[c-1];
+                        score.cycles += v.savings.cycles;
+                        score.inlined += v.savings.nops + v.savings.consts + v.savings.irqs;
+                        score.code += v.code;
+                    }
+                    auto [it, fresh] = sel.try_emplace(sig, xresult{index, 1, score});
+                    if (!fresh)
+                        it->second.count++;
+                }
+            }
+        };
+        vector<thread> pool;
+        for (auto t=1u; t < partial.size(); t++)
+            pool.emplace_back(work, t);
+        work(0);
+        for (auto& t : pool)
+            t.join();
+
+        /* merge, keep lowest index for a deterministic representative */
+        auto& sel = partial[0];
+        for (auto t=1u; t < partial.size(); t++)
+            for (auto& [sig, r] : partial[t]) {
+                auto [it, fresh] = sel.try_emplace(sig, r);
+                if (fresh)
+                    continue;
+                it->second.index = min(it->second.index, r.index);
+                it->second.count += r.count;
+            }
+        vector<xresult> results;
+        for (auto& [sig, r] : sel)
+            results.push_back(r);
+        distinct *= results.size();
+        g.pareto = pareto_of(move(results));
+    }
+
+    /* combine group pareto sets, pruned after each group */
+    auto free_space = space; // vars no function depends on
+    for (auto& g : groups)
+        free_space /= g.space;
+    struct combined {
+        xresult r;
+        vector<uint64_t> index; // per group
+    };
+    vector<combined> pareto{ {xresult{0, free_space, {}}, {}} };
+    for (auto& g : groups) {
+        vector<combined> next;
+        for (auto& c : pareto)
+            for (auto& r : g.pareto) {
+                auto n = c;
+                n.r.add(r);
+                n.index.push_back(r.index);
+                next.push_back(move(n));
+            }
+        pareto.clear();
+        for (auto& n : next)
+            if (none_of(next.cbegin(), next.cend(), [&](auto& o) { return o.r.score.dominates(n.r.score); }))
+                pareto.push_back(move(n));
+    }
+    sort(pareto.begin(), pareto.end(), [](auto& a, auto& b) {
+            return tie(b.r.score.cycles, b.r.score.inlined, a.r.score.dyn_pps, a.r.score.code, a.index)
+                < tie(a.r.score.cycles, a.r.score.inlined, b.r.score.dyn_pps, b.r.score.code, b.index); });
+
+    cout << ANSI_COLOR_YELLOW "Explored " << dec << space << " configurations of "
+         << xvars.size() << " variables, " << distinct << " distinct, "
+         << pareto.size() << " pareto-optimal:\n" ANSI_COLOR_RESET;
+    for (auto& c : pareto) {
+        auto values = values_in;
+        for (auto g=0u; g < groups.size(); g++)
+            decode(groups[g], c.index[g], values);
+        cout << "\t";
+        for (auto i=0u; i < xvars.size(); i++)
+            cout << xvars[i]->name() << "=" << values[xpos[i]] << " ";
+        auto& r = c.r;
+        cout << " cycles=" << r.score.cycles << " inlined=" << r.score.inlined
+             << " dynamic_pps=" << r.score.dyn_pps << " code=0x" << hex << r.score.code << dec;
+        if (r.count > 1)
+            cout << "  (+" << r.count - 1 << " equivalent)";
+        cout << "\n";
+    }
+}
@@ -0,0 +1,224 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cpuid.h>
+#include <dirent.h>
+
+#include "facts.h"
+
+using namespace std;
+
+//---------------------cpuid---------------------------------------------------
+enum : uint8_t { EAX, EBX, ECX, EDX };
+enum : uint8_t { OS_NONE, OS_AVX, OS_AVX512, OS_AMX }; // XCR0 state required
+
+static const struct feature {
+    const char *name;
+    uint32_t leaf, sub;
+    uint8_t reg, bit, os;
+} features[] = {
+    { "tsc",        1, 0, EDX,  4 }, { "cmov",       1, 0, EDX, 15 },
+    { "sse",        1, 0, EDX, 25 }, { "sse2",       1, 0, EDX, 26 },
+    { "pni",        1, 0, ECX,  0 }, { "pclmulqdq",  1, 0, ECX,  1 },
+    { "ssse3",      1, 0, ECX,  9 }, { "fma",        1, 0, ECX, 12, OS_AVX },
+    { "cx16",       1, 0, ECX, 13 }, { "sse4_1",     1, 0, ECX, 19 },
+    { "sse4_2",     1, 0, ECX, 20 }, { "movbe",      1, 0, ECX, 22 },
+    { "popcnt",     1, 0, ECX, 23 }, { "aes",        1, 0, ECX, 25 },
+    { "xsave",      1, 0, ECX, 26 }, { "avx",        1, 0, ECX, 28, OS_AVX },
+    { "f16c",       1, 0, ECX, 29, OS_AVX }, { "rdrand", 1, 0, ECX, 30 },
+    { "fsgsbase",   7, 0, EBX,  0 }, { "bmi1",       7, 0, EBX,  3 },
+    { "hle",        7, 0, EBX,  4 }, { "avx2",       7, 0, EBX,  5, OS_AVX },
+    { "bmi2",       7, 0, EBX,  8 }, { "erms",       7, 0, EBX,  9 },
+    { "invpcid",    7, 0, EBX, 10 }, { "rtm",        7, 0, EBX, 11 },
+    { "avx512f",    7, 0, EBX, 16, OS_AVX512 }, { "avx512dq", 7, 0, EBX, 17, OS_AVX512 },
+    { "rdseed",     7, 0, EBX, 18 }, { "adx",        7, 0, EBX, 19 },
+    { "avx512ifma", 7, 0, EBX, 21, OS_AVX512 }, { "clflushopt", 7, 0, EBX, 23 },
+    { "clwb",       7, 0, EBX, 24 }, { "avx512cd",   7, 0, EBX, 28, OS_AVX512 },
+    { "sha_ni",     7, 0, EBX, 29 }, { "avx512bw",   7, 0, EBX, 30, OS_AVX512 },
+    { "avx512vl",   7, 0, EBX, 31, OS_AVX512 },
+    { "avx512vbmi", 7, 0, ECX,  1, OS_AVX512 }, { "umip", 7, 0, ECX,  2 },
+    { "pku",        7, 0, ECX,  3 }, { "waitpkg",    7, 0, ECX,  5 },
+    { "avx512_vbmi2", 7, 0, ECX, 6, OS_AVX512 }, { "gfni", 7, 0, ECX,  8 },
+    { "vaes",       7, 0, ECX,  9, OS_AVX }, { "vpclmulqdq", 7, 0, ECX, 10, OS_AVX },
+    { "avx512_vnni", 7, 0, ECX, 11, OS_AVX512 }, { "avx512_bitalg", 7, 0, ECX, 12, OS_AVX512 },
+    { "avx512_vpopcntdq", 7, 0, ECX, 14, OS_AVX512 }, { "rdpid", 7, 0, ECX, 22 },
+    { "movdiri",    7, 0, ECX, 27 }, { "movdir64b",  7, 0, ECX, 28 },
+    { "serialize",  7, 0, EDX, 14 }, { "amx_bf16",   7, 0, EDX, 22, OS_AMX },
+    { "amx_tile",   7, 0, EDX, 24, OS_AMX }, { "amx_int8", 7, 0, EDX, 25, OS_AMX },
+    { "lahf_lm",    0x80000001, 0, ECX,  0 }, { "abm",   0x80000001, 0, ECX,  5 },
+    { "sse4a",      0x80000001, 0, ECX,  6 }, { "3dnowprefetch", 0x80000001, 0, ECX, 8 },
+    { "xop",        0x80000001, 0, ECX, 11, OS_AVX }, { "fma4", 0x80000001, 0, ECX, 16, OS_AVX },
+    { "tbm",        0x80000001, 0, ECX, 21 }, { "syscall", 0x80000001, 0, EDX, 11 },
+    { "nx",         0x80000001, 0, EDX, 20 }, { "pdpe1gb", 0x80000001, 0, EDX, 26 },
+    { "rdtscp",     0x80000001, 0, EDX, 27 }, { "lm",    0x80000001, 0, EDX, 29 },
+};
+
+static uint64_t xcr0() {
+    uint32_t lo, hi;
+    asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return uint64_t(hi) << 32 | lo;
+}
+
+void CpuidFacts::collect(Facts &facts) {
+    if (cpuinfo != nullptr) {
+        ifstream in{cpuinfo};
+        if (!in)
+            throw std::runtime_error("open "s + cpuinfo + " failed.");
+        string line, flag;
+        while (getline(in, line) && line.compare(0, 5, "flags") != 0)
+            ;
+        if (!in || line.find(':') == string::npos)
+            throw std::runtime_error("No flags in "s + cpuinfo);
+        istringstream flags{line.substr(line.find(':') + 1)};
+        vector<string> have;
+        while (flags >> flag)
+            have.push_back(flag);
+        for (auto& f : features)
+            facts["has_"s + f.name] = find(have.cbegin(), have.cend(), f.name) != have.cend();
+        return;
+    }
+
+    uint32_t r[4];
+    auto max_std = __get_cpuid_max(0, nullptr);
+    auto max_ext = __get_cpuid_max(0x80000000, nullptr);
+    __cpuid(1, r[EAX], r[EBX], r[ECX], r[EDX]);
+    auto xcr = (r[ECX] & bit_OSXSAVE) ? xcr0() : 0;
+    for (auto& f : features) {
+        auto max = f.leaf & 0x80000000 ? max_ext : max_std;
+        auto on = false;
+        if (f.leaf <= max) {
+            __cpuid_count(f.leaf, f.sub, r[EAX], r[EBX], r[ECX], r[EDX]);
+            on = r[f.reg] & (1u << f.bit);
+        }
+        switch (f.os) {
+        case OS_AVX:    on = on && (xcr & 0x06) == 0x06; break;
+        case OS_AVX512: on = on && (xcr & 0xe6) == 0xe6; break;
+        case OS_AMX:    on = on && (xcr & 0x60000) == 0x60000; break;
+        }
+        facts["has_"s + f.name] = on;
+    }
+}
+
+//---------------------/proc & /sys-------------------------------------------
+static bool read_line(const string &path, string &line) {
+    ifstream in{path};
+    return in && getline(in, line);
+}
+
+/* "0-3,8,10-11" */
+static int count_list(const string &list) {
+    int n = 0, lo, hi;
+    char sep;
+    istringstream in{list};
+    while (in >> lo) {
+        hi = lo;
+        if (in.peek() == '-')
+            in >> sep >> hi;
+        n += hi - lo + 1;
+        in >> sep; // ','
+    }
+    return n;
+}
+
+void SysFacts::collect(Facts &facts) {
+    string line;
+    if (read_line(root + "/sys/devices/system/cpu/online", line)) {
+        facts["ncpus"] = count_list(line);
+        facts["smp"] = facts["ncpus"] > 1;
+    }
+    facts["numa_nodes"] = read_line(root + "/sys/devices/system/node/online", line)
+        ? count_list(line) : 1;
+    if (read_line(root + "/proc/sys/kernel/osrelease", line)) {
+        int major = 0, minor = 0;
+        char dot;
+        istringstream{line} >> major >> dot >> minor;
+        facts["kernel_major"] = major;
+        facts["kernel_minor"] = minor;
+    }
+    if (read_line(root + "/sys/kernel/mm/transparent_hugepage/enabled", line))
+        facts["thp"] = line.find("[always]") != string::npos ? 2
+            : line.find("[madvise]") != string::npos ? 1 : 0;
+
+    auto vdir = root + "/sys/devices/system/cpu/vulnerabilities";
+    if (auto d = opendir(vdir.c_str())) {
+        while (auto e = readdir(d)) {
+            if (e->d_name[0] == '.' || !read_line(vdir + "/" + e->d_name, line))
+                continue;
+            facts["vuln_"s + e->d_name] = line.compare(0, 12, "Not affected") != 0;
+        }
+        closedir(d);
+    }
+}
+
+//---------------------env file-----------------------------------------------
+void EnvFileFacts::collect(Facts &facts) {
+    ifstream in{path};
+    if (!in)
+        throw std::runtime_error("open " + path + " failed.");
+    string line;
+    while (getline(in, line)) {
+        auto start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+            continue;
+        if (line.compare(start, 7, "export ") == 0)
+            start += 7;
+        auto eq = line.find('=', start);
+        if (eq == string::npos)
+            continue;
+        auto name = line.substr(start, eq - start);
+        auto value = line.substr(eq + 1);
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        if (value.size() >= 2 && (value[0] == '"' || value[0] == '\'') && value.back() == value[0])
+            value = value.substr(1, value.size() - 2);
+
+        if (value == "yes" || value == "true" || value == "on") {
+            facts[name] = 1;
+        } else if (value == "no" || value == "false" || value == "off") {
+            facts[name] = 0;
+        } else {
+            size_t end;
+            try {
+                auto n = stoi(value, &end, 0);
+                if (end == value.size() && n >= 0)
+                    facts[name] = n;
+            } catch (const std::logic_error&) { } // e.g. PATH
+        }
+    }
+}
+
+//---------------------config-------------------------------------------------
+void auto_config(Config &cfg, const vector<unique_ptr<FactProvider>> &providers,
+        const char *map_file) {
+    Facts facts;
+    for (auto& p : providers)
+        p->collect(facts);
+
+    map<string, string> bind; // var -> fact
+    for (auto& [fact, value] : facts)
+        bind[fact] = fact;
+    if (map_file != nullptr) {
+        ifstream in{map_file};
+        if (!in)
+            throw std::runtime_error("open "s + map_file + " failed.");
+        string line, var, fact;
+        while (getline(in, line)) {
+            istringstream l{line};
+            if (!(l >> var) || var[0] == '#')
+                continue;
+            if (!(l >> fact))
+                throw std::runtime_error("Map file: no fact for " + var);
+            if (facts.count(fact) == 0)
+                throw std::runtime_error("Map file: unknown fact " + fact + " for " + var);
+            bind[var] = fact;
+        }
+    }
+
+    /* before the explicit options, last -s wins */
+    vector<pair<string, int64_t>> changes;
+    for (auto& [var, fact] : bind) {
+        changes.push_back({var, facts[fact]});
+        cfg.apply.push_back(var);
+    }
+    cfg.changes.insert(cfg.changes.begin(), changes.cbegin(), changes.cend());
+}
@@ -0,0 +1,62 @@
+#ifndef __FACTS_H
+#define __FACTS_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bintail/bintail.h>
+
+/* Facts about the host, name -> value */
+using Facts = std::map<std::string, int>;
+
+class FactProvider {
+public:
+    virtual ~FactProvider() = default;
+    virtual void collect(Facts &facts) = 0;
+};
+
+/*
+ * CPU features as has_<flag>, flags named as in /proc/cpuinfo. Read with
+ * cpuid (masked by OS support) or from the "flags" line of a cpuinfo
+ * fixture.
+ */
+class CpuidFacts : public FactProvider {
+public:
+    CpuidFacts(const char *cpuinfo = nullptr) :cpuinfo{cpuinfo} { }
+    void collect(Facts &facts);
+private:
+    const char *cpuinfo;
+};
+
+/*
+ * Kernel facts from /proc and /sys below root: ncpus, smp, numa_nodes,
+ * kernel_major, kernel_minor, thp (0 never, 1 madvise, 2 always) and
+ * vuln_<name> per /sys/devices/system/cpu/vulnerabilities entry.
+ */
+class SysFacts : public FactProvider {
+public:
+    SysFacts(const std::string &root = "") :root{root} { }
+    void collect(Facts &facts);
+private:
+    std::string root;
+};
+
+/* NAME=VALUE lines, non-negative numbers or yes/no/true/false/on/off */
+class EnvFileFacts : public FactProvider {
+public:
+    EnvFileFacts(const std::string &path) :path{path} { }
+    void collect(Facts &facts);
+private:
+    std::string path;
+};
+
+/*
+ * Set & apply every variable named like a fact, later providers win.
+ * Map file lines "var fact" bind other variable names. Explicit -s
+ * options keep precedence.
+ */
+void auto_config(Config &cfg, const std::vector<std::unique_ptr<FactProvider>> &providers,
+        const char *map_file);
+#endif
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <elf.h>
+
+#include "fleet.h"
+
+using namespace std;
+
+static bool is_elf(const string &path) {
+    char magic[SELFMAG];
+    int fd;
+    if ((fd = open(path.c_str(), O_RDONLY)) == -1)
+        return false;
+    auto elf = read(fd, magic, SELFMAG) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    close(fd);
+    return elf;
+}
+
+/* mkdir -p of the directory part */
+static void make_parents(const string &path) {
+    for (auto pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos+1))
+        if (mkdir(path.substr(0, pos).c_str(), 0755) == -1 && errno != EEXIST)
+            throw std::runtime_error("mkdir "s + path.substr(0, pos) + " failed. " + strerror(errno));
+}
+
+Fleet::Fleet(const char *manifest, unsigned workers, uint64_t _in_flight)
+    :in_flight{_in_flight} {
+    for (auto i=0u; i < max(workers, 1u); i++)
+        queues.push_back(make_unique<Queue>());
+
+    ifstream in{manifest};
+    if (!in)
+        throw std::runtime_error("open "s + manifest + " failed.");
+    string line;
+    for (auto nr = 1u; getline(in, line); nr++) {
+        line = line.substr(0, line.find('#'));
+        try {
+            Config cfg;
+            auto args = cfg.parse(line);
+            if (args.empty())
+                continue;
+            if (args.size() != 2)
+                throw std::runtime_error("Expected infile outfile");
+            struct stat st;
+            if (stat(args[0].c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                add_tree(cfg, args[0], args[1]);
+            else
+                add(cfg, args[0], args[1]);
+        } catch (const std::exception &e) {
+            throw std::runtime_error(manifest + ":"s + to_string(nr) + ": " + e.what());
+        }
+    }
+}
+
+/* Round robin, stealing evens out the rest */
+void Fleet::add(const Config &cfg, const string &in, const string &out) {
+    struct stat st;
+    auto size = stat(in.c_str(), &st) == 0 ? st.st_size : 0;
+    queues[n_jobs++ % queues.size()]->jobs.push_back({cfg, in, out, uint64_t(size)});
+}
+
+void Fleet::add_tree(const Config &cfg, const string &in, const string &out) {
+    auto d = opendir(in.c_str());
+    if (d == nullptr)
+        throw std::runtime_error("opendir "s + in + " failed. " + strerror(errno));
+    while (auto e = readdir(d)) {
+        if (e->d_name == "."s || e->d_name == ".."s)
+            continue;
+        auto path = in + "/" + e->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            add_tree(cfg, path, out + "/" + e->d_name);
+        else if (S_ISREG(st.st_mode) && is_elf(path))
+            add(cfg, path, out + "/" + e->d_name);
+    }
+    closedir(d);
+}
+
+/* Own queue first, then the back of the others */
+bool Fleet::take(unsigned self, Job &job) {
+    for (auto i=0u; i < queues.size(); i++) {
+        auto& q = *queues[(self + i) % queues.size()];
+        lock_guard<mutex> l{q.lock};
+        if (q.jobs.empty())
+            continue;
+        if (i == 0) {
+            job = move(q.jobs.front());
+            q.jobs.pop_front();
+        } else {
+            job = move(q.jobs.back());
+            q.jobs.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void Fleet::tailor(const Job &job) {
+    make_parents(job.outfile);
+    Bintail bintail{job.infile.c_str()};
+    bintail.init_write(job.outfile.c_str(), job.cfg.drops_info());
+    bintail.apply_config(job.cfg);
+    bintail.write(job.cfg.undo, job.cfg.huge_text);
+}
+
+void Fleet::worker(unsigned self) {
+    Job job;
+    while (take(self, job)) {
+        {
+            unique_lock<mutex> l{mem_lock};
+            mem_cv.wait(l, [&] { return used == 0 || used + job.size <= in_flight; });
+            used += job.size;
+        }
+        auto start = chrono::steady_clock::now();
+        string error;
+        try {
+            tailor(job);
+        } catch (const std::exception &e) {
+            error = e.what();
+        }
+        auto usec = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+        {
+            lock_guard<mutex> l{mem_lock};
+            used -= job.size;
+        }
+        mem_cv.notify_all();
+
+        lock_guard<mutex> l{out_lock};
+        if (!error.empty())
+            failed = true;
+        cout << (error.empty() ? "ok " : "error ") << usec << " " << job.infile
+             << " " << job.outfile << (error.empty() ? "" : " ") << error << endl;
+    }
+}
+
+int Fleet::run() {
+    vector<thread> pool;
+    for (auto i=1u; i < queues.size(); i++)
+        pool.emplace_back(&Fleet::worker, this, i);
+    worker(0);
+    for (auto& t : pool)
+        t.join();
+    return failed ? 1 : 0;
+}
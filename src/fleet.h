@@ -0,0 +1,60 @@
+#ifndef __FLEET_H
+#define __FLEET_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <bintail/bintail.h>
+
+/*
+ * Tailor many binaries from a manifest.
+ *
+ * One job per line, same syntax as a daemon request:
+ *   [-s var=value] [-a var] [-A] [-g] [-u] [-H] infile outfile
+ * An infile directory stands for every ELF file below it, tailored to the
+ * same relative path below outfile. Blank lines & '#' comments are
+ * skipped. Each worker takes jobs from the front of its own queue and
+ * steals from the back of the others. Inputs being tailored add up to
+ * at most in_flight bytes (one is always allowed). One line per file:
+ *   ok|error <usec> infile outfile [message]
+ */
+class Fleet {
+public:
+    Fleet(const char *manifest, unsigned workers, uint64_t in_flight);
+    int run(); // 1 if any file failed
+
+private:
+    struct Job {
+        Config cfg;
+        std::string infile;
+        std::string outfile;
+        uint64_t size;
+    };
+    struct Queue {
+        std::mutex lock;
+        std::deque<Job> jobs;
+    };
+
+    void add(const Config &cfg, const std::string &in, const std::string &out);
+    void add_tree(const Config &cfg, const std::string &in, const std::string &out);
+    bool take(unsigned self, Job &job);
+    void tailor(const Job &job);
+    void worker(unsigned self);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    size_t n_jobs = 0;
+
+    uint64_t in_flight;
+    uint64_t used = 0;
+    std::mutex mem_lock;
+    std::condition_variable mem_cv;
+
+    std::mutex out_lock;
+    bool failed = false;
+};
+#endif
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <gelf.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+#include "x86len.h"
+
+using namespace std;
+
+/*
+ * Body with address dependent operands replaced by their targets: an
+ * offset for targets inside, the absolute address for the rest. Equal
+ * keys are interchangeable bodies. Empty if it does not decode.
+ */
+static string body_key(const uint8_t *op, size_t size, uint64_t vaddr) {
+    string key;
+    for (size_t off = 0; off < size;) {
+        x86_insn insn;
+        if (x86_insn_decode(op + off, size - off, insn) == 0)
+            return {};
+        auto fix = insn.rel_size ? insn.rel_off : insn.rip_off;
+        if (fix == 0) {
+            key.append(reinterpret_cast<const char*>(op + off), insn.len);
+        } else {
+            auto fix_sz = insn.rel_size == 1 ? 1 : 4;
+            int64_t disp = fix_sz == 1 ? int8_t(op[off+fix])
+                : *reinterpret_cast<const int32_t*>(op + off + fix);
+            int64_t target = off + insn.len + disp;
+            auto inside = target >= 0 && target < int64_t(size);
+            uint64_t value = inside ? target : vaddr + target;
+            key.append(reinterpret_cast<const char*>(op + off), fix);
+            key.push_back(inside ? 'i' : 'a');
+            key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            key.append(reinterpret_cast<const char*>(op + off + fix + fix_sz),
+                    insn.len - fix - fix_sz);
+        }
+        off += insn.len;
+    }
+    return key;
+}
+
+/**
+ * Identical code folding of variants within a function: duplicates use
+ * the first body, in mv_info_mvfn, patched callsites & symbols. Their
+ * bodies are unreachable and guarded on apply. Variants with pointers
+ * from data or exported ones are left alone.
+ */
+void Bintail::fold_variants() {
+    unordered_set<uint64_t> referenced;
+    for (auto& r : rela_other)
+        if (r.r_info == R_X86_64_RELATIVE)
+            referenced.insert(r.r_addend);
+    for (auto& s : dynsyms)
+        if (s.sym.st_shndx != SHN_UNDEF)
+            referenced.insert(s.sym.st_value);
+
+    unordered_map<uint64_t, uint64_t> moved; // body -> kept body
+    for (auto& fn : fns) {
+        auto& vs = fn->variants();
+        auto& state = fold_cache[fn->get_name()];
+        if (!reuse_fold(fn.get(), state)) {
+            state.at.clear();
+            state.kept.clear();
+            unordered_map<string, size_t> bodies;
+            for (auto i=0u; i < vs.size(); i++) {
+                auto& m = vs[i];
+                state.at.push_back({m->location(), m->size()});
+                state.kept.push_back(i);
+                if (m->size() == 0)
+                    continue;
+                auto op = reinterpret_cast<const uint8_t*>(text.in_buf(m->location()));
+                auto key = body_key(op, m->size(), m->location());
+                if (!key.empty())
+                    state.kept[i] = bodies.emplace(move(key), i).first->second;
+            }
+        }
+        for (auto i=0u; i < vs.size(); i++) {
+            auto& m = vs[i];
+            auto kept = vs[state.kept[i]]->location();
+            if (kept == m->location() || referenced.count(m->location()))
+                continue;
+            folded.push_back({m->location(), m->size(), fn.get()});
+            moved[m->location()] = kept;
+            m->mvfn.function_body = kept;
+        }
+    }
+
+    for (auto& s : syms) {
+        auto it = moved.find(s.sym.st_value);
+        if (it != moved.end() && GELF_ST_TYPE(s.sym.st_info) == STT_FUNC)
+            s.sym.st_value = it->second;
+    }
+    if (!folded.empty())
+        cerr << " folded=" << folded.size() << " ";
+}
+
+/*
+ * Fold result of the previous model (watch) for an unchanged function:
+ * same variant bodies, all moved by the same distance. Their targets
+ * outside moved alike, equal keys stay equal.
+ */
+bool Bintail::reuse_fold(MVFn *fn, fold_state &state) {
+    if (prev_model == nullptr)
+        return false;
+    auto it = prev_model->fold_cache.find(fn->get_name());
+    if (it == prev_model->fold_cache.end())
+        return false;
+    auto& prev = it->second;
+    auto& vs = fn->variants();
+    if (prev.at.size() != vs.size())
+        return false;
+    for (auto i=0u; i < vs.size(); i++) {
+        auto& m = vs[i];
+        auto [at, size] = prev.at[i];
+        if (size != m->size() || m->location() - at != vs[0]->location() - prev.at[0].first
+                || memcmp(prev_model->text.in_buf(at), text.in_buf(m->location()), size) != 0)
+            return false;
+    }
+    state.at.clear();
+    for (auto& m : vs)
+        state.at.push_back({m->location(), m->size()});
+    state.kept = prev.kept;
+    reused_fns++;
+    return true;
+}
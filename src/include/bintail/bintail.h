@@ -22,6 +22,9 @@ class MVVar;
 class MVFn;
 class MVPP;
 class MVData;
+class MVmvfn;
+class ModelWriter;
+class UndoNote;
 
 const GElf_Rela make_rela(uint64_t source, uint64_t target);
 
@@ -62,14 +65,40 @@ protected:
     uint64_t max_size;
 };
 
+/*
+ * Info section, generated in two phases: layout() assigns every element
+ * its offset & relocation slots, fill() writes a range of them (chunks
+ * may run in parallel), finish() sets the shdr & start/stop ptrs.
+ */
 class MVSection : public Section {
 public:
     bool probe_rela(GElf_Rela *rela);
+    bool claim_rela(const GElf_Rela &rela, std::vector<GElf_Rela> &owned);
+    virtual uint64_t layout(bool fpic, uint64_t offset, uint64_t vaddr) = 0;
+    void fill_slots(size_t from, size_t to); // thread safe, after layout
+    virtual void finish(Section *data);
+    void pad();
+    size_t n_slots() { return slots.size(); }
 
     uint64_t start_ptr;
     uint64_t stop_ptr;
 protected:
-    void add_data(MVData* );
+    struct slot {
+        MVData *e;
+        uint64_t off;    // in section
+        size_t rel;      // first index in relocs
+    };
+    void add_slot(MVData *e, uint64_t size, size_t n_relocs);
+    void end_layout();
+    virtual size_t fill_slot(const slot &s, std::byte *buf, GElf_Rela *rela);
+
+    std::vector<slot> slots;
+    bool fpic;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t size_out;
+    size_t n_relocs;
+    std::byte *buf_out = nullptr; // output buffer, by end_layout
 };
 
 class BssSection : public Section {
@@ -82,7 +111,7 @@ public:
 class MVFnSection : public MVSection {
 public:
     std::unique_ptr<std::vector<struct mv_info_fn>> read();
-    uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
+    uint64_t layout(bool fpic, uint64_t offset, uint64_t vaddr);
     bool is_needed(bool overr);
     void set_fns(std::vector<std::unique_ptr<MVFn>> *fns);
 private:
@@ -92,7 +121,7 @@ private:
 class MVVarSection : public MVSection {
 public:
     std::unique_ptr<std::vector<struct mv_info_var>> read();
-    uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
+    uint64_t layout(bool fpic, uint64_t offset, uint64_t vaddr);
     bool is_needed(bool overr);
     void set_vars(std::vector<std::shared_ptr<MVVar>> *vars);
 private:
@@ -102,7 +131,7 @@ private:
 class MVCsSection : public MVSection {
 public:
     std::unique_ptr<std::vector<struct mv_info_callsite>> read();
-    uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
+    uint64_t layout(bool fpic, uint64_t offset, uint64_t vaddr);
     bool is_needed(bool overr);
     void set_pps(std::vector<std::unique_ptr<MVPP>> *pps);
 private:
@@ -111,9 +140,12 @@ private:
 
 class MVDataSection : public MVSection {
 public:
-    uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr);
+    uint64_t layout(bool fpic, uint64_t offset, uint64_t vaddr);
+    void finish(Section *data);
     bool is_needed(bool overr);
     void set_fns(std::vector<std::unique_ptr<MVFn>> *fns);
+protected:
+    size_t fill_slot(const slot &s, std::byte *buf, GElf_Rela *rela);
 private:
     std::vector<std::unique_ptr<MVFn>> *fns;
 };
@@ -169,7 +201,7 @@ class InfoArea : public Area {
 public:
     InfoArea(Elf *e_out, bool fpic, MVDataSection *mvdata, MVVarSection *mvvar, 
             MVFnSection *mvfn, MVCsSection *mvcs, BssSection *bss);
-    uint64_t generate(Section *data);
+    uint64_t generate(Section *data, bool keep = false);
     void find_start_of_area();
     bool test_phdr(GElf_Phdr &phdr);
     uint64_t size_in_file();
@@ -180,11 +212,88 @@ private:
     MVFnSection *mvfn;
     MVCsSection *mvcs;
     BssSection *bss;
+    bool with_bss = false;
+};
+
+/* Tailoring request, equivalent to -s/-a/-A/-g/-u/-H */
+struct Config {
+    std::vector<std::pair<std::string, int64_t>> changes; // -s var=value
+    std::vector<std::string> apply;   // var
+    bool apply_all = false;
+    bool guard = true;
+    bool undo = false;
+    bool huge_text = false;
+
+    /* -A drops the info sections, unless -u keeps the input layout */
+    bool drops_info() const { return apply_all && !undo; }
+    /* consume options, return positional arguments */
+    std::vector<std::string> parse(const std::string &line);
+    /* same for equivalent option lists, for cache keys */
+    std::string canonical() const;
+};
+
+/* Cycles per instruction, for estimate */
+struct CostTable {
+    unsigned call = 3;
+    unsigned call_indirect = 5;
+    unsigned jmp = 2;
+    unsigned ret = 2;
+    unsigned nop = 0;
+    unsigned mov = 1;
+    unsigned cli = 5;
+    unsigned sti = 5;
+
+    void load(const char *file); // "insn cycles" per line
+};
+
+/* Findings of Bintail::verify */
+struct VerifyReport {
+    unsigned pps = 0;        // checked patchpoints
+    uint64_t guarded = 0;    // checked guard bytes
+    std::vector<std::string> errors;
+    std::vector<std::string> warnings;
+
+    bool ok() const { return errors.empty(); }
+};
+
+/*
+ * Variant selection of all functions, compiled from the model. The
+ * values of a variable are split at the bounds of its assignments; per
+ * function, variable & interval a bitset holds the variants allowing
+ * it, one more row those not constraining it (variable not frozen). The
+ * selection is the lowest bit of the AND of these rows, as in
+ * MVFn::select().
+ */
+class DecisionTable {
+public:
+    DecisionTable(const std::vector<std::shared_ptr<MVVar>> &vars,
+            const std::vector<std::unique_ptr<MVFn>> &fns);
+    /* values & frozen by index in vars, variant index per fn or -1 */
+    void resolve(const std::vector<int64_t> &values, const std::vector<bool> &frozen,
+            std::vector<int> &choice) const;
+    size_t n_vars() const { return bounds.size(); }
+    size_t n_fns() const { return fns.size(); }
+private:
+    struct term {
+        uint32_t var;
+        uint32_t rows;  // offset in bits
+    };
+    struct fn_entry {
+        uint32_t terms; // first in terms
+        uint32_t n_terms;
+        uint32_t words; // per row
+        uint32_t init;  // offset in bits, selectable at all
+    };
+    std::vector<std::vector<int64_t>> bounds; // per var, sorted
+    std::vector<fn_entry> fns;
+    std::vector<term> terms;
+    std::vector<uint64_t> bits;
 };
 
 class Bintail {
 public:
-    Bintail(const char *infile);
+    /* prev: model of an earlier build of infile, for reuse while loading */
+    Bintail(const char *infile, Bintail *prev = nullptr);
     ~Bintail();
 
     void print(); // Display mv_info_* structs in __multiverse_* section
@@ -192,14 +301,25 @@ public:
     void print_sym();
     void print_dyn();
     void print_vars();
+    void dump(ModelWriter &w); // machine readable print()
 
     void init_write(const char *outfile, bool del_scns);
-    void write();
-    void update_relocs_sym();
+    void init_write(int fd, bool del_scns);
+    void write(bool undo = false, bool huge_text = false);
+    void reset();
+    void update_relocs_sym(bool keep_size = false);
 
-    void change(std::string change_str);
+    void change(const std::string &var_name, int64_t value);
     void apply(std::string apply_str, bool guard);
     void apply_all(bool guard);
+    void apply_config(const Config &cfg);
+    void estimate(const Config &cfg, const CostTable &costs);
+    void explore(const Config &cfg, const CostTable &costs, unsigned threads);
+    VerifyReport verify(const Config &cfg, const char *outfile, unsigned threads);
+    void tailor_process(int pid, const Config &cfg); // infile: /proc/pid/exe
+    /* selected variant per fn (nullptr: stays dynamic), model untouched */
+    std::vector<MVmvfn*> resolve(const Config &cfg);
+    const DecisionTable& decisions();
 
     std::unique_ptr<InfoArea> mvinfo_area;
 
@@ -225,7 +345,43 @@ public:
 
     std::vector<GElf_Rela> rela_other;
     std::vector<symbol>  syms;
+    std::vector<symbol>  dynsyms;
+
+    std::string provenance; // of restored input
+    /* same model for a relinked infile, see same_model() */
+    bool relink(const char *infile);
+    size_t reused_fns = 0; // fold results taken from prev
 private:
+    void load();
+    void load_sections();
+    bool same_model(Elf *e);
+    void restore_input();
+    /* info word relocated against a defined dynamic symbol */
+    struct sym_word { uint64_t value; uint64_t r_info; int64_t r_addend; };
+    std::map<uint64_t, sym_word> resolve_local_syms(); // by vaddr
+    void link_imports();
+    void fold_variants();
+    /* per variant: body as loaded, index of the body it is folded to */
+    struct fold_state {
+        std::vector<std::pair<uint64_t, size_t>> at;
+        std::vector<size_t> kept;
+    };
+    bool reuse_fold(MVFn *fn, fold_state &state);
+    void gc_syms();
+    void freeze(const Config &cfg); // model only
+    void apply_frozen(bool guard);
+    void keep_tailored(bool guard);
+    void specialize_calls();
+    void retarget_fptrs();
+    uint64_t* out_word(uint64_t vaddr);
+    void layout();
+    void align_text(uint64_t align);
+    void add_undo_note();
+    std::vector<std::vector<uint32_t>> text_owners(
+            const std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+    Elf_Scn* add_section(const std::string &name, GElf_Word type, uint64_t align,
+            std::vector<std::byte> &&buf);
+
     /* Elf file */
     int infd, outfd;
     Elf *e_in, *e_out;
@@ -235,10 +391,43 @@ private:
     Elf_Scn *reloc_scn_out;
 
     Elf_Scn *symtab_scn;
+    Elf_Scn *symtab_scn_out;
 
     uint removed_scns;
 
     std::vector<struct sec> secs;
+    std::vector<std::pair<Elf_Scn*, Elf_Scn*>> scn_map; // in -> out
+    std::vector<std::vector<std::byte>> out_bufs;
+    std::unique_ptr<UndoNote> undo_in; // of a restored input
+    Elf_Scn *undo_scn_in = nullptr;
+    bool keep_pending = false; // keep_tailored on the next apply
+    std::vector<GElf_Rela> data_relocs_in;
+    std::vector<GElf_Rela> rela_other_in;
+    std::vector<symbol> syms_in;
+    bool guarded = false; // by the last apply
+    struct body { uint64_t location; size_t size; MVFn *fn; };
+    std::vector<body> folded; // duplicate variant bodies
+    std::map<std::string, fold_state> fold_cache; // by fn name
+    Bintail *prev_model; // during load only
+    std::vector<std::pair<uint64_t, MVFn*>> specialized; // call site, callee
     std::map<Elf_Scn*, Section*> scn_handler;
+    std::unique_ptr<DecisionTable> table; // by decisions()
+};
+
+/*
+ * Executable & its multiverse DSOs, found over DT_NEEDED in lib_path.
+ * Imported variables take the value of the defining module, one config
+ * tailors every module.
+ */
+class ModuleSet {
+public:
+    ModuleSet(const char *exe, const std::vector<std::string> &lib_path);
+    void print();
+    /* executable to outfile, DSOs by DT_NEEDED name to lib_out */
+    void write(const Config &cfg, const char *outfile, const std::string &lib_out);
+
+    std::vector<std::unique_ptr<Bintail>> modules;
+    std::vector<std::string> files;  // input per module
+    std::vector<std::string> needed; // DT_NEEDED name, "" for the executable
 };
 #endif
@@ -0,0 +1,314 @@
+#include <iostream>
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <gelf.h>
+
+#include <bintail/bintail.h>
+
+using namespace std;
+
+#ifndef DT_RELRSZ
+#define DT_RELRSZ 35
+#endif
+#ifndef DT_RELR
+#define DT_RELR 36
+#endif
+
+namespace {
+struct placed {
+    Elf_Scn *scn;  // nullptr if removed
+    GElf_Shdr in;  // as in the input
+    GElf_Shdr out; // sizes & generated addresses final
+    string name;
+    bool moved = false; // to the new PT_LOAD
+};
+}
+
+static bool is_tbss(const GElf_Shdr &shdr) {
+    return shdr.sh_type == SHT_NOBITS && (shdr.sh_flags & SHF_TLS);
+}
+
+/* Alloc sections within the memory of phdr, by input address */
+static vector<placed*> members(vector<placed> &scns, const GElf_Phdr &phdr) {
+    vector<placed*> in_phdr;
+    auto end = phdr.p_vaddr + phdr.p_memsz;
+    for (auto& s : scns) {
+        if (!(s.in.sh_flags & SHF_ALLOC) || (phdr.p_type == PT_LOAD && is_tbss(s.in)))
+            continue;
+        if (s.in.sh_addr >= phdr.p_vaddr && s.in.sh_addr + s.in.sh_size <= end
+                && (s.in.sh_size > 0 || s.in.sh_addr < end))
+            in_phdr.push_back(&s);
+    }
+    return in_phdr;
+}
+
+/*
+ * File & memory size of a phdr from its members, bytes behind the last
+ * member (not part of any section) are kept. Moved ones count as removed.
+ */
+static void resize(GElf_Phdr &phdr, const vector<placed*> &in_phdr) {
+    uint64_t in_file = 0, out_file = 0, in_mem = 0, out_mem = 0;
+    bool file = false;
+    for (auto s : in_phdr) {
+        auto in_end = s->in.sh_addr + s->in.sh_size - phdr.p_vaddr;
+        auto out_end = s->scn && !s->moved ? s->out.sh_addr + s->out.sh_size - phdr.p_vaddr : 0;
+        if (s->in.sh_type != SHT_NOBITS) {
+            in_file = max(in_file, in_end);
+            out_file = max(out_file, out_end);
+            file = true;
+        }
+        in_mem = max(in_mem, in_end);
+        out_mem = max(out_mem, out_end);
+    }
+    if (file && phdr.p_filesz >= in_file)
+        phdr.p_filesz = out_file + (phdr.p_filesz - in_file);
+    if (!in_phdr.empty() && phdr.p_memsz >= in_mem)
+        phdr.p_memsz = out_mem + (phdr.p_memsz - in_mem);
+}
+
+/**
+ * Place output sections once their sizes are final. Allocated sections
+ * keep their vaddr (bintail's own ones have been placed by their
+ * generators), segments take their size from the members and move down
+ * in the file as far as p_align allows. Other phdrs follow their
+ * PT_LOAD, non-alloc sections are packed behind the last segment and
+ * .dynamic pointers follow the tables they describe.
+ *
+ * A dynamic table (.rela.dyn, .dynsym, ...) growing into its neighbour
+ * moves to a new read-only PT_LOAD behind the others, only .dynamic
+ * refers to it. The phdr table grows in place, the sections behind it
+ * (.interp, notes, dynamic tables) make room by moving along, their
+ * PT_INTERP/PT_NOTE follow them. Other sections must not grow into
+ * their neighbour.
+ */
+void Bintail::layout() {
+    vector<placed> scns;
+    size_t shstrndx;
+    elf_getshdrstrndx(e_in, &shstrndx);
+    for (auto& [in, out] : scn_map) {
+        placed s;
+        s.scn = out;
+        gelf_getshdr(in, &s.in);
+        if (out != nullptr)
+            gelf_getshdr(out, &s.out);
+        s.name = elf_strptr(e_in, shstrndx, s.in.sh_name);
+        scns.push_back(s);
+    }
+
+    /* grown sections must not run into their neighbours */
+    vector<placed*> alloc;
+    for (auto& s : scns)
+        if (s.scn && (s.out.sh_flags & SHF_ALLOC) && !is_tbss(s.out) && s.out.sh_size > 0)
+            alloc.push_back(&s);
+    sort(alloc.begin(), alloc.end(), [](placed *a, placed *b) {
+        return a->out.sh_addr < b->out.sh_addr;
+    });
+    set<uint64_t> dyn_tables; // input vaddr
+    for (auto tag : { DT_RELA, DT_JMPREL, DT_RELR, DT_STRTAB, DT_SYMTAB, DT_HASH,
+            DT_GNU_HASH, DT_VERSYM, DT_VERDEF, DT_VERNEED }) {
+        auto ptr = dynamic.get_dyn(tag);
+        if (ptr.has_value())
+            dyn_tables.insert(ptr.value()->d_un.d_ptr);
+    }
+    auto movable = [&](const placed &s) {
+        return s.in.sh_type != SHT_NOBITS && (dyn_tables.count(s.in.sh_addr) != 0);
+    };
+    bool add_load = false;
+    for (auto i=1u; i < alloc.size(); i++) {
+        if (alloc[i-1]->out.sh_addr + alloc[i-1]->out.sh_size <= alloc[i]->out.sh_addr)
+            continue;
+        if (!movable(*alloc[i-1]))
+            throw std::runtime_error("Section " + alloc[i-1]->name + " grows into "
+                    + alloc[i]->name + ", only dynamic tables are moved");
+        alloc[i-1]->moved = add_load = true;
+    }
+
+    size_t phdr_num;
+    elf_getphdrnum(e_in, &phdr_num);
+    vector<GElf_Phdr> in_phdrs(phdr_num), phdrs(phdr_num);
+    vector<size_t> loads;
+    for (auto i=0u; i < phdr_num; i++) {
+        gelf_getphdr(e_in, i, &in_phdrs[i]);
+        phdrs[i] = in_phdrs[i];
+        if (phdrs[i].p_type == PT_LOAD)
+            loads.push_back(i);
+    }
+
+    /* one more phdr, sections right behind the table move out of its way */
+    if (add_load) {
+        auto table_end = ehdr_in.e_phoff + phdr_num * ehdr_in.e_phentsize;
+        for (auto& s : scns) {
+            if (!s.scn || !(s.in.sh_flags & SHF_ALLOC) || s.in.sh_type == SHT_NOBITS
+                    || s.in.sh_offset + s.in.sh_size <= table_end
+                    || s.in.sh_offset >= table_end + ehdr_in.e_phentsize)
+                continue;
+            if (!movable(s) && s.in.sh_type != SHT_NOTE && s.name != ".interp")
+                throw std::runtime_error("No room for another program header, "
+                        + s.name + " follows the table");
+            s.moved = true;
+        }
+    }
+
+    /* segments: sizes, then file offsets in file order */
+    for (auto i : loads)
+        resize(phdrs[i], members(scns, in_phdrs[i]));
+    if (add_load) {
+        GElf_Phdr p{};
+        p.p_type = PT_LOAD;
+        p.p_flags = PF_R;
+        for (auto i : loads) {
+            p.p_align = max(p.p_align, phdrs[i].p_align);
+            p.p_vaddr = max(p.p_vaddr, phdrs[i].p_vaddr + phdrs[i].p_memsz);
+        }
+        p.p_align = max<uint64_t>(p.p_align, 1);
+        p.p_vaddr = (p.p_vaddr + p.p_align-1) & ~(p.p_align-1);
+        p.p_paddr = p.p_vaddr;
+        auto vaddr = p.p_vaddr;
+        vector<placed*> moved;
+        for (auto& s : scns)
+            if (s.moved)
+                moved.push_back(&s);
+        sort(moved.begin(), moved.end(), [](placed *a, placed *b) {
+            return a->in.sh_addr < b->in.sh_addr;
+        });
+        for (auto s : moved) {
+            auto align = max<uint64_t>(s->out.sh_addralign, 1);
+            s->out.sh_addr = (vaddr + align-1) & ~(align-1);
+            vaddr = s->out.sh_addr + s->out.sh_size;
+        }
+        p.p_filesz = p.p_memsz = vaddr - p.p_vaddr;
+        loads.push_back(phdrs.size());
+        phdrs.push_back(p);
+        in_phdrs.push_back(p);
+        in_phdrs.back().p_offset = UINT64_MAX; // last in file
+        phdr_num++;
+        cerr << " moved=" << moved.size() << " ";
+    }
+    sort(loads.begin(), loads.end(), [&](size_t a, size_t b) {
+        return in_phdrs[a].p_offset < in_phdrs[b].p_offset;
+    });
+    uint64_t cursor = 0;
+    for (auto i : loads) {
+        auto& p = phdrs[i];
+        auto align = max<uint64_t>(p.p_align, 1);
+        if (i != loads.front()) // headers stay at 0
+            p.p_offset = cursor + ((p.p_vaddr - cursor) & (align-1));
+        cursor = max(cursor, p.p_offset + p.p_filesz);
+    }
+    auto by_vaddr = loads;
+    sort(by_vaddr.begin(), by_vaddr.end(), [&](size_t a, size_t b) {
+        return phdrs[a].p_vaddr < phdrs[b].p_vaddr;
+    });
+    for (auto i=1u; i < by_vaddr.size(); i++) {
+        auto& a = phdrs[by_vaddr[i-1]];
+        if (a.p_vaddr + a.p_memsz > phdrs[by_vaddr[i]].p_vaddr)
+            throw std::runtime_error("Segment grows into the next one");
+    }
+
+    /* offset of a vaddr, by the PT_LOAD it was in */
+    auto load_of = [&](uint64_t vaddr) -> GElf_Phdr* {
+        for (auto i : loads)
+            if (vaddr >= in_phdrs[i].p_vaddr && vaddr < in_phdrs[i].p_vaddr + in_phdrs[i].p_memsz)
+                return &phdrs[i];
+        return nullptr;
+    };
+    for (auto i=0u; i < phdr_num; i++) {
+        auto& p = phdrs[i];
+        if (p.p_type == PT_LOAD || (p.p_filesz == 0 && p.p_memsz == 0))
+            continue;
+        if (p.p_type == PT_PHDR)
+            p.p_filesz = p.p_memsz = phdr_num * ehdr_in.e_phentsize;
+        auto in_phdr = members(scns, in_phdrs[i]);
+        size_t n_moved = count_if(in_phdr.begin(), in_phdr.end(), [](placed *s) { return s->moved; });
+        if (n_moved != 0 && n_moved == in_phdr.size()) { // notes, interp: follow
+            auto start = UINT64_MAX, end = 0ul;
+            for (auto s : in_phdr) {
+                start = min(start, s->out.sh_addr);
+                end = max(end, s->out.sh_addr + s->out.sh_size);
+            }
+            p.p_vaddr = p.p_paddr = start;
+            p.p_filesz = p.p_memsz = end - start;
+            p.p_offset = start - phdrs[loads.back()].p_vaddr + phdrs[loads.back()].p_offset;
+            continue;
+        }
+        if (n_moved != 0 && p.p_type != PT_GNU_RELRO)
+            throw std::runtime_error("Program header partly moved, type "s + to_string(p.p_type));
+        auto load = load_of(p.p_vaddr);
+        if (load == nullptr)
+            continue;
+        p.p_offset = p.p_vaddr - load->p_vaddr + load->p_offset;
+        if (p.p_type != PT_PHDR)
+            resize(p, in_phdr);
+    }
+    if (add_load) {
+        gelf_newphdr(e_out, phdr_num);
+        ehdr_out.e_phnum = phdr_num;
+    }
+    for (auto i=0u; i < phdr_num; i++)
+        gelf_update_phdr(e_out, i, &phdrs[i]);
+
+    /* sections: alloc ones by vaddr, the rest behind the segments */
+    sort(scns.begin(), scns.end(), [](const placed &a, const placed &b) {
+        return a.in.sh_offset < b.in.sh_offset;
+    });
+    for (auto& s : scns) {
+        if (s.scn == nullptr)
+            continue;
+        if (s.moved) {
+            auto& load = phdrs[loads.back()];
+            s.out.sh_offset = s.out.sh_addr - load.p_vaddr + load.p_offset;
+        } else if (s.out.sh_flags & SHF_ALLOC) {
+            auto load = load_of(s.in.sh_addr);
+            if (load != nullptr)
+                s.out.sh_offset = s.out.sh_addr - load->p_vaddr + load->p_offset;
+        } else {
+            auto align = max<uint64_t>(s.out.sh_addralign, 1);
+            s.out.sh_offset = (cursor + align-1) & ~(align-1);
+            cursor = s.out.sh_offset + (s.out.sh_type == SHT_NOBITS ? 0 : s.out.sh_size);
+        }
+        gelf_update_shdr(s.scn, &s.out);
+    }
+    ehdr_out.e_shoff = (cursor + 7) & ~7ul;
+
+    /* symbols in moved sections */
+    if (add_load && symtab_scn_out != nullptr) {
+        GElf_Sym sym;
+        auto d = elf_getdata(symtab_scn_out, nullptr);
+        for (auto& s : scns) {
+            if (!s.moved)
+                continue;
+            auto ndx = elf_ndxscn(s.scn);
+            for (auto i=0ul; gelf_getsym(d, i, &sym) != nullptr; i++)
+                if (sym.st_shndx == ndx) {
+                    sym.st_value += s.out.sh_addr - s.in.sh_addr;
+                    gelf_update_sym(d, i, &sym);
+                }
+        }
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+    }
+
+    /* table pointers & sizes in .dynamic */
+    const pair<int64_t, int64_t> tables[] = {
+        {DT_RELA, DT_RELASZ}, {DT_JMPREL, DT_PLTRELSZ}, {DT_RELR, DT_RELRSZ},
+        {DT_STRTAB, DT_STRSZ}, {DT_INIT_ARRAY, DT_INIT_ARRAYSZ},
+        {DT_FINI_ARRAY, DT_FINI_ARRAYSZ}, {DT_PREINIT_ARRAY, DT_PREINIT_ARRAYSZ},
+        {DT_SYMTAB, DT_NULL}, {DT_HASH, DT_NULL}, {DT_GNU_HASH, DT_NULL},
+        {DT_VERSYM, DT_NULL}, {DT_VERDEF, DT_NULL}, {DT_VERNEED, DT_NULL},
+    };
+    for (auto [ptr_tag, sz_tag] : tables) {
+        auto ptr = dynamic.get_dyn(ptr_tag);
+        if (!ptr.has_value())
+            continue;
+        auto s = find_if(scns.begin(), scns.end(), [&](const placed &s) {
+            return s.scn && (s.in.sh_flags & SHF_ALLOC) && s.in.sh_addr == ptr.value()->d_un.d_ptr;
+        });
+        if (s == scns.end())
+            continue;
+        ptr.value()->d_un.d_ptr = s->out.sh_addr;
+        auto sz = sz_tag != DT_NULL ? dynamic.get_dyn(sz_tag) : nullopt;
+        if (sz.has_value() && (sz.value()->d_un.d_val == s->in.sh_size
+                    || sz.value()->d_un.d_val == s->out.sh_size))
+            sz.value()->d_un.d_val = s->out.sh_size;
+    }
+}
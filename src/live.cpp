@@ -0,0 +1,334 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <set>
+#include <map>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+/*
+ * Live tailoring: apply_config on the file of the running executable,
+ * the changed bytes go into the process while all its threads are
+ * stopped. No guards & no layout, the process keeps its mappings.
+ */
+
+static void read_mem(int pid, uint64_t addr, void *buf, size_t len) {
+    struct iovec local = { buf, len };
+    struct iovec remote = { reinterpret_cast<void*>(addr), len };
+    if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != ssize_t(len))
+        throw std::runtime_error("Reading process memory at "s + to_string(addr) + " failed. " + strerror(errno));
+}
+
+/* Read-only pages (text): /proc/pid/mem writes through the protection */
+static void write_mem(int pid, int memfd, uint64_t addr, const void *buf, size_t len) {
+    struct iovec local = { const_cast<void*>(buf), len };
+    struct iovec remote = { reinterpret_cast<void*>(addr), len };
+    if (process_vm_writev(pid, &local, 1, &remote, 1, 0) == ssize_t(len))
+        return;
+    if (pwrite(memfd, buf, len, addr) != ssize_t(len))
+        throw std::runtime_error("Writing process memory at "s + to_string(addr) + " failed. " + strerror(errno));
+}
+
+/* Runtime address of the program headers */
+static uint64_t at_phdr(int pid) {
+    auto path = "/proc/"s + to_string(pid) + "/auxv";
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("open "s + path + " failed. " + strerror(errno));
+    Elf64_auxv_t aux;
+    uint64_t phdr = 0;
+    while (read(fd, &aux, sizeof(aux)) == sizeof(aux) && aux.a_type != AT_NULL)
+        if (aux.a_type == AT_PHDR)
+            phdr = aux.a_un.a_val;
+    close(fd);
+    if (phdr == 0)
+        throw std::runtime_error("No AT_PHDR in "s + path);
+    return phdr;
+}
+
+/* Every thread of pid in a ptrace-stop until destruction */
+class StoppedProcess {
+public:
+    StoppedProcess(int pid);
+    ~StoppedProcess() { detach(); }
+
+    map<int, uint64_t> pcs; // tid -> rip
+private:
+    void detach();
+
+    map<int, int> sigs;     // tid -> signal to deliver on detach
+};
+
+StoppedProcess::StoppedProcess(int pid) {
+    auto task = "/proc/"s + to_string(pid) + "/task";
+    try {
+        /* until no thread was created meanwhile */
+        for (bool more = true; more;) {
+            more = false;
+            auto d = opendir(task.c_str());
+            if (d == nullptr)
+                throw std::runtime_error("opendir "s + task + " failed. " + strerror(errno));
+            vector<int> tids;
+            while (auto e = readdir(d))
+                if (e->d_name[0] != '.')
+                    tids.push_back(stoi(e->d_name));
+            closedir(d);
+
+            for (auto tid : tids) {
+                if (sigs.count(tid))
+                    continue;
+                if (ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) == -1) {
+                    if (errno == ESRCH) // exited
+                        continue;
+                    throw std::runtime_error("ptrace "s + to_string(tid) + " failed. " + strerror(errno));
+                }
+                sigs[tid] = 0;
+                more = true;
+                ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+                int status;
+                if (waitpid(tid, &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+                    sigs.erase(tid);
+                    continue;
+                }
+                if (status >> 16 == 0) // signal-delivery-stop, keep the signal
+                    sigs[tid] = WSTOPSIG(status);
+            }
+        }
+        for (auto& [tid, sig] : sigs) {
+            struct user_regs_struct regs;
+            if (ptrace(PTRACE_GETREGS, tid, nullptr, &regs) == -1)
+                throw std::runtime_error("ptrace getregs "s + to_string(tid) + " failed. " + strerror(errno));
+            pcs[tid] = regs.rip;
+        }
+    } catch (...) {
+        detach();
+        throw;
+    }
+}
+
+void StoppedProcess::detach() {
+    for (auto& [tid, sig] : sigs)
+        ptrace(PTRACE_DETACH, tid, nullptr, reinterpret_cast<void*>(uintptr_t(sig)));
+    sigs.clear();
+}
+
+/*
+ * Same patch set as apply_config, written into process pid. Variables
+ * take the process' values before -s, so -A freezes its current state.
+ * A thread inside a patchpoint window is let run for a bit, then
+ * stopped again. mv_info_fn.active_mvfn of fixed functions points to the
+ * selected variant, libmultiverse sees them as committed. Generic
+ * entries get no inlined body: a thread returning into one (from a call
+ * in it) would continue in copied code, only pcs are checked. The model
+ * is meant for this process only afterwards.
+ */
+void Bintail::tailor_process(int pid, const Config &cfg) {
+    if (!provenance.empty())
+        throw std::runtime_error("Process runs a tailored executable");
+
+    /* load bias from the program headers, 0 for ET_EXEC */
+    GElf_Phdr phdr;
+    uint64_t phdr_vaddr = 0;
+    size_t phdr_num;
+    elf_getphdrnum(e_in, &phdr_num);
+    for (auto i=0u; i<phdr_num; i++) {
+        gelf_getphdr(e_in, i, &phdr);
+        if (phdr.p_type == PT_PHDR) {
+            phdr_vaddr = phdr.p_vaddr;
+            break;
+        }
+        if (phdr.p_type == PT_LOAD && phdr.p_offset <= ehdr_in.e_phoff
+                && ehdr_in.e_phoff < phdr.p_offset + phdr.p_filesz && phdr_vaddr == 0)
+            phdr_vaddr = phdr.p_vaddr + ehdr_in.e_phoff - phdr.p_offset;
+    }
+    auto bias = at_phdr(pid) - phdr_vaddr;
+    bool fpic = (ehdr_in.e_type == ET_DYN);
+
+    int fd;
+    if ((fd = open("/dev/null", O_WRONLY)) == -1)
+        throw std::runtime_error("open /dev/null failed. "s + strerror(errno));
+    init_write(fd, false);
+
+    map<MVVar*, int64_t> live;
+    for (auto& v : vars) {
+        if (v->imported)
+            continue;
+        int64_t val = 0;
+        auto width = v->var.variable_width;
+        read_mem(pid, bias + v->location(), &val, width);
+        if (v->var.flag_signed && width < 8 && (val >> (8*width - 1)) & 1)
+            val |= -1l << (8*width);
+        live[v.get()] = val;
+        v->_value = val; // model only, words are diffed against live
+    }
+    for (auto& fn : fns) // 5 bytes: jmp, or a shorter body
+        fn->limit_entry(fn->location() + 5);
+    auto live_cfg = cfg;
+    live_cfg.guard = false;
+    apply_config(live_cfg);
+
+    /* expect empty: written unconditionally */
+    struct patch { uint64_t vaddr; vector<byte> bytes; vector<byte> expect; };
+    vector<patch> code, words;
+    set<uint64_t> skip; // bytes of vars & relocated words
+
+    GElf_Shdr shdr;
+    gelf_getshdr(text.scn_in, &shdr);
+    auto in = text.in_buf();
+    auto out = text.out_buf();
+    for (size_t i = 0; i < shdr.sh_size; i++) {
+        if (in[i] == out[i])
+            continue;
+        auto j = i;
+        while (j < shdr.sh_size && in[j] != out[j])
+            j++;
+        code.push_back({shdr.sh_addr + i, {out+i, out+j}, {}});
+        i = j;
+    }
+
+    unsigned n_vars = 0;
+    for (auto& [v, val] : live) {
+        for (auto a = v->location(); a < v->location() + v->var.variable_width; a++)
+            skip.insert(a);
+        if (v->value() == val)
+            continue;
+        auto value = v->value();
+        auto b = reinterpret_cast<byte*>(&value);
+        words.push_back({v->location(), {b, b + v->var.variable_width}, {}});
+        n_vars++;
+    }
+
+    if (fpic)
+        for (auto i = 0u; i < rela_other.size(); i++) {
+            auto& r = rela_other[i];
+            if (r.r_addend == rela_other_in[i].r_addend)
+                continue;
+            uint64_t from = bias + rela_other_in[i].r_addend;
+            uint64_t to = bias + r.r_addend;
+            auto f = reinterpret_cast<byte*>(&from);
+            auto t = reinterpret_cast<byte*>(&to);
+            words.push_back({r.r_offset, {t, t+8}, {f, f+8}});
+            for (auto a = r.r_offset; a < r.r_offset + 8; a++)
+                skip.insert(a);
+        }
+
+    /* non-PIE pointer tables, only if the process did not change them */
+    Elf_Scn* mv_scns[] = { mvvar.scn_in, mvfn.scn_in, mvcs.scn_in, mvdata.scn_in, text.scn_in };
+    for (auto& [scn_in, scn_out] : scn_map) {
+        gelf_getshdr(scn_in, &shdr);
+        if (scn_out == nullptr || !(shdr.sh_flags & SHF_ALLOC) || shdr.sh_type != SHT_PROGBITS
+                || find(begin(mv_scns), end(mv_scns), scn_in) != end(mv_scns))
+            continue;
+        auto din = static_cast<const byte*>(elf_getdata(scn_in, nullptr)->d_buf);
+        auto dout = static_cast<const byte*>(elf_getdata(scn_out, nullptr)->d_buf);
+        auto changed = [&](size_t i) {
+            return din[i] != dout[i] && !skip.count(shdr.sh_addr + i);
+        };
+        for (size_t i = 0; i < shdr.sh_size; i++) {
+            if (!changed(i))
+                continue;
+            auto j = i;
+            while (j < shdr.sh_size && changed(j))
+                j++;
+            words.push_back({shdr.sh_addr + i, {dout+i, dout+j}, {din+i, din+j}});
+            i = j;
+        }
+    }
+
+    unsigned n_fns = 0;
+    if (mvfn.scn_in != nullptr) {
+        gelf_getshdr(mvfn.scn_in, &shdr);
+        for (auto i = 0u; i < fns.size(); i++) {
+            auto& fn = fns[i];
+            auto pfn = fn->select();
+            if (!fn->is_fixed() || pfn == nullptr)
+                continue;
+            auto& vs = fn->variants();
+            auto ndx = find_if(vs.begin(), vs.end(), [&](auto& m) { return m.get() == pfn; }) - vs.begin();
+            uint64_t active = bias + fn->fn.mv_functions + ndx * sizeof(mv_info_mvfn);
+            auto b = reinterpret_cast<byte*>(&active);
+            words.push_back({shdr.sh_addr + i * sizeof(mv_info_fn) + offsetof(mv_info_fn, active_mvfn),
+                    {b, b+8}, {}});
+            n_fns++;
+        }
+    }
+
+    /* (start, end) a pc must not be in */
+    vector<pair<uint64_t, uint64_t>> windows;
+    for (auto& pp : pps) {
+        if (pp->_fn == nullptr || !pp->_fn->is_fixed())
+            continue;
+        void *from, *to;
+        pp->patchpoint_size(&from, &to);
+        windows.push_back({bias + uint64_t(from), bias + uint64_t(to)});
+    }
+    for (auto& p : code)
+        windows.push_back({bias + p.vaddr, bias + p.vaddr + p.bytes.size()});
+
+    auto mem = "/proc/"s + to_string(pid) + "/mem";
+    int memfd;
+    if ((memfd = open(mem.c_str(), O_RDWR)) == -1)
+        throw std::runtime_error("open "s + mem + " failed. " + strerror(errno));
+
+    unsigned skipped = 0;
+    uint64_t code_bytes = 0;
+    try {
+        for (auto attempt = 0;; attempt++) {
+            if (attempt != 0) // detached, let it run on
+                this_thread::sleep_for(chrono::milliseconds(1));
+            StoppedProcess stop{pid};
+            auto busy = find_if(stop.pcs.begin(), stop.pcs.end(), [&](auto& t) {
+                return any_of(windows.begin(), windows.end(), [&](auto& w) {
+                    return w.first < t.second && t.second < w.second;
+                });
+            });
+            if (busy != stop.pcs.end()) {
+                if (attempt == 100)
+                    throw std::runtime_error("Thread "s + to_string(busy->first)
+                            + " stays in a patchpoint window");
+                continue;
+            }
+
+            for (auto& p : words) {
+                if (!p.expect.empty()) {
+                    vector<byte> cur(p.expect.size());
+                    read_mem(pid, bias + p.vaddr, cur.data(), cur.size());
+                    if (cur != p.expect) {
+                        skipped++;
+                        continue;
+                    }
+                }
+                write_mem(pid, memfd, bias + p.vaddr, p.bytes.data(), p.bytes.size());
+            }
+            for (auto& p : code) {
+                write_mem(pid, memfd, bias + p.vaddr, p.bytes.data(), p.bytes.size());
+                code_bytes += p.bytes.size();
+            }
+            break;
+        }
+    } catch (...) {
+        close(memfd);
+        reset();
+        throw;
+    }
+    close(memfd);
+
+    cout << "pid " << pid << ": " << n_fns << " functions, " << n_vars << " variables, "
+         << code.size() << " code ranges (0x" << hex << code_bytes << dec << " bytes)";
+    if (skipped != 0)
+        cout << ", " << skipped << " pointers changed by the process skipped";
+    cout << "\n";
+    reset();
+}
@@ -1,55 +1,262 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <optional>
 #include <getopt.h>
+#include <unistd.h>
 
 using namespace std;
 
 #include <bintail/bintail.h>
+#include "server.h"
+#include "cache.h"
+#include "facts.h"
+#include "fleet.h"
+#include "patch.h"
+#include "dump.h"
+#include "watch.h"
+
+static const struct option long_opts[] = {
+    { "serve", required_argument, nullptr, 'S' },
+    { "lru",   required_argument, nullptr, 'L' },
+    { "estimate", no_argument,     nullptr, 'E' },
+    { "costs", required_argument, nullptr, 'C' },
+    { "explore", no_argument,      nullptr, 'X' },
+    { "verify", no_argument,       nullptr, 'V' },
+    { "cache", required_argument,  nullptr, 'K' },
+    { "cache-size", required_argument, nullptr, 'Z' },
+    { "cache-stats", no_argument,  nullptr, 'T' },
+    { "auto-config", no_argument,  nullptr, 'O' },
+    { "auto-map", required_argument, nullptr, 'M' },
+    { "env-file", required_argument, nullptr, 'N' },
+    { "cpuinfo", required_argument, nullptr, 'I' },
+    { "sysroot", required_argument, nullptr, 'R' },
+    { "lib-path", required_argument, nullptr, 'P' },
+    { "lib-out", required_argument, nullptr, 'D' },
+    { "fleet", required_argument,  nullptr, 'F' },
+    { "in-flight", required_argument, nullptr, 'B' },
+    { "diff", no_argument,         nullptr, 'G' },
+    { "patch", required_argument,  nullptr, 'Q' },
+    { "emit-patch", required_argument, nullptr, 'U' },
+    { "pid",   required_argument, nullptr, 'W' },
+    { "dump",  required_argument, nullptr, 'J' },
+    { "watch", no_argument,       nullptr, 'Y' },
+    { "help",  no_argument,       nullptr, 'h' },
+    { nullptr, 0,                 nullptr, 0 }
+};
+
+/* infile/outfile pairs, files in parallel, threads left for patchpoints */
+static int verify_files(const Config &cfg, char **files, unsigned n, unsigned jobs) {
+    mutex out_lock;
+    atomic<unsigned> next{0};
+    atomic<bool> failed{false};
+    auto file_jobs = max(1u, min(jobs, n));
+    auto work = [&]() {
+        for (unsigned i; (i = next++) < n;) {
+            auto infile = files[2*i];
+            auto outfile = files[2*i+1];
+            VerifyReport rep;
+            try {
+                Bintail bintail{infile};
+                rep = bintail.verify(cfg, outfile, max(1u, jobs / file_jobs));
+            } catch (const std::exception &e) {
+                rep.errors.push_back(e.what());
+            }
+            lock_guard<mutex> l{out_lock};
+            if (!rep.ok())
+                failed = true;
+            cout << (rep.ok() ? ANSI_COLOR_GREEN "ok  " : ANSI_COLOR_RED "FAIL ")
+                 << ANSI_COLOR_RESET << outfile << ": " << dec << rep.pps << " patchpoints, 0x"
+                 << hex << rep.guarded << " guarded bytes" << dec << "\n";
+            for (auto& e : rep.errors)
+                cout << "\t" << e << "\n";
+            for (auto& w : rep.warnings)
+                cout << "\twarning: " << w << "\n";
+        }
+    };
+    vector<thread> pool;
+    for (auto t=1u; t < file_jobs; t++)
+        pool.emplace_back(work);
+    work();
+    for (auto& t : pool)
+        t.join();
+    return failed ? 1 : 0;
+}
+
+/* bytes, K/M/G suffix */
+static uint64_t parse_size(const string &s) {
+    size_t end;
+    uint64_t n = stoull(s, &end);
+    switch (end < s.size() ? toupper(s[end]) : 0) {
+    case 'G': n <<= 10; [[fallthrough]];
+    case 'M': n <<= 10; [[fallthrough]];
+    case 'K': n <<= 10;
+    }
+    return n;
+}
 
 int main(int argc, char *argv[]) {
-    auto apply_all = false;
     auto display = false;
     auto write = true;
-    auto guard = true;
     auto dyn = false;
     auto sym = false;
     auto mvreloc = false;
-    vector<string> changes;
-    vector<string> apply;
+    auto estimate = false;
+    auto explore = false;
+    auto verify = false;
+    const char *costs_file = nullptr;
+    const char *serve = nullptr;
+    const char *cache_dir = nullptr;
+    uint64_t cache_size = 1ul << 30;
+    auto cache_stats = false;
+    auto auto_cfg = false;
+    const char *map_file = nullptr;
+    const char *env_file = nullptr;
+    const char *cpuinfo = nullptr;
+    string sysroot;
+    vector<string> lib_path;
+    string lib_out;
+    const char *fleet = nullptr;
+    uint64_t in_flight = 1ul << 30;
+    auto diff = false;
+    const char *patch_file = nullptr;
+    const char *emit_patch = nullptr;
+    auto pid = 0;
+    const char *dump = nullptr;
+    auto watch = false;
+    auto jobs = 4u;
+    auto lru = 16u;
+    Config cfg;
     
     int opt;
     int rt = 1;
-    while ((opt = getopt(argc, argv, "a:Adhglrs:twy")) != -1) {
+    while ((opt = getopt_long(argc, argv, "a:AdhgHj:lrs:tuwy", long_opts, nullptr)) != -1) {
         switch (opt) {
         case 'a':
-            apply.push_back(optarg);
+            cfg.apply.push_back(optarg);
             break;
         case 'A':
-            apply_all = true;
+            cfg.apply_all = true;
+            break;
+        case 'B':
+            in_flight = parse_size(optarg);
+            break;
+        case 'C':
+            costs_file = optarg;
             break;
         case 'd':
             display = true;
             break;
+        case 'D':
+            lib_out = optarg;
+            break;
+        case 'E':
+            estimate = true;
+            break;
+        case 'F':
+            fleet = optarg;
+            break;
         case 'g':
-            guard = false;
+            cfg.guard = false;
+            break;
+        case 'G':
+            diff = true;
+            break;
+        case 'H':
+            cfg.huge_text = true;
+            break;
+        case 'I':
+            cpuinfo = optarg;
+            break;
+        case 'j':
+            jobs = stoul(optarg);
+            break;
+        case 'J':
+            dump = optarg;
+            break;
+        case 'K':
+            cache_dir = optarg;
             break;
         case 'l':
             dyn = true;
             break;
+        case 'L':
+            lru = stoul(optarg);
+            break;
+        case 'M':
+            map_file = optarg;
+            break;
+        case 'N':
+            env_file = optarg;
+            break;
+        case 'O':
+            auto_cfg = true;
+            break;
+        case 'P':
+            lib_path.push_back(optarg);
+            break;
+        case 'Q':
+            patch_file = optarg;
+            break;
         case 'r':
             mvreloc = true;
             break;
+        case 'R':
+            sysroot = optarg;
+            break;
         case 's':
-            changes.push_back(optarg);
+            try {
+                if (!cfg.parse("-s "s + optarg).empty())
+                    throw std::runtime_error("Option -s expects var=value, not "s + optarg);
+            } catch (const std::exception &e) {
+                cerr << e.what() << "\n";
+                return 1;
+            }
+            break;
+        case 'S':
+            serve = optarg;
+            break;
+        case 'T':
+            cache_stats = true;
+            break;
+        case 'u':
+            cfg.undo = true;
+            break;
+        case 'U':
+            emit_patch = optarg;
+            break;
+        case 'V':
+            verify = true;
+            break;
+        case 'W':
+            pid = stoi(optarg);
+            break;
+        case 'X':
+            explore = true;
             break;
         case 'y':
             sym = true;
             break;
+        case 'Y':
+            watch = true;
+            break;
+        case 'Z':
+            cache_size = parse_size(optarg);
+            break;
         case 'h':
             rt = 0;
         default:
             cerr << "Usage: bintail [-d] [-w] infile outfile\n"
+                 << "       bintail --serve socket [-j threads] [--lru n]\n"
+                 << "       bintail --verify [-j threads] infile outfile [infile outfile ...]\n"
+                 << "       bintail --fleet manifest [-j threads] [--in-flight n]\n"
+                 << "       bintail --diff base target patch\n"
+                 << "       bintail --patch patch base outfile\n"
+                 << "       bintail --pid pid [-s var=value] [-a var] [-A]\n"
+                 << "       bintail --watch config infile outfile\n"
                  << "Tailor multiverse executable\n"
                  << "\n"
                  << "-a var         Apply variable.\n"
@@ -57,49 +264,197 @@ int main(int argc, char *argv[]) {
                  << "-d             Display multiverse configuration.\n"
                  << "-h             Print help.\n"
                  << "-g             Do not guard unused code.\n"
+                 << "-H             Align text segment to 2 MiB for huge pages.\n"
+                 << "-j threads     Worker threads.\n"
                  << "-l             Show dynamic info.\n"
                  << "-r             Dump mvrelocs.\n"
                  << "-s var=value   Set variable to value.\n"
+                 << "-u             Embed undo note, output can be tailored again.\n"
                  << "-y             Dump Symbols.\n"
+                 << "--serve socket Tailoring daemon on unix socket.\n"
+                 << "--lru n        Parsed binaries kept by daemon.\n"
+                 << "--estimate     Print savings of -s/-a/-A, no output.\n"
+                 << "--costs file   Cycles per instruction for --estimate.\n"
+                 << "--explore      Pareto-optimal values for -a/-A variables.\n"
+                 << "--verify       Check outfiles tailored with -s/-a/-A/-g.\n"
+                 << "--cache dir    Reuse outputs of identical input & options.\n"
+                 << "--cache-size n Evict least recently used above n[K|M|G] bytes.\n"
+                 << "--cache-stats  Print hit/miss counters of --cache.\n"
+                 << "--auto-config  Set & apply variables named like host facts.\n"
+                 << "--auto-map f   Lines \"var fact\" for --auto-config.\n"
+                 << "--env-file f   NAME=VALUE facts, override cpu & kernel facts.\n"
+                 << "--cpuinfo f    Read cpu flags from a cpuinfo file, not cpuid.\n"
+                 << "--sysroot dir  Read /proc & /sys below dir.\n"
+                 << "--lib-path dir Tailor multiverse DSOs (DT_NEEDED) found in dir too.\n"
+                 << "--lib-out dir  Tailored DSOs go to dir, default: next to outfile.\n"
+                 << "--fleet file   Tailor the \"[options] infile outfile\" lines of file.\n"
+                 << "--in-flight n  Input bytes tailored at once by --fleet, default 1G.\n"
+                 << "--diff         Write binary patch from base to target.\n"
+                 << "--patch file   Apply binary patch to base.\n"
+                 << "--emit-patch f Also write patch from infile to outfile.\n"
+                 << "--pid pid      Tailor running process, no files written.\n"
+                 << "--dump=fmt     Write the model as json or cbor to stdout.\n"
+                 << "--watch        Tailor again on relink or config change.\n"
                  << "\n";
             return rt;
         }
     }
-    if (optind+2 != argc) {
-        if (optind+1 == argc) {
-            write = false;
-        } else {
-            cerr << "Expected 1-2 arguments\n";
-            return 1;
+
+    try {
+        if (auto_cfg) {
+            vector<unique_ptr<FactProvider>> providers;
+            providers.push_back(make_unique<CpuidFacts>(cpuinfo));
+            providers.push_back(make_unique<SysFacts>(sysroot));
+            if (env_file != nullptr)
+                providers.push_back(make_unique<EnvFileFacts>(env_file));
+            auto_config(cfg, providers, map_file);
+        }
+        if (serve != nullptr) {
+            Server server{serve, jobs, lru};
+            server.run();
+            return 0;
+        }
+        if (fleet != nullptr)
+            return Fleet{fleet, jobs, in_flight}.run();
+        if (diff || patch_file != nullptr) {
+            if (argc - optind != (diff ? 3 : 2)) {
+                cerr << (diff ? "Expected base target patch\n" : "Expected base outfile\n");
+                return 1;
+            }
+            auto patch = diff ? BinaryPatch::diff(argv[optind], argv[optind+1])
+                : BinaryPatch::load(patch_file);
+            if (diff)
+                patch.save(argv[optind+2]);
+            else
+                patch.apply(argv[optind], argv[optind+1]);
+            patch.print();
+            return 0;
+        }
+        if (pid != 0) {
+            if (optind != argc) {
+                cerr << "--pid takes no files\n";
+                return 1;
+            }
+            Bintail bintail{("/proc/" + to_string(pid) + "/exe").c_str()};
+            bintail.tailor_process(pid, cfg);
+            return 0;
+        }
+        if (watch) {
+            if (argc - optind != 3) {
+                cerr << "Expected config infile outfile\n";
+                return 1;
+            }
+            Watcher{cfg, argv[optind], argv[optind+1], argv[optind+2]}.run();
+            return 0;
+        }
+        if (verify) {
+            if (argc - optind < 2 || (argc - optind) % 2 != 0) {
+                cerr << "Expected infile outfile pairs\n";
+                return 1;
+            }
+            return verify_files(cfg, argv + optind, (argc - optind) / 2, jobs);
         }
-    }
 
-    auto infile = argv[optind];
-    auto outfile = argv[optind+1];
-    Bintail bintail{infile};
+        if (cache_dir != nullptr && cache_stats) {
+            OutputCache{cache_dir, cache_size}.print_stats();
+            return 0;
+        }
 
-    if (sym)
-        bintail.print_sym();
-    if (dyn)
-        bintail.print_dyn();
-    if (mvreloc)
-        bintail.print_reloc();
-    if (display)
-        bintail.print();
+        if (optind+2 != argc) {
+            if (optind+1 == argc) {
+                write = false;
+            } else {
+                cerr << "Expected 1-2 arguments\n";
+                return 1;
+            }
+        }
+
+        auto infile = argv[optind];
+        auto outfile = argv[optind+1];
 
-    if (!write)
-        return 0;
+        if (!lib_path.empty()) {
+            ModuleSet set{infile, lib_path};
+            if (display)
+                set.print();
+            if (write) {
+                if (lib_out.empty()) {
+                    string out{outfile};
+                    lib_out = out.find('/') == string::npos ? "." : out.substr(0, out.rfind('/'));
+                }
+                set.write(cfg, outfile, lib_out);
+            }
+            return 0;
+        }
 
-    bintail.init_write(outfile, apply_all);
+        if (dump != nullptr) {
+            auto writer = ModelWriter::create(dump, STDOUT_FILENO);
+            cout.rdbuf(cerr.rdbuf()); // stdout is the model
+            Bintail bintail{infile};
+            bintail.dump(*writer);
+            return 0;
+        }
+
+        /* --emit-patch: outfile against infile, also for cached ones */
+        auto emit = [&]() {
+            if (emit_patch != nullptr)
+                BinaryPatch::diff(infile, outfile).save(emit_patch);
+        };
+
+        optional<OutputCache> cache;
+        string key;
+        if (cache_dir != nullptr && write && !(sym || dyn || mvreloc || display || estimate || explore)) {
+            cache.emplace(cache_dir, cache_size);
+            key = cache->key(infile, cfg);
+            if (cache->fetch(key, outfile)) {
+                emit();
+                return 0;
+            }
+        }
 
-    for (auto& e : changes)
-        bintail.change(e);
-    for (auto& e : apply)
-        bintail.apply(e, guard);
-    if (apply_all)
-        bintail.apply_all(guard);
+        Bintail bintail{infile};
 
-    bintail.write();
+        if (sym)
+            bintail.print_sym();
+        if (dyn)
+            bintail.print_dyn();
+        if (mvreloc)
+            bintail.print_reloc();
+        if (display)
+            bintail.print();
+        if (estimate || explore) {
+            CostTable costs;
+            if (costs_file != nullptr)
+                costs.load(costs_file);
+            if (estimate)
+                bintail.estimate(cfg, costs);
+            else
+                bintail.explore(cfg, costs, jobs);
+            return 0;
+        }
+
+        if (!write)
+            return 0;
+
+        if (cache) {
+            string tmp;
+            bintail.init_write(cache->create(tmp), cfg.drops_info());
+            bintail.apply_config(cfg);
+            bintail.write(cfg.undo, cfg.huge_text);
+            bintail.reset();
+            cache->publish(tmp, key, outfile);
+            emit();
+            return 0;
+        }
+
+        bintail.init_write(outfile, cfg.drops_info());
+        bintail.apply_config(cfg);
+        bintail.write(cfg.undo, cfg.huge_text);
+        bintail.reset(); // outfile complete
+        emit();
+    } catch (const std::exception &e) {
+        cerr << e.what() << "\n";
+        return 1;
+    }
 
     return 0;
 }
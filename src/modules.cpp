@@ -0,0 +1,124 @@
+#include <iostream>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <gelf.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+/* DT_NEEDED entries & whether it carries multiverse variables */
+static vector<string> read_needed(const string &file, bool &multiverse) {
+    vector<string> needed;
+    multiverse = false;
+    int fd;
+    if ((fd = open(file.c_str(), O_RDONLY)) == -1)
+        throw std::runtime_error("open " + file + " failed.");
+    auto e = elf_begin(fd, ELF_C_READ, nullptr);
+    if (e == nullptr) {
+        close(fd);
+        throw std::runtime_error("elf_begin " + file + " failed.");
+    }
+
+    size_t shstrndx;
+    GElf_Shdr shdr;
+    Elf_Scn *scn = nullptr;
+    elf_getshdrstrndx(e, &shstrndx);
+    while ((scn = elf_nextscn(e, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        if (elf_strptr(e, shstrndx, shdr.sh_name) == "__multiverse_var_"s)
+            multiverse = true;
+        if (shdr.sh_type != SHT_DYNAMIC)
+            continue;
+        auto d = elf_getdata(scn, nullptr);
+        for (auto i=0u; i < d->d_size / shdr.sh_entsize; i++) {
+            GElf_Dyn dyn;
+            gelf_getdyn(d, i, &dyn);
+            if (dyn.d_tag == DT_NEEDED)
+                needed.push_back(elf_strptr(e, shdr.sh_link, dyn.d_un.d_val));
+        }
+    }
+    elf_end(e);
+    close(fd);
+    return needed;
+}
+
+static string real_path(const string &path) {
+    char buf[PATH_MAX];
+    return realpath(path.c_str(), buf) != nullptr ? buf : path;
+}
+
+/**
+ * Load order as ld.so searches symbols: executable, then breadth first
+ * over DT_NEEDED. Libraries not in lib_path are system ones & skipped.
+ */
+ModuleSet::ModuleSet(const char *exe, const vector<string> &lib_path) {
+    if (elf_version(EV_CURRENT) == EV_NONE)
+        throw std::runtime_error("libelf init failed");
+
+    deque<pair<string, string>> todo{{exe, ""}}; // file, DT_NEEDED name
+    set<string> seen;
+    while (!todo.empty()) {
+        auto [file, name] = todo.front();
+        todo.pop_front();
+        bool multiverse;
+        for (auto& n : read_needed(file, multiverse)) {
+            if (!seen.insert(n).second)
+                continue;
+            for (auto& dir : lib_path)
+                if (access((dir + "/" + n).c_str(), R_OK) == 0) {
+                    todo.emplace_back(dir + "/" + n, n);
+                    break;
+                }
+        }
+        if (!multiverse && !name.empty())
+            continue;
+        modules.push_back(make_unique<Bintail>(file.c_str()));
+        files.push_back(file);
+        needed.push_back(name);
+    }
+
+    /* first definition wins, like symbol lookup */
+    unordered_map<string, MVVar*> defined;
+    for (auto& m : modules)
+        for (auto& v : m->vars)
+            if (!v->imported)
+                defined.emplace(v->name(), v.get());
+    for (auto i=0u; i < modules.size(); i++)
+        for (auto& v : modules[i]->vars) {
+            if (!v->imported)
+                continue;
+            auto it = defined.find(v->name());
+            if (it == defined.end())
+                throw std::runtime_error(files[i] + ": variable " + v->name()
+                        + " not defined in any module");
+            v->import_value(it->second->value());
+        }
+}
+
+void ModuleSet::print() {
+    for (auto i=0u; i < modules.size(); i++) {
+        cout << ANSI_COLOR_YELLOW << files[i] << ":\n" ANSI_COLOR_RESET;
+        modules[i]->print();
+    }
+}
+
+/* Same config everywhere: a variable is frozen in all modules using it */
+void ModuleSet::write(const Config &cfg, const char *outfile, const string &lib_out) {
+    for (auto i=0u; i < modules.size(); i++) {
+        auto out = needed[i].empty() ? string{outfile} : lib_out + "/" + needed[i];
+        if (real_path(out) == real_path(files[i]))
+            throw std::runtime_error("Output " + out + " would overwrite its input");
+        modules[i]->init_write(out.c_str(), cfg.drops_info());
+        modules[i]->apply_config(cfg);
+        modules[i]->write(cfg.undo, cfg.huge_text);
+        modules[i]->reset();
+    }
+}
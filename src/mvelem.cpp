@@ -4,60 +4,41 @@
 #include <vector>
 #include <string>
 #include <cstdlib>
-#include <regex>
 using namespace std;
 
 #include "string.h"
 #include "mvelem.h"
+#include "x86len.h"
 #include <bintail/bintail.h>
 
-//------------------MVText-----------------------------------
-MVText::MVText(std::byte *buf, size_t size, uint64_t vaddr) {
-    orig_vaddr = vaddr;
-    copy(buf, buf+size, instr.begin());
-}
-
-size_t MVText::make_info(bool fpic, std::byte *buf, Section* scn, uint64_t vaddr) {
-    copy(instr.cbegin(), instr.cend(), buf);
-    if (fpic) {
-        // Adjust relocations
-        for (auto& r : scn->relocs) {
-            uint64_t orig_target = r.r_addend;
-            uint64_t start = orig_vaddr;
-            uint64_t end = start + instr.size();
-            if (orig_target >= start && orig_target < end) {
-                auto target = orig_target - start + vaddr;
-                r.r_addend = target;
-            }
-        }
-    }
-    return instr.size();
-}
-
 //------------------MVassign-----------------------------------
-MVassign::MVassign(struct mv_info_assignment& _assign)
-    :assign{_assign} { }
+MVassign::MVassign(struct mv_info_assignment& _assign, uint64_t slot)
+    :slot{slot}, assign{_assign} { }
 
-size_t MVassign::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
+size_t MVassign::make_info(bool fpic, byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto ass =  reinterpret_cast<mv_info_assignment*>(buf);
     ass->location = assign.location;
     ass->lower_bound = assign.lower_bound;
     ass->upper_bound = assign.upper_bound;
     if (fpic) {
-        sec->add_rela(vaddr, ass->location);
+        rela[0] = make_rela(vaddr, ass->location);
+        if (sym_info != 0) {
+            rela[0].r_info = sym_info;
+            rela[0].r_addend = sym_addend;
+        }
     }
     return sizeof(mv_info_assignment);
 }
+
+void MVassign::resolve_sym(uint64_t value, uint64_t r_info, int64_t r_addend) {
+    assign.location = value;
+    sym_info = r_info;
+    sym_addend = r_addend;
+}
 void MVassign::link_var(MVVar* _var) {
     var = _var;
 }
 
-bool MVassign::check_sym(const string &sym_match) {
-    smatch m;
-    regex pat { var->name() + "_" + (var->value() ? "(1|true)" : "(0|false)") + "(\\.|$)"};
-    return regex_search(sym_match, m, pat);
-}
-
 bool MVassign::is_active() {
     auto low = assign.lower_bound;
     auto high = assign.upper_bound;
@@ -100,12 +81,14 @@ MVmvfn::MVmvfn(struct mv_info_mvfn& _mvfn, MVDataSection* mvdata, Section* text)
     }
     auto assign_infos = reinterpret_cast<const struct mv_info_assignment*>
         (mvdata->in_buf(mvfn.assignments));
-    for_each(assign_infos, assign_infos+mvfn.n_assignments, [&](auto ainfo)
-            { assigns.push_back(make_unique<MVassign>(ainfo)); });
+    for (auto i=0u; i < mvfn.n_assignments; i++) {
+        auto ainfo = assign_infos[i];
+        assigns.push_back(make_unique<MVassign>(ainfo, mvfn.assignments + i*sizeof(ainfo)));
+    }
 }
 
 /* make mvfn & mvassings */
-size_t MVmvfn::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
+size_t MVmvfn::make_info(bool fpic, byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto mfn =  reinterpret_cast<mv_info_mvfn*>(buf);
 
     mfn->function_body = mvfn.function_body;
@@ -115,8 +98,8 @@ size_t MVmvfn::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
     mfn->constant = mvfn.constant;
 
     if (fpic) {
-        sec->add_rela(vaddr+offsetof(struct mv_info_mvfn, function_body), mvfn.function_body);
-        sec->add_rela(vaddr+offsetof(struct mv_info_mvfn, assignments), mvfn.assignments);
+        rela[0] = make_rela(vaddr+offsetof(struct mv_info_mvfn, function_body), mvfn.function_body);
+        rela[1] = make_rela(vaddr+offsetof(struct mv_info_mvfn, assignments), mvfn.assignments);
     }
     return sizeof(mv_info_mvfn);
 }
@@ -125,10 +108,12 @@ void MVmvfn::set_info_assigns(uint64_t vaddr) {
     mvfn.assignments = vaddr;
 }
 
-size_t MVmvfn::make_info_ass(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr) {
+size_t MVmvfn::make_info_ass(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto esz = 0ul;
-    for (auto& a : assigns)
-        esz += a->make_info(fpic, buf+esz, scn, vaddr+esz);
+    for (auto& a : assigns) {
+        esz += a->make_info(fpic, buf+esz, rela, vaddr+esz);
+        rela += fpic ? MVassign::info_relocs : 0;
+    }
     return esz;
 }
 
@@ -158,44 +143,144 @@ void MVmvfn::print(bool cur) {
         assign->print();
 }
 
-void MVmvfn::check_var(MVVar* var, MVFn* fn) {
+void MVmvfn::link_vars(const unordered_map<uint64_t, MVVar*> &var_at, MVFn* fn) {
     for (auto& assign : assigns) {
-        if (var->location() == assign->location()) {
-            assign->link_var(var);
-            var->link_fn(fn);
-        }
+        auto it = var_at.find(assign->location());
+        if (it == var_at.end())
+            continue;
+        assign->link_var(it->second);
+        it->second->link_fn(fn);
     }
 }
 
-void MVmvfn::probe_sym(struct symbol &sym, const string &sym_match) {
-    if (all_of(assigns.begin(), assigns.end(), [&](auto& ass)
-                { return ass->check_sym(sym_match); }))
+/* Name encodes the assignments, the body address identifies the variant */
+void MVmvfn::probe_sym(struct symbol &sym) {
+    if (sym.sym.st_value == mvfn.function_body)
         symbol = sym;
-
 }
 
 //---------------------MVFn----------------------------------------------------
-void MVFn::apply(Section* text, bool guard) {
+/* Variant fixed by frozen variables, nullptr if still variable */
+MVmvfn* MVFn::select() {
     auto pfn = find_if(mvfns.begin(), mvfns.end(), [](auto& mfn)
             { return mfn->assign_vars_frozen() && mfn->active(); });
     if (pfn == mvfns.end())
+        return nullptr;
+    return pfn->get();
+}
+
+void MVFn::apply(Section* text, bool guard) {
+    auto pfn = select();
+    if (pfn == nullptr)
         return;
     if (guard) {
         for (auto& e : mvfns)
-            if (e.get() != pfn.base()->get())
+            if (e->location() != pfn->location()) // folded variants share it
                 text->fill(e->location(), byte{0xcc}, e->size());
         text->fill(location(), byte{0xcc}, symbol.sym.st_size); // overriden by pp
     }
     for (auto& p : pps) 
-        p->patchpoint_apply(&(pfn->get()->mvfn), text);
+        p->patchpoint_apply(pfn, text);
     frozen = true;
 }
 
-void MVFn::set_mvfn_vaddr(uint64_t vaddr) {
-    mvfn_vaddr = vaddr;
+/* Text apply() may write to, [start, end) */
+void MVFn::footprint(vector<pair<uint64_t, uint64_t>> &ranges) {
+    ranges.push_back({location(), location() + max<uint64_t>(size(), 5)}); // entry
+    for (auto& e : mvfns)
+        ranges.push_back({e->location(), e->location() + e->size()});
+    for (auto& p : pps) {
+        auto len = p->pp.type == PP_TYPE_X86_CALL_INDIRECT ? 6 : 5;
+        ranges.push_back({p->pp.location, p->pp.location + len});
+    }
+}
+
+/* apply() without touching text */
+void MVFn::estimate(Savings &s, const CostTable &c, Section* text) {
+    auto pfn = select();
+    if (pfn == nullptr)
+        return;
+    estimate(pfn, s, c, text);
+}
+
+void MVFn::estimate(MVmvfn* pfn, Savings &s, const CostTable &c, Section* text) {
+    s.fns++;
+    set<uint64_t> bodies{pfn->location()};
+    for (auto& e : mvfns)
+        if (bodies.insert(e->location()).second)
+            s.guarded += e->size();
+    /* entry: jmp to the variant or its inlined body, as patchpoint_apply */
+    auto entry_len = 5ul;
+    for (auto& p : pps)
+        if (p->pp.type == PP_TYPE_X86_JUMP) {
+            auto e = p->entry(pfn, text);
+            entry_len = e.size();
+            s.jumps += e.size() == 5 && e[0] == 0xe9;
+        }
+    if (symbol.sym.st_size > entry_len)
+        s.guarded += symbol.sym.st_size - entry_len;
+
+    auto type = pfn->mvfn.type;
+    auto body = c.ret + (type == MVFN_TYPE_CONSTANT ? c.mov :
+                         type == MVFN_TYPE_CLI ? c.cli :
+                         type == MVFN_TYPE_STI ? c.sti : 0);
+    for (auto& p : pps) {
+        if (p->pp.type == PP_TYPE_X86_JUMP)
+            continue;
+        /* before: call generic, jmp to variant, variant body */
+        int64_t before = (p->pp.type == PP_TYPE_X86_CALL_INDIRECT ? c.call_indirect : c.call)
+            + c.jmp + body;
+        int64_t after;
+        switch (type) {
+        case MVFN_TYPE_NOP:
+            s.nops++;
+            after = c.nop;
+            break;
+        case MVFN_TYPE_CONSTANT:
+            s.consts++;
+            after = c.mov;
+            break;
+        case MVFN_TYPE_CLI:
+        case MVFN_TYPE_STI:
+            s.irqs++;
+            after = (type == MVFN_TYPE_CLI ? c.cli : c.sti) + c.nop;
+            break;
+        default:
+            s.calls++;
+            after = c.call + body;
+        }
+        s.cycles += before - after;
+    }
 }
 
-size_t MVFn::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
+size_t MVFn::n_assigns() {
+    auto n = 0ul;
+    for (auto& m : mvfns)
+        n += m->n_assigns();
+    return n;
+}
+
+size_t MVFn::n_callsites() {
+    return count_if(pps.cbegin(), pps.cend(), [](auto p)
+            { return p->pp.type != PP_TYPE_X86_JUMP; });
+}
+
+void Savings::add(const Savings &o) {
+    fns += o.fns;
+    calls += o.calls;
+    nops += o.nops;
+    consts += o.consts;
+    irqs += o.irqs;
+    jumps += o.jumps;
+    guarded += o.guarded;
+    cycles += o.cycles;
+}
+
+void MVFn::reset() {
+    frozen = false;
+}
+
+size_t MVFn::make_info(bool fpic, byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto f = reinterpret_cast<mv_info_fn*>(buf);
     f->name = fn.name;
     f->function_body = fn.function_body;
@@ -204,23 +289,39 @@ size_t MVFn::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
     f->patchpoints_head = nullptr;
 
     if (fpic) {
-        sec->add_rela(vaddr+offsetof(struct mv_info_fn, name), fn.name);
-        sec->add_rela(vaddr+offsetof(struct mv_info_fn, function_body), fn.function_body);
-        sec->add_rela(vaddr+offsetof(struct mv_info_fn, mv_functions), mvfn_vaddr);
+        rela[0] = make_rela(vaddr+offsetof(struct mv_info_fn, name), fn.name);
+        rela[1] = make_rela(vaddr+offsetof(struct mv_info_fn, function_body), fn.function_body);
+        rela[2] = make_rela(vaddr+offsetof(struct mv_info_fn, mv_functions), mvfn_vaddr);
     }
     return sizeof(mv_info_fn);
 }
 
-size_t MVFn::make_mvdata(bool fpic, std::byte* buf, MVDataSection *mvdata, uint64_t vaddr) {
+/* Sizing pass: place mvfn[] & assignments at vaddr, returns size */
+size_t MVFn::layout_mvdata(uint64_t vaddr) {
+    mvfn_vaddr = vaddr;
+    auto asz = sizeof(mv_info_mvfn)*mvfns.size();
+    for (auto& m : mvfns) {
+        m->set_info_assigns(vaddr+asz);
+        asz += m->n_assigns() * sizeof(mv_info_assignment);
+    }
+    return asz;
+}
+
+size_t MVFn::mvdata_relocs() {
+    return mvfns.size() * MVmvfn::info_relocs + n_assigns() * MVassign::info_relocs;
+}
+
+size_t MVFn::make_mvdata(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     /*        v-esz                                           v-asz
      * mvfn[3] assigns_mvfn0[] assigns_mvfn1[] assigns_mvfn2[]
      */
     auto esz = 0ul;
     auto asz = sizeof(mv_info_mvfn)*mvfns.size();
     for (auto& m : mvfns) {
-        m->set_info_assigns(vaddr+asz);
-        esz += m->make_info(fpic, buf+esz, mvdata, vaddr+esz);
-        asz += m->make_info_ass(fpic, buf+asz, mvdata, vaddr+asz);
+        esz += m->make_info(fpic, buf+esz, rela, vaddr+esz);
+        rela += fpic ? MVmvfn::info_relocs : 0;
+        asz += m->make_info_ass(fpic, buf+asz, rela, vaddr+asz);
+        rela += fpic ? m->n_assigns() * MVassign::info_relocs : 0;
     }
     return asz;
 }
@@ -230,7 +331,7 @@ void MVFn::add_pp(MVPP* pp) {
 }
 
 MVFn::MVFn(struct mv_info_fn& _fn, MVDataSection *mvdata, Section *text, Section *rodata)
-    :frozen{false} {
+    :frozen{false}, callsite_off{UINT64_MAX} {
     fn = _fn;
     name = rodata->get_string(fn.name);
 
@@ -243,21 +344,18 @@ MVFn::MVFn(struct mv_info_fn& _fn, MVDataSection *mvdata, Section *text, Section
             { mvfns.push_back(make_unique<MVmvfn>(minfo, mvdata, text));} );
 }
 
-void MVFn::probe_var(MVVar* var) {
+void MVFn::link_vars(const unordered_map<uint64_t, MVVar*> &var_at) {
     for (auto& mvfn : mvfns)
-        mvfn->check_var(var, this);
+        mvfn->link_vars(var_at, this);
 }
 
+/* Caller matched the prefix: name or name.multiverse.<assignments> */
 void MVFn::probe_sym(struct symbol &sym) {
-    smatch m;
-    regex pat { "^" + name + "(\\.multiverse\\.(.+))?$" };
-    if (regex_search(sym.name, m, pat)) {
-        if (m[2].matched) // probe mvfn with part after multiverse
-            for (auto& mvfn : mvfns)
-                mvfn->probe_sym(sym, m[2].str());
-        else
-           symbol = sym;
-    }
+    if (sym.name.size() == name.size())
+        symbol = sym;
+    else if (sym.name.size() > name.size() + strlen(".multiverse."))
+        for (auto& mvfn : mvfns)
+            mvfn->probe_sym(sym);
 }
 
 void MVFn::print() {
@@ -304,10 +402,16 @@ MVVar::MVVar(struct mv_info_var _var, Section* rodata, Section* data)
         _value = 0;
         //cout << "Warning: Variable " << _name << " is uninitialized.\n";
     }
+    init_value = _value;
 }
 
+MVVar::MVVar(const string &name)
+        :frozen{false}, var{}, in_data{false}, imported{true}, _value{0},
+         _name{name}, init_value{0} { }
+
 void MVVar::print() {
-    cout << "Var: " << _name << "@0x" << location() << "\n"
+    cout << "Var: " << _name << "@0x" << location()
+         << (imported ? " (imported)" : "") << "\n"
          << "\twidth=" << var.variable_width  << " flags=[ "
          << (var.flag_tracked ? "tracked " : "")
          << (var.flag_signed ? "signed " : "" )
@@ -316,7 +420,7 @@ void MVVar::print() {
         fn->print();
 }
 
-size_t MVVar::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
+size_t MVVar::make_info(bool fpic, byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto v = reinterpret_cast<struct mv_info_var*>(buf);
     v->name = var.name;
     v->variable_location = var.variable_location;
@@ -324,8 +428,12 @@ size_t MVVar::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
     v->functions_head = nullptr;
 
     if (fpic) {
-        sec->add_rela(vaddr+offsetof(struct mv_info_var, name), var.name);
-        sec->add_rela(vaddr+offsetof(struct mv_info_var, variable_location), var.variable_location);
+        rela[0] = make_rela(vaddr+offsetof(struct mv_info_var, name), var.name);
+        rela[1] = make_rela(vaddr+offsetof(struct mv_info_var, variable_location), var.variable_location);
+        if (sym_info != 0) {
+            rela[1].r_info = sym_info;
+            rela[1].r_addend = sym_addend;
+        }
     }
     return sizeof(struct mv_info_var);
 }
@@ -347,10 +455,9 @@ uint64_t MVVar::location() {
     return var.variable_location;
 }
 
-void MVVar::apply(Section* text, bool guard) {
-    frozen = true;
-    for (auto& f : fns)
-        f->apply(text, guard);
+void MVVar::reset() {
+    frozen = false;
+    _value = init_value;
 }
 
 //---------------------MVPP---------------------------------------------------
@@ -368,18 +475,18 @@ MVPP::MVPP(MVFn* fn) : _fn{fn} {
     function_body = 0;
 }
 
-MVPP::MVPP(struct mv_info_callsite& cs, Section* text) {
+MVPP::MVPP(struct mv_info_callsite& cs, Section* text) :_fn{nullptr}, fptr{false} {
     function_body = cs.function_body;
     decode_callsite(cs, text);
 }
 
-size_t MVPP::make_info(bool fpic, byte* buf, Section* sec, uint64_t vaddr) {
+size_t MVPP::make_info(bool fpic, byte* buf, GElf_Rela* rela, uint64_t vaddr) {
     auto cs = reinterpret_cast<mv_info_callsite*>(buf);
     cs->function_body = function_body;
     cs->call_label = pp.location;
     if (fpic) {
-        sec->add_rela(vaddr+offsetof(struct mv_info_callsite, function_body), function_body);
-        sec->add_rela(vaddr+offsetof(struct mv_info_callsite, call_label), pp.location);
+        rela[0] = make_rela(vaddr+offsetof(struct mv_info_callsite, function_body), function_body);
+        rela[1] = make_rela(vaddr+offsetof(struct mv_info_callsite, call_label), pp.location);
     }
     return sizeof(mv_info_callsite);
 }
@@ -412,15 +519,78 @@ uint64_t MVPP::decode_callsite(struct mv_info_callsite& cs, Section* text) {
     return callee;
 }
 
-void MVPP::patchpoint_apply(struct mv_info_mvfn *mvfn, Section* text) {
+/* Leaf code moved from one address to another, relative operands that
+ * leave the body keep their target */
+static bool copy_leaf(const uint8_t *op, size_t size, uint64_t from, uint64_t to,
+        vector<uint8_t> &out) {
+    out.assign(op, op + size);
+    for (size_t off = 0; off < size;) {
+        x86_insn insn;
+        if (x86_insn_decode(op + off, size - off, insn) == 0 || insn.call)
+            return false;
+        auto fix = insn.rel_size ? insn.rel_off : insn.rip_off;
+        if (fix != 0) {
+            int64_t disp = insn.rel_size == 1 ? int8_t(op[off+fix])
+                : *reinterpret_cast<const int32_t*>(op + off + fix);
+            int64_t target = off + insn.len + disp;
+            if (target < 0 || target >= int64_t(size)) {
+                disp += from - to;
+                if (insn.rel_size == 1 || disp != int32_t(disp))
+                    return false;
+                *reinterpret_cast<int32_t*>(out.data() + off + fix) = disp;
+            }
+        }
+        off += insn.len;
+    }
+    return true;
+}
+
+/**
+ * Generic entry of a fixed function: the body of a simple variant, a
+ * copy of a small leaf variant or a jmp to the variant. Inlined bodies
+ * have to fit before the first callsite in the generic body.
+ */
+vector<uint8_t> MVPP::entry(MVmvfn *pfn, Section *text) {
+    auto& mvfn = pfn->mvfn;
+    vector<uint8_t> e;
+    switch (mvfn.type) {
+    case MVFN_TYPE_NOP:
+        e = { 0xc3 };             // ret
+        break;
+    case MVFN_TYPE_CONSTANT:
+        e = { 0xb8, 0, 0, 0, 0, 0xc3 }; // mov $..., eax; ret
+        memcpy(&e[1], &mvfn.constant, 4);
+        break;
+    case MVFN_TYPE_CLI:
+        e = { 0xfa, 0xc3 };       // cli; ret
+        break;
+    case MVFN_TYPE_STI:
+        e = { 0xfb, 0xc3 };       // sti; ret
+        break;
+    default:
+        if (pfn->size() == 0 || pfn->size() > max_inline
+                || !copy_leaf(reinterpret_cast<const uint8_t*>(text->in_buf(pfn->location())),
+                    pfn->size(), pfn->location(), pp.location, e))
+            e.clear();
+    }
+    if (e.empty() || e.size() > _fn->entry_room()) {
+        int32_t offset = mvfn.function_body - (pp.location + 5);
+        e = { 0xe9, 0, 0, 0, 0 }; // jmp
+        memcpy(&e[1], &offset, 4);
+    }
+    return e;
+}
+
+void MVPP::patchpoint_apply(MVmvfn *pfn, Section* text) {
+    auto mvfn = &pfn->mvfn;
     auto op = reinterpret_cast<unsigned char*>(text->out_buf(pp.location));
     uint32_t offset;
     switch(pp.type) {
-        case PP_TYPE_X86_JUMP:
-            op[0] = 0xe9; // jmp
-            offset = (uintptr_t)mvfn->function_body - ((uintptr_t) pp.location + 5);
-            *((uint32_t *)&op[1]) = offset;
+        case PP_TYPE_X86_JUMP: {
+            auto e = entry(pfn, text);
+            memcpy(op, e.data(), e.size());
             break;
+        }
         case PP_TYPE_X86_CALL:
         case PP_TYPE_X86_CALL_INDIRECT:
             // Oh, look. It has a very simple body!
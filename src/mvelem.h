@@ -2,8 +2,10 @@
 #define __MVELEM_H
 
 #include <set>
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 #include <cstddef>
 #include <bintail/bintail.h>
 
@@ -11,20 +13,26 @@ class MVFn;
 class MVVar;
 class MVPP;
 
-class MVData {
-public:
-    virtual size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr) = 0;
-    virtual ~MVData() {}
+/* Outcome of a configuration, see Bintail::estimate */
+struct Savings {
+    unsigned fns = 0;
+    unsigned calls = 0;      // direct call to variant
+    unsigned nops = 0;
+    unsigned consts = 0;     // mov $imm, %eax
+    unsigned irqs = 0;       // cli/sti
+    unsigned jumps = 0;      // generic entry jmp remains
+    uint64_t guarded = 0;    // bytes
+    int64_t cycles = 0;      // saved, summed over callsites
+
+    void add(const Savings &o);
+    unsigned callsites() const { return calls + nops + consts + irqs; }
 };
 
-//-----------------------------------------------------------------------------
-class MVText : public MVData {
+class MVData {
 public:
-    MVText(std::byte* buf, size_t size, uint64_t vaddr);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
-private:
-    long orig_vaddr;
-    std::vector<std::byte> instr;
+    /* write info at buf/vaddr, fpic: relocations to rela[] */
+    virtual size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr) = 0;
+    virtual ~MVData() {}
 };
 
 //-----------------------------------------------------------------------------
@@ -36,15 +44,22 @@ struct mv_info_assignment {
 
 class MVassign : public MVData {
 public:
-    MVassign(struct mv_info_assignment& _assign);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
+    static constexpr size_t info_relocs = 1;
+    MVassign(struct mv_info_assignment& _assign, uint64_t slot);
+    size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
     bool is_active();
-    bool check_sym(const std::string &sym_match);
     void link_var(MVVar* _var);
     void print();
 
     constexpr uint64_t location() { return assign.location; }
-    MVVar* var;
+    constexpr uint32_t lower() { return assign.lower_bound; }
+    constexpr uint32_t upper() { return assign.upper_bound; }
+    /* location relocated against a defined symbol, value read locally */
+    void resolve_sym(uint64_t value, uint64_t r_info, int64_t r_addend);
+    MVVar* var = nullptr;
+    uint64_t slot;          // input vaddr of the info
+    uint64_t sym_info = 0;  // location relocated against a symbol
+    int64_t sym_addend = 0; //   import or interposable definition
 private:
     struct mv_info_assignment assign;
 };
@@ -65,15 +80,18 @@ struct mv_info_mvfn {
 
 class MVmvfn : public MVData {
 public:
+    static constexpr size_t info_relocs = 2;
     MVmvfn(struct mv_info_mvfn& _mvfn, MVDataSection* data, Section* text);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
-    size_t make_info_ass(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
+    size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
+    size_t make_info_ass(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
     void set_info_assigns(uint64_t vaddr);
-    void check_var(MVVar* var, MVFn* fn);
-    void probe_sym(struct symbol &sym, const std::string &sym_match);
+    void link_vars(const std::unordered_map<uint64_t, MVVar*> &var_at, MVFn* fn);
+    void probe_sym(struct symbol &sym);
     void print(bool active);
     bool active();
     bool assign_vars_frozen();
+    size_t n_assigns() { return assigns.size(); }
+    const std::vector<std::unique_ptr<MVassign>>& get_assigns() { return assigns; }
 
     /* If a multiverse function body does nothing, or only returns a
      * constant value, we can further optimize the patched callsites. For a
@@ -103,18 +121,35 @@ struct mv_info_fn {
 
 class MVFn : public MVData {
 public:
+    static constexpr size_t info_relocs = 3;
     MVFn(struct mv_info_fn& _fn, MVDataSection* data, Section* text, Section* rodata);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
+    size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
     void print();
-    void probe_var(MVVar* var);
+    void link_vars(const std::unordered_map<uint64_t, MVVar*> &var_at);
     void probe_sym(struct symbol &sym);
     void add_pp(MVPP* pp);
     void apply(Section* text, bool guard);
-    size_t make_mvdata(bool fpic, std::byte* buf, MVDataSection* mvdata, uint64_t vaddr);
-    void set_mvfn_vaddr(uint64_t vaddr);
+    void footprint(std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+    MVmvfn* select();
+    void estimate(Savings &s, const CostTable &costs, Section* text);
+    void estimate(MVmvfn* pfn, Savings &s, const CostTable &costs, Section* text);
+    void reset();
+    size_t layout_mvdata(uint64_t vaddr);
+    size_t mvdata_relocs();
+    size_t make_mvdata(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
 
     constexpr bool is_fixed() { return frozen; }
     constexpr uint64_t location() { return fn.function_body; }
+    constexpr size_t size() { return symbol.sym.st_size; }
+    /* generic body up to the first callsite in it */
+    size_t entry_room() { return std::min<uint64_t>(size(), callsite_off); }
+    void limit_entry(uint64_t callsite) { callsite_off = std::min(callsite_off, callsite - location()); }
+    const std::string& get_name() { return name; }
+    size_t n_mvfns() { return mvfns.size(); }
+    size_t n_pps() { return pps.size(); }
+    const std::vector<std::unique_ptr<MVmvfn>>& variants() { return mvfns; }
+    size_t n_assigns();
+    size_t n_callsites();
 
     struct mv_info_fn fn;
     bool frozen;
@@ -125,6 +160,7 @@ private:
     std::vector<MVPP*> pps;
     std::string name;
     struct symbol symbol;
+    uint64_t callsite_off;
 };
 
 //-----------------------------------------------------------------------------
@@ -155,24 +191,32 @@ struct mv_info_var {
 
 class MVVar : public MVData {
 public:
+    static constexpr size_t info_relocs = 2;
     MVVar(struct mv_info_var _var, Section* rodata, Section* data);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
+    MVVar(const std::string &name); // imported
+    size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
     void print();
     void link_fn(MVFn* fn);
     void set_value(int v, Section* data);
-    void apply(Section* text, bool guard);
+    void reset();
+    void import_value(int64_t v) { _value = init_value = v; }
     uint64_t location();
 
     std::string& name() { return _name; }
     int64_t value() { return _value; }
+    const std::set<MVFn*>& functions() { return fns; }
 
     bool frozen;
     struct mv_info_var var;
     bool in_data;
+    bool imported = false;  // defined in another module, no info
+    uint64_t sym_info = 0;  // variable_location relocated against a symbol
+    int64_t sym_addend = 0;
     int64_t _value;
 private:
     std::set<MVFn*> fns;
     std::string _name;
+    int64_t init_value;
 };
 
 //-----------------------------------------------------------------------------
@@ -198,13 +242,16 @@ struct mv_patchpoint {
 
 class MVPP : public MVData {
 public:
+    static constexpr size_t info_relocs = 2;
+    static constexpr size_t max_inline = 64; // copied leaf variants
     MVPP(MVFn* fn);
     MVPP(struct mv_info_callsite& cs, Section* text);
     void print();
     void set_fn(MVFn* fn);
-    size_t make_info(bool fpic, std::byte* buf, Section* scn, uint64_t vaddr);
+    size_t make_info(bool fpic, std::byte* buf, GElf_Rela* rela, uint64_t vaddr);
     uint64_t decode_callsite(struct mv_info_callsite& cs, Section* text); // ret callee
-    void patchpoint_apply(struct mv_info_mvfn *mvfn, Section* text);
+    void patchpoint_apply(MVmvfn *pfn, Section* text);
+    std::vector<uint8_t> entry(MVmvfn *pfn, Section *text); // PP_TYPE_X86_JUMP
     void patchpoint_size(void **from, void** to);
 
     struct mv_patchpoint pp;
@@ -9,6 +9,9 @@
 #include <cassert>
 #include <memory>
 #include <set>
+#include <tuple>
+#include <atomic>
+#include <thread>
 
 #include <bintail/bintail.h>
 #include "mvelem.h"
@@ -47,9 +50,9 @@ uint64_t InfoArea::size_in_file() {
         + mvfn->max_sz() + mvcs->max_sz();
 }
 
+/* Segment of all info sections, .bss is optional */
 bool InfoArea::test_phdr(GElf_Phdr &phdr) {
-    return bss->in_segment(phdr)
-        && ( mvdata->in_segment(phdr) || mvdata->max_sz() == 0 )
+    return ( mvdata->in_segment(phdr) || mvdata->max_sz() == 0 )
         && ( mvvar->in_segment(phdr) || mvvar->max_sz() == 0 )
         && ( mvfn->in_segment(phdr) || mvfn->max_sz() == 0 )
         && ( mvcs->in_segment(phdr) || mvcs->max_sz() == 0 );
@@ -57,6 +60,7 @@ bool InfoArea::test_phdr(GElf_Phdr &phdr) {
 
 void InfoArea::find_start_of_area() {
     GElf_Shdr shdr;
+    uint64_t in_end = 0;
     Section* secs[] = {mvdata, mvvar, mvfn, mvcs};
     for (auto& s : secs) {
         gelf_getshdr(s->scn_in, &shdr);
@@ -64,36 +68,138 @@ void InfoArea::find_start_of_area() {
             area_offset_start = shdr.sh_offset;
             area_vaddr_start = shdr.sh_addr;
         }
+        in_end = max(in_end, shdr.sh_offset + shdr.sh_size);
     }
+    /* .bss right behind the area takes the space freed in memory */
+    with_bss = bss->scn_in != nullptr && bss->in_segment(phdr) && in_end == area_offset_end;
 }
 
 /*
  * InfoAREA:
- * [ ... | mvdata | mvfn | mvvar | mvcs | .bss ]
+ * [ ... | mvdata | mvfn | mvvar | mvcs | (.bss) ]
+ * keep: sections stay where and as large as they were (-u)
  */
-uint64_t InfoArea::generate(Section *data) {
-    auto area_pos = 0ul;
-
-    area_pos += mvdata->generate(fpic, area_offset_start+area_pos, area_vaddr_start+area_pos);
-    area_pos += mvfn->generate(fpic, area_offset_start+area_pos, area_vaddr_start+area_pos, data);
-    area_pos += mvvar->generate(fpic, area_offset_start+area_pos, area_vaddr_start+area_pos, data);
-    area_pos += mvcs->generate(fpic, area_offset_start+area_pos, area_vaddr_start+area_pos, data);
+uint64_t InfoArea::generate(Section *data, bool keep) {
+    MVSection* secs[] = {mvdata, mvfn, mvvar, mvcs};
 
-    /* Shift and expand .bss in mem, move to end in file */
-    auto shift = bss->generate(area_offset_start + area_pos, area_vaddr_start + area_pos, area_vaddr_end);
+    /* sizing: offsets of all elements, mvfn_vaddr before mvfn is filled */
+    auto area_pos = 0ul;
+    GElf_Shdr shdr;
+    for (auto s : secs) {
+        if (keep && s->scn_in != nullptr) {
+            gelf_getshdr(s->scn_in, &shdr);
+            s->layout(fpic, shdr.sh_offset, shdr.sh_addr);
+            continue;
+        }
+        area_pos += s->layout(fpic, area_offset_start+area_pos, area_vaddr_start+area_pos);
+    }
 
-    /* Shrink Segment */
-    phdr.p_filesz -= shift;
-    gelf_update_phdr(e_out, ndx, &phdr);
+    /* fill: chunks of all sections on worker threads */
+    const size_t chunk = 1024;
+    vector<tuple<MVSection*, size_t, size_t>> chunks;
+    for (auto s : secs)
+        for (auto i = 0ul; i < s->n_slots(); i += chunk)
+            chunks.emplace_back(s, i, min(i + chunk, s->n_slots()));
+    atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i; (i = next++) < chunks.size();) {
+            auto [s, from, to] = chunks[i];
+            s->fill_slots(from, to);
+        }
+    };
+    vector<thread> pool;
+    auto threads = min<size_t>(thread::hardware_concurrency(), chunks.size());
+    for (auto t = 1ul; t < threads; t++)
+        pool.emplace_back(work);
+    work();
+    for (auto& t : pool)
+        t.join();
+
+    for (auto s : secs) {
+        s->finish(data);
+        if (keep)
+            s->pad();
+    }
 
-    return shift;
+    /* Shift and expand .bss in mem, segment sizes follow in layout */
+    if (!with_bss || keep)
+        return 0;
+    return bss->generate(area_offset_start + area_pos, area_vaddr_start + area_pos, area_vaddr_end);
 }
 
 //------------------MVSection--------------------------------
 bool MVSection::probe_rela(GElf_Rela *rela) {
-    if (rela->r_offset == start_ptr || rela->r_offset == stop_ptr)
+    return claim_rela(*rela, relocs);
+}
+
+/* start/stop_ptr are generated anew, thread safe for distinct owned */
+bool MVSection::claim_rela(const GElf_Rela &rela, std::vector<GElf_Rela> &owned) {
+    if (rela.r_offset == start_ptr || rela.r_offset == stop_ptr)
         return true;
-    return Section::probe_rela(rela);
+    if (scn_in == nullptr || !inside(rela.r_offset))
+        return false;
+    owned.push_back(rela);
+    return true;
+}
+
+/* Start sizing pass, no elements if the section is removed */
+void MVSection::add_slot(MVData *e, uint64_t size, size_t n) {
+    slots.push_back({e, size_out, n_relocs});
+    size_out += size;
+    n_relocs += fpic ? n : 0;
+}
+
+/* Output stays within the copied input buffer, fetched for the fill workers */
+void MVSection::end_layout() {
+    if (size_out > max_size)
+        throw std::runtime_error("Info section grows");
+    relocs.assign(n_relocs, GElf_Rela{});
+    buf_out = nullptr;
+    if (!slots.empty())
+        buf_out = static_cast<byte*>(elf_getdata(scn_out, nullptr)->d_buf);
+}
+
+size_t MVSection::fill_slot(const slot &s, std::byte *buf, GElf_Rela *rela) {
+    return s.e->make_info(fpic, buf, rela, vaddr + s.off);
+}
+
+void MVSection::fill_slots(size_t from, size_t to) {
+    for (auto i = from; i < to; i++)
+        fill_slot(slots[i], buf_out + slots[i].off, relocs.data() + slots[i].rel);
+}
+
+void MVSection::finish(Section *data) {
+    if (scn_out != nullptr) {
+        auto d = elf_getdata(scn_out, nullptr);
+        d->d_size = size_out;
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+
+        GElf_Shdr shdr;
+        gelf_getshdr(scn_in, &shdr);
+        shdr.sh_offset = offset;
+        shdr.sh_addr = vaddr;
+        shdr.sh_size = size_out;
+        gelf_update_shdr(scn_out, &shdr);
+        elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
+    }
+
+    /* start/stop_ptr for libmultiverse */
+    data->write_ptr(fpic, start_ptr, vaddr);
+    data->write_ptr(fpic, stop_ptr, vaddr+size_out);
+}
+
+/* Back to the input size, zeros behind the entries */
+void MVSection::pad() {
+    if (scn_out == nullptr)
+        return;
+    auto d = elf_getdata(scn_out, nullptr);
+    memset(static_cast<byte*>(d->d_buf) + size_out, 0, max_size - size_out);
+    d->d_size = max_size;
+
+    GElf_Shdr shdr;
+    gelf_getshdr(scn_out, &shdr);
+    shdr.sh_size = max_size;
+    gelf_update_shdr(scn_out, &shdr);
 }
 
 //-----------------MVFnSection-------------------------------
@@ -117,39 +223,16 @@ std::unique_ptr<std::vector<struct mv_info_fn>> MVFnSection::read() {
     return v;
 }
 
-uint64_t MVFnSection::generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data) {
-    relocs.clear();
-    auto ndx = 0;
-    /* no data -> section not needed */
-    if (scn_out != nullptr) {
-        /* data */
-        auto data = elf_getdata(scn_out, nullptr);
-        auto buf = static_cast<byte*>(data->d_buf);
-
-        for (auto& e:*fns) {
-            if (e->is_fixed())
-                continue;
-            ndx += e->make_info(fpic, buf+ndx, this, vaddr+ndx);
-        }
-        data->d_size = ndx;
-        elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-        
-        /* shdr */
-        GElf_Shdr shdr;
-        gelf_getshdr(scn_in, &shdr);
-
-        shdr.sh_offset = offset;
-        shdr.sh_addr = vaddr;
-        shdr.sh_size = ndx;
-
-        gelf_update_shdr(scn_out, &shdr);
-        elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
-    }
-    
-    /* start/stop_ptr for libmultiverse */
-    data->write_ptr(fpic, start_ptr, vaddr);
-    data->write_ptr(fpic, stop_ptr, vaddr+ndx);
-    return ndx;
+uint64_t MVFnSection::layout(bool _fpic, uint64_t _offset, uint64_t _vaddr) {
+    fpic = _fpic; offset = _offset; vaddr = _vaddr;
+    slots.clear();
+    size_out = n_relocs = 0;
+    if (scn_out != nullptr) // no data -> section not needed
+        for (auto& e:*fns)
+            if (!e->is_fixed())
+                add_slot(e.get(), sizeof(mv_info_fn), MVFn::info_relocs);
+    end_layout();
+    return size_out;
 }
 
 bool MVFnSection::is_needed(bool overr) {
@@ -181,39 +264,16 @@ std::unique_ptr<std::vector<struct mv_info_var>> MVVarSection::read() {
     return v;
 }
 
-uint64_t MVVarSection::generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data) {
-    relocs.clear();
-    auto ndx = 0;
-
-    if (scn_out != nullptr) { // no data -> section not needed
-        /* data */
-        auto data = elf_getdata(scn_out, nullptr);
-        auto buf = static_cast<byte*>(data->d_buf);
-
-        for (auto& e:*vars) {
-            if (e->frozen)
-                continue;
-            ndx += e->make_info(fpic, buf+ndx, this, vaddr+ndx);
-        }
-        data->d_size = ndx;
-        elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-        
-        /* shdr */
-        GElf_Shdr shdr;
-        gelf_getshdr(scn_in, &shdr);
-
-        shdr.sh_offset = offset;
-        shdr.sh_addr = vaddr;
-        shdr.sh_size = ndx;
-
-        gelf_update_shdr(scn_out, &shdr);
-        elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
-    }
-    
-    /* start/stop_ptr for libmultiverse */
-    data->write_ptr(fpic, start_ptr, vaddr);
-    data->write_ptr(fpic, stop_ptr, vaddr+ndx);
-    return ndx;
+uint64_t MVVarSection::layout(bool _fpic, uint64_t _offset, uint64_t _vaddr) {
+    fpic = _fpic; offset = _offset; vaddr = _vaddr;
+    slots.clear();
+    size_out = n_relocs = 0;
+    if (scn_out != nullptr) // no data -> section not needed
+        for (auto& e:*vars)
+            if (!e->frozen && !e->imported)
+                add_slot(e.get(), sizeof(mv_info_var), MVVar::info_relocs);
+    end_layout();
+    return size_out;
 }
 
 bool MVVarSection::is_needed(bool overr) {
@@ -244,38 +304,16 @@ std::unique_ptr<std::vector<struct mv_info_callsite>> MVCsSection::read() {
     return v;
 }
 
-uint64_t MVCsSection::generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data) {
-    relocs.clear();
-    auto ndx = 0;
-    if (scn_out != nullptr) { // no data -> section not needed
-        /* data */
-        auto data = elf_getdata(scn_out, nullptr);
-        auto buf = static_cast<byte*>(data->d_buf);
-
-        for (auto& e:*pps) {
-            if ( e->_fn->is_fixed() || e->pp.type == PP_TYPE_X86_JUMP)
-                continue;
-            ndx += e->make_info(fpic, buf+ndx, this, vaddr+ndx);
-        }
-        data->d_size = ndx;
-        elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-
-        /* shdr */
-        GElf_Shdr shdr;
-        gelf_getshdr(scn_in, &shdr);
-
-        shdr.sh_offset = offset;
-        shdr.sh_addr = vaddr;
-        shdr.sh_size = ndx;
-
-        gelf_update_shdr(scn_out, &shdr);
-        elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
-    }
-    
-    /* start/stop_ptr for libmultiverse */
-    data->write_ptr(fpic, start_ptr, vaddr);
-    data->write_ptr(fpic, stop_ptr, vaddr+ndx);
-    return ndx;
+uint64_t MVCsSection::layout(bool _fpic, uint64_t _offset, uint64_t _vaddr) {
+    fpic = _fpic; offset = _offset; vaddr = _vaddr;
+    slots.clear();
+    size_out = n_relocs = 0;
+    if (scn_out != nullptr) // no data -> section not needed
+        for (auto& e:*pps)
+            if (!e->_fn->is_fixed() && e->pp.type != PP_TYPE_X86_JUMP)
+                add_slot(e.get(), sizeof(mv_info_callsite), MVPP::info_relocs);
+    end_layout();
+    return size_out;
 }
 
 bool MVCsSection::is_needed(bool overr) {
@@ -286,39 +324,39 @@ void MVCsSection::set_pps(std::vector<std::unique_ptr<MVPP>> *_pps) {
     pps = _pps;
 }
 //------------------MVDataSection--------------------------------
-uint64_t MVDataSection::generate(bool fpic, uint64_t offset, uint64_t vaddr) {
-    relocs.clear();
-    if (scn_out == nullptr) { // no data -> section not needed
-        return 0;
-    }
+uint64_t MVDataSection::layout(bool _fpic, uint64_t _offset, uint64_t _vaddr) {
+    fpic = _fpic; offset = _offset; vaddr = _vaddr;
+    slots.clear();
+    size_out = n_relocs = 0;
+    if (scn_out != nullptr) // no data -> section not needed
+        for (auto& e:*fns)
+            if (!e->is_fixed())
+                add_slot(e.get(), e->layout_mvdata(vaddr + size_out), e->mvdata_relocs());
+    end_layout();
+    return size_out;
+}
 
-    /* data */
-    auto data = elf_getdata(scn_out, nullptr);
-    auto buf = static_cast<byte*>(data->d_buf);
+size_t MVDataSection::fill_slot(const slot &s, std::byte *buf, GElf_Rela *rela) {
+    return static_cast<MVFn*>(s.e)->make_mvdata(fpic, buf, rela, vaddr + s.off);
+}
+
+/* No start/stop ptrs, reached over mvfn */
+void MVDataSection::finish(Section *data) {
+    (void) data;
+    if (scn_out == nullptr)
+        return;
+    auto d = elf_getdata(scn_out, nullptr);
+    d->d_size = size_out;
+    elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
 
-    auto ndx = 0;
-    for (auto& e:*fns) {
-        if (e->is_fixed())
-            continue;
-        e->set_mvfn_vaddr(vaddr + ndx);
-        ndx += e->make_mvdata(fpic, buf+ndx, this, vaddr+ndx);
-    }
-    data->d_size = ndx;
-    elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-    
-    /* shdr */
     GElf_Shdr shdr;
     gelf_getshdr(scn_in, &shdr);
-
     shdr.sh_offset = offset;
     shdr.sh_addr = vaddr;
-    shdr.sh_size = ndx;
+    shdr.sh_size = size_out;
     //shdr.sh_addralign = 1; // ToDo(Felix): why 16?
-
     gelf_update_shdr(scn_out, &shdr);
     elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
-
-    return ndx;
 }
 
 bool MVDataSection::is_needed(bool overr) {
@@ -361,6 +399,7 @@ uint64_t BssSection::new_sz() {
 //------------------Dynamic------------------------------------
 void Dynamic::load(Elf_Scn *scn_in) {
     Section::load(scn_in);
+    dyns.clear();
     auto d = elf_getdata(scn_in, nullptr);
     GElf_Shdr shdr;
     gelf_getshdr(scn_in, &shdr);
@@ -396,7 +435,7 @@ void Dynamic::write() {
     auto d = elf_getdata(scn_out, nullptr);
     for (auto& dyn : dyns) 
         if (!gelf_update_dyn(d, i++, dyn.get()))
-            cout << "Error: gelf_update_dyn() " << elf_errmsg(elf_errno()) << endl;
+            cerr << "Error: gelf_update_dyn() " << elf_errmsg(elf_errno()) << endl;
     elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
 
     /* shdr */
@@ -410,12 +449,16 @@ void Dynamic::write() {
 }
 
 //------------------Section------------------------------------
-void Section::add_rela(uint64_t source, uint64_t target) {
+const GElf_Rela make_rela(uint64_t source, uint64_t target) {
     GElf_Rela rela;
     rela.r_addend = target;
     rela.r_info = R_X86_64_RELATIVE;
     rela.r_offset = source;
-    relocs.push_back(rela);
+    return rela;
+}
+
+void Section::add_rela(uint64_t source, uint64_t target) {
+    relocs.push_back(make_rela(source, target));
 }
 
 const std::byte* Section::in_buf() {
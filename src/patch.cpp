@@ -0,0 +1,326 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gelf.h>
+
+#include "patch.h"
+#include "sha256.h"
+
+using namespace std;
+
+static const uint32_t PATCH_VERSION = 1;
+static const size_t BLOCK = 32; // shortest copy
+
+/* Read-only mapping of a whole file */
+class Mapped {
+public:
+    Mapped(const char *path) {
+        struct stat st;
+        if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+            throw std::runtime_error("open "s + path + " failed. " + strerror(errno));
+        mode = st.st_mode;
+        size = st.st_size;
+        if (size == 0)
+            return;
+        auto m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap "s + path + " failed. " + strerror(errno));
+        }
+        p = static_cast<const byte*>(m);
+    }
+    ~Mapped() {
+        if (p != nullptr)
+            munmap(const_cast<byte*>(p), size);
+        close(fd);
+    }
+
+    const byte *p = nullptr;
+    size_t size = 0;
+    mode_t mode;
+private:
+    int fd;
+};
+
+static string sha_hex(const byte *p, size_t len) {
+    Sha256 sha;
+    sha.update(p, len);
+    return sha.hex();
+}
+
+/* NT_GNU_BUILD_ID as hex, "" if none or not ELF */
+static string build_id(const Mapped &m) {
+    string id;
+    auto e = elf_memory(const_cast<char*>(reinterpret_cast<const char*>(m.p)), m.size);
+    if (e == nullptr)
+        return id;
+    Elf_Scn *scn = nullptr;
+    GElf_Shdr shdr;
+    while (id.empty() && (scn = elf_nextscn(e, scn)) != nullptr) {
+        if (gelf_getshdr(scn, &shdr) == nullptr || shdr.sh_type != SHT_NOTE)
+            continue;
+        auto d = elf_getdata(scn, nullptr);
+        GElf_Nhdr nhdr;
+        size_t off = 0, name_off, desc_off;
+        while (d != nullptr && (off = gelf_getnote(d, off, &nhdr, &name_off, &desc_off)) > 0) {
+            auto buf = static_cast<const uint8_t*>(d->d_buf);
+            if (nhdr.n_type != NT_GNU_BUILD_ID || nhdr.n_namesz != 4
+                    || memcmp(buf + name_off, "GNU", 4) != 0)
+                continue;
+            static const char digits[] = "0123456789abcdef";
+            for (auto i=0u; i < nhdr.n_descsz; i++) {
+                id += digits[buf[desc_off+i] >> 4];
+                id += digits[buf[desc_off+i] & 0xf];
+            }
+            break;
+        }
+    }
+    elf_end(e);
+    return id;
+}
+
+static uint64_t block_hash(const byte *p) {
+    uint64_t h = 0xcbf29ce484222325; // FNV-1a
+    for (auto i=0u; i < BLOCK; i++)
+        h = (h ^ uint8_t(p[i])) * 0x100000001b3;
+    return h;
+}
+
+/*
+ * Greedy: copies of at least BLOCK bytes from the base, tried at the end
+ * of the last copy, the same offset & an aligned block of equal hash.
+ */
+BinaryPatch BinaryPatch::diff(const char *base, const char *target) {
+    if (elf_version(EV_CURRENT) == EV_NONE)
+        throw std::runtime_error("libelf init failed");
+    Mapped b{base}, t{target};
+    BinaryPatch patch;
+    patch.base_build_id = build_id(b);
+    patch.base_sha = sha_hex(b.p, b.size);
+    patch.base_size = b.size;
+    patch.target_sha = sha_hex(t.p, t.size);
+    patch.target_size = t.size;
+
+    unordered_map<uint64_t, uint64_t> blocks; // hash -> first base offset
+    for (uint64_t off = 0; off + BLOCK <= b.size; off += BLOCK)
+        blocks.emplace(block_hash(b.p + off), off);
+
+    uint64_t lit = 0, next = 0;
+    auto flush = [&](uint64_t end) {
+        if (end > lit)
+            patch.ops.push_back({OP_DATA, 0, end - lit, {t.p + lit, t.p + end}});
+    };
+    for (uint64_t i = 0; i < t.size;) {
+        uint64_t from = UINT64_MAX;
+        if (i + BLOCK <= t.size) {
+            auto it = blocks.find(block_hash(t.p + i));
+            uint64_t cands[] = { next, i, it != blocks.end() ? it->second : UINT64_MAX };
+            for (auto c : cands)
+                if (b.size >= BLOCK && c <= b.size - BLOCK && memcmp(t.p + i, b.p + c, BLOCK) == 0) {
+                    from = c;
+                    break;
+                }
+        }
+        if (from == UINT64_MAX) {
+            uint64_t run = 1;
+            while (i + run < t.size && t.p[i+run] == t.p[i])
+                run++;
+            if (run >= BLOCK) { // guard fill
+                flush(i);
+                patch.ops.push_back({OP_FILL, 0, run, {t.p[i]}});
+                lit = i + run;
+            }
+            i += run >= BLOCK ? run : 1;
+            continue;
+        }
+        auto len = BLOCK;
+        while (i + len < t.size && from + len < b.size && t.p[i+len] == b.p[from+len])
+            len++;
+        flush(i);
+        patch.ops.push_back({OP_COPY, from, len, {}});
+        i += len;
+        lit = i;
+        next = from + len;
+    }
+    flush(t.size);
+    return patch;
+}
+
+template<typename T>
+static void put(vector<byte> &buf, const T &v) {
+    auto p = reinterpret_cast<const byte*>(&v);
+    buf.insert(buf.end(), p, p+sizeof(T));
+}
+
+static void put_str(vector<byte> &buf, const string &s) {
+    put(buf, static_cast<uint64_t>(s.size()));
+    auto p = reinterpret_cast<const byte*>(s.data());
+    buf.insert(buf.end(), p, p+s.size());
+}
+
+void BinaryPatch::save(const char *patch_file) {
+    vector<byte> buf;
+    buf.insert(buf.end(), reinterpret_cast<const byte*>(PATCH_MAGIC),
+            reinterpret_cast<const byte*>(PATCH_MAGIC) + sizeof(PATCH_MAGIC));
+    put(buf, PATCH_VERSION);
+    put_str(buf, base_build_id);
+    put_str(buf, base_sha);
+    put(buf, base_size);
+    put_str(buf, target_sha);
+    put(buf, target_size);
+    put(buf, static_cast<uint64_t>(ops.size()));
+    for (auto& o : ops) {
+        put(buf, o.type);
+        if (o.type == OP_COPY)
+            put(buf, o.offset);
+        put(buf, o.len);
+        buf.insert(buf.end(), o.bytes.cbegin(), o.bytes.cend()); // DATA: len, FILL: 1
+    }
+    Sha256 sha;
+    sha.update(buf.data(), buf.size());
+    auto digest = sha.digest();
+    auto d = reinterpret_cast<const byte*>(digest.data());
+    buf.insert(buf.end(), d, d + digest.size());
+
+    ofstream out{patch_file, ios::binary | ios::trunc};
+    if (!out.write(reinterpret_cast<const char*>(buf.data()), buf.size()))
+        throw std::runtime_error("write "s + patch_file + " failed.");
+}
+
+BinaryPatch BinaryPatch::load(const char *patch_file) {
+    ifstream in{patch_file, ios::binary};
+    if (!in)
+        throw std::runtime_error("open "s + patch_file + " failed.");
+    vector<char> raw{istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+    auto buf = reinterpret_cast<const byte*>(raw.data());
+    array<uint8_t, 32> digest;
+    if (raw.size() < sizeof(PATCH_MAGIC) + digest.size()
+            || memcmp(buf, PATCH_MAGIC, sizeof(PATCH_MAGIC)) != 0)
+        throw std::runtime_error(patch_file + " is not a bintail patch"s);
+    auto size = raw.size() - digest.size();
+    Sha256 sha;
+    sha.update(buf, size);
+    digest = sha.digest();
+    if (memcmp(buf + size, digest.data(), digest.size()) != 0)
+        throw std::runtime_error(patch_file + ": checksum mismatch"s);
+
+    size_t pos = sizeof(PATCH_MAGIC);
+    auto take = [&](size_t len) {
+        if (len > size - pos)
+            throw std::runtime_error(patch_file + " truncated"s);
+        pos += len;
+        return buf + pos - len;
+    };
+    auto get = [&](auto &v) { memcpy(&v, take(sizeof(v)), sizeof(v)); };
+    auto get_str = [&](string &s) {
+        uint64_t len;
+        get(len);
+        auto p = reinterpret_cast<const char*>(take(len));
+        s.assign(p, len);
+    };
+
+    BinaryPatch patch;
+    uint32_t version;
+    get(version);
+    if (version != PATCH_VERSION)
+        throw std::runtime_error(patch_file + ": unsupported version "s + to_string(version));
+    get_str(patch.base_build_id);
+    get_str(patch.base_sha);
+    get(patch.base_size);
+    get_str(patch.target_sha);
+    get(patch.target_size);
+    uint64_t n;
+    get(n);
+    for (auto i=0u; i < n; i++) {
+        op o;
+        get(o.type);
+        if (o.type != OP_COPY && o.type != OP_DATA && o.type != OP_FILL)
+            throw std::runtime_error(patch_file + ": bad op"s);
+        o.offset = 0;
+        if (o.type == OP_COPY)
+            get(o.offset);
+        get(o.len);
+        if (o.type != OP_COPY) {
+            auto n = o.type == OP_DATA ? o.len : 1;
+            auto p = take(n);
+            o.bytes.assign(p, p + n);
+        }
+        patch.ops.push_back(move(o));
+    }
+    return patch;
+}
+
+/* Target next to outfile, renamed into place once it checks out */
+void BinaryPatch::apply(const char *base, const char *outfile) {
+    if (elf_version(EV_CURRENT) == EV_NONE)
+        throw std::runtime_error("libelf init failed");
+    Mapped b{base};
+    if (b.size != base_size || sha_hex(b.p, b.size) != base_sha) {
+        auto id = build_id(b);
+        if (!base_build_id.empty() && id != base_build_id)
+            throw std::runtime_error("Patch is for build-id " + base_build_id + ", "
+                    + base + " has " + (id.empty() ? "none"s : id));
+        throw std::runtime_error(base + " is not the base of this patch"s);
+    }
+
+    auto tmp = string(outfile) + ".XXXXXX";
+    int fd = mkstemp(tmp.data());
+    if (fd == -1)
+        throw std::runtime_error("mkstemp "s + tmp + " failed. " + strerror(errno));
+    byte *out = nullptr;
+    try {
+        if (ftruncate(fd, target_size) == -1)
+            throw std::runtime_error("ftruncate "s + tmp + " failed. " + strerror(errno));
+        if (target_size > 0) {
+            auto m = mmap(nullptr, target_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED)
+                throw std::runtime_error("mmap "s + tmp + " failed. " + strerror(errno));
+            out = static_cast<byte*>(m);
+        }
+        uint64_t pos = 0;
+        for (auto& o : ops) {
+            if (o.len > target_size - pos || (o.type == OP_COPY
+                        && (o.offset > base_size || o.len > base_size - o.offset)))
+                throw std::runtime_error("Patch op out of bounds");
+            if (o.type == OP_FILL)
+                memset(out + pos, int(o.bytes[0]), o.len);
+            else
+                memcpy(out + pos, o.type == OP_COPY ? b.p + o.offset : o.bytes.data(), o.len);
+            pos += o.len;
+        }
+        if (pos != target_size || sha_hex(out, target_size) != target_sha)
+            throw std::runtime_error("Patched "s + outfile + " does not match the patch target");
+        if (out != nullptr)
+            munmap(out, target_size);
+        out = nullptr;
+        fchmod(fd, b.mode & 07777);
+        close(fd);
+        fd = -1;
+        if (rename(tmp.c_str(), outfile) == -1)
+            throw std::runtime_error("rename "s + tmp + " failed. " + strerror(errno));
+    } catch (...) {
+        if (out != nullptr)
+            munmap(out, target_size);
+        if (fd != -1)
+            close(fd);
+        unlink(tmp.c_str());
+        throw;
+    }
+}
+
+void BinaryPatch::print() {
+    uint64_t copies = 0, data = 0;
+    for (auto& o : ops)
+        (o.type == OP_DATA ? data : copies) += o.len;
+    cout << "base " << (base_build_id.empty() ? "(no build-id)" : base_build_id)
+         << " " << base_sha.substr(0, 16) << " " << base_size << " bytes\n"
+         << "target " << target_sha.substr(0, 16) << " " << target_size << " bytes\n"
+         << ops.size() << " ops: " << copies << " bytes copied or filled, " << data << " bytes new\n";
+}
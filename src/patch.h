@@ -0,0 +1,46 @@
+#ifndef __PATCH_H
+#define __PATCH_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#define PATCH_MAGIC "BTPATCH"
+
+/*
+ * Binary patch from a base file to a target file, e.g. stock -> tailored
+ * or one configuration -> another.
+ *
+ * Header: magic, version, build-id & sha256/size of base and target.
+ * Ops write the target front to back: COPY (base offset, length) for
+ * unchanged or moved ranges (sections shifted by the layout), FILL
+ * (length, byte) for guarded code and DATA (bytes) for the rest. A
+ * sha256 of everything before it closes the file. apply() maps the
+ * base, checks it against the header, writes the target through a shared
+ * mapping & renames it into place.
+ */
+class BinaryPatch {
+public:
+    static BinaryPatch diff(const char *base, const char *target);
+    static BinaryPatch load(const char *patch_file);
+    void save(const char *patch_file);
+    void apply(const char *base, const char *outfile);
+    void print();
+
+    std::string base_build_id; // hex, empty if the base has none
+    std::string base_sha;
+    uint64_t base_size;
+    std::string target_sha;
+    uint64_t target_size;
+private:
+    enum kind : uint8_t { OP_COPY = 1, OP_DATA = 2, OP_FILL = 3 };
+    struct op {
+        kind type;
+        uint64_t offset; // OP_COPY: in base
+        uint64_t len;
+        std::vector<std::byte> bytes; // OP_DATA, OP_FILL: the byte
+    };
+    std::vector<op> ops;
+};
+#endif
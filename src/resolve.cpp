@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+DecisionTable::DecisionTable(const vector<shared_ptr<MVVar>> &vars,
+        const vector<unique_ptr<MVFn>> &model) {
+    unordered_map<MVVar*, uint32_t> ndx;
+    for (auto i=0u; i < vars.size(); i++)
+        ndx[vars[i].get()] = i;
+
+    /* interval k of a var: [bounds[k-1], bounds[k]) */
+    bounds.resize(vars.size());
+    for (auto& fn : model)
+        for (auto& m : fn->variants())
+            for (auto& a : m->get_assigns())
+                if (a->var != nullptr) {
+                    auto& b = bounds[ndx.at(a->var)];
+                    b.push_back(a->lower());
+                    b.push_back(int64_t(a->upper()) + 1);
+                }
+    for (auto& b : bounds) {
+        sort(b.begin(), b.end());
+        b.erase(unique(b.begin(), b.end()), b.end());
+    }
+
+    for (auto& fn : model) {
+        auto& vs = fn->variants();
+        uint32_t words = (vs.size() + 63) / 64;
+        fn_entry f{uint32_t(terms.size()), 0, words, uint32_t(bits.size())};
+        bits.resize(bits.size() + words);
+        vector<uint32_t> used;
+        for (auto i=0u; i < vs.size(); i++) {
+            auto& as = vs[i]->get_assigns();
+            if (none_of(as.cbegin(), as.cend(), [](auto& a) { return a->var == nullptr; }))
+                bits[f.init + i/64] |= 1ul << (i%64);
+            for (auto& a : as)
+                if (a->var != nullptr)
+                    used.push_back(ndx.at(a->var));
+        }
+        sort(used.begin(), used.end());
+        used.erase(unique(used.begin(), used.end()), used.end());
+
+        for (auto k : used) {
+            auto& b = bounds[k];
+            term t{k, uint32_t(bits.size())};
+            bits.resize(bits.size() + (b.size() + 2) * words);
+            for (auto i=0u; i < vs.size(); i++) {
+                auto& as = vs[i]->get_assigns();
+                auto bit = 1ul << (i%64);
+                for (auto row=0u; row < b.size() + 2; row++) {
+                    /* a value of the interval, last row: not frozen */
+                    auto v = row == 0 ? b.front() - 1 : b[row-1];
+                    auto ok = all_of(as.cbegin(), as.cend(), [&](auto& a) {
+                        return a->var != vars[k].get() || (row <= b.size()
+                            && v >= a->lower() && v <= a->upper());
+                    });
+                    if (ok)
+                        bits[t.rows + row*words + i/64] |= bit;
+                }
+            }
+            terms.push_back(t);
+            f.n_terms++;
+        }
+        fns.push_back(f);
+    }
+}
+
+void DecisionTable::resolve(const vector<int64_t> &values, const vector<bool> &frozen,
+        vector<int> &choice) const {
+    vector<uint32_t> row(bounds.size());
+    for (auto k=0u; k < bounds.size(); k++) {
+        auto& b = bounds[k];
+        row[k] = frozen[k] ? upper_bound(b.cbegin(), b.cend(), values[k]) - b.cbegin()
+            : b.size() + 1;
+    }
+
+    choice.resize(fns.size());
+    vector<uint64_t> acc;
+    for (auto i=0u; i < fns.size(); i++) {
+        auto& f = fns[i];
+        acc.assign(bits.begin() + f.init, bits.begin() + f.init + f.words);
+        for (auto t = terms.data() + f.terms; t != terms.data() + f.terms + f.n_terms; t++) {
+            auto r = bits.data() + t->rows + row[t->var] * f.words;
+            for (auto w=0u; w < f.words; w++) // vectorized for wide functions
+                acc[w] &= r[w];
+        }
+        choice[i] = -1;
+        for (auto w=0u; w < f.words; w++)
+            if (acc[w] != 0) {
+                choice[i] = w*64 + __builtin_ctzl(acc[w]);
+                break;
+            }
+    }
+}
+
+const DecisionTable& Bintail::decisions() {
+    if (table == nullptr)
+        table = make_unique<DecisionTable>(vars, fns);
+    return *table;
+}
+
+vector<MVmvfn*> Bintail::resolve(const Config &cfg) {
+    auto& t = decisions();
+    vector<int64_t> values(vars.size());
+    vector<bool> frozen(vars.size());
+    for (auto i=0u; i < vars.size(); i++) {
+        auto& v = vars[i];
+        values[i] = v->value();
+        frozen[i] = v->frozen || cfg.apply_all
+            || find(cfg.apply.cbegin(), cfg.apply.cend(), v->name()) != cfg.apply.cend();
+    }
+    for (auto& [var, value] : cfg.changes)
+        for (auto i=0u; i < vars.size(); i++)
+            if (var == vars[i]->name())
+                values[i] = value;
+
+    vector<int> choice;
+    t.resolve(values, frozen, choice);
+    vector<MVmvfn*> sel(fns.size(), nullptr);
+    for (auto i=0u; i < fns.size(); i++)
+        if (choice[i] >= 0)
+            sel[i] = fns[i]->variants()[choice[i]].get();
+    return sel;
+}
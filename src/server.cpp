@@ -0,0 +1,194 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+using namespace std;
+
+Server::Server(const char *_sock_path, unsigned _workers, size_t _lru_size)
+    :sock_path{_sock_path}, workers{_workers}, lru_size{_lru_size} {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (sock_path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Socket path too long");
+    strcpy(addr.sun_path, sock_path.c_str());
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        throw std::runtime_error("socket failed. "s + strerror(errno));
+    struct stat st;
+    if (lstat(sock_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(sock);
+            throw std::runtime_error(sock_path + " exists and is not a socket");
+        }
+        unlink(sock_path.c_str()); // stale socket of previous run
+    }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || listen(sock, SOMAXCONN) == -1) {
+        close(sock);
+        throw std::runtime_error("bind "s + sock_path + " failed. " + strerror(errno));
+    }
+}
+
+Server::~Server() {
+    close(sock);
+    unlink(sock_path.c_str());
+}
+
+void Server::run() {
+    vector<thread> pool;
+    for (auto i=0u; i < max(workers, 1u); i++)
+        pool.emplace_back(&Server::worker, this);
+    cout << "bintail: serving on " << sock_path << "\n";
+
+    int conn;
+    while ((conn = accept(sock, nullptr, nullptr)) != -1 || errno == EINTR) {
+        if (conn == -1)
+            continue;
+        lock_guard<mutex> l{queue_lock};
+        conns.push(conn);
+        queue_cv.notify_one();
+    }
+    throw std::runtime_error("accept failed. "s + strerror(errno));
+}
+
+void Server::worker() {
+    for (;;) {
+        int conn;
+        {
+            unique_lock<mutex> l{queue_lock};
+            queue_cv.wait(l, [this] { return !conns.empty(); });
+            conn = conns.front();
+            conns.pop();
+        }
+        serve(conn);
+        close(conn);
+    }
+}
+
+/* Read request lines, collect fds sent along */
+void Server::serve(int conn) {
+    string buf;
+    vector<int> fds;
+    char chunk[4096];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+
+    for (;;) {
+        size_t nl;
+        while ((nl = buf.find('\n')) != string::npos) {
+            auto reply = handle(buf.substr(0, nl), fds) + "\n";
+            buf.erase(0, nl+1);
+            if (::write(conn, reply.data(), reply.size()) != (ssize_t)reply.size())
+                return;
+        }
+
+        struct iovec iov = { chunk, sizeof(chunk) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        auto n = recvmsg(conn, &msg, 0);
+        if (n <= 0)
+            break;
+        for (auto c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            auto nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            auto p = reinterpret_cast<int*>(CMSG_DATA(c));
+            fds.insert(fds.end(), p, p+nfds);
+        }
+        buf.append(chunk, n);
+    }
+    for (auto fd : fds)
+        close(fd);
+}
+
+string Server::handle(const string &line, vector<int> &fds) {
+    auto start = chrono::steady_clock::now();
+    try {
+        Config cfg;
+        auto args = cfg.parse(line);
+        if (args.size() != 2)
+            throw std::runtime_error("Expected infile outfile");
+
+        auto hit = false;
+        auto entry = lookup(args[0], hit);
+        lock_guard<mutex> l{entry->lock};
+        auto& bintail = *entry->bintail;
+        try {
+            if (args[1] == "-") {
+                if (fds.empty())
+                    throw std::runtime_error("No fd passed for outfile -");
+                auto fd = fds.front();
+                fds.erase(fds.begin());
+                bintail.init_write(fd, cfg.drops_info());
+            } else {
+                bintail.init_write(args[1].c_str(), cfg.drops_info());
+            }
+            bintail.apply_config(cfg);
+            bintail.write(cfg.undo, cfg.huge_text);
+            bintail.reset(); // close outfile before reply
+        } catch (...) {
+            bintail.reset(); // cached model as freshly loaded
+            throw;
+        }
+
+        auto usec = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+        return "ok "s + (hit ? "hit " : "miss ") + to_string(usec);
+    } catch (const std::exception &e) {
+        return "error "s + e.what();
+    }
+}
+
+static bool same_file(const struct stat &st, dev_t dev, ino_t ino, const struct timespec &mtime) {
+    return st.st_dev == dev && st.st_ino == ino
+        && st.st_mtim.tv_sec == mtime.tv_sec
+        && st.st_mtim.tv_nsec == mtime.tv_nsec;
+}
+
+shared_ptr<Server::Entry> Server::lookup(const string &path, bool &hit) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw std::runtime_error("stat "s + path + " failed. " + strerror(errno));
+
+    {
+        lock_guard<mutex> l{lru_lock};
+        for (auto it = lru.begin(); it != lru.end(); it++) {
+            auto& e = *it;
+            if (e->path != path)
+                continue;
+            if (!same_file(st, e->dev, e->ino, e->mtime)) { // relinked
+                lru.erase(it);
+                break;
+            }
+            hit = true;
+            lru.splice(lru.begin(), lru, it);
+            return e;
+        }
+    }
+
+    /* Parse without holding the lru */
+    auto e = make_shared<Entry>();
+    e->path = path;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+    e->bintail = make_unique<Bintail>(path.c_str());
+
+    lock_guard<mutex> l{lru_lock};
+    lru.push_front(e);
+    while (lru.size() > lru_size)
+        lru.pop_back(); // in-flight requests keep their entry
+    return e;
+}
@@ -0,0 +1,55 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include <list>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/stat.h>
+
+#include <bintail/bintail.h>
+
+/*
+ * Tailoring daemon on a unix stream socket.
+ *
+ * One request per line, same syntax as the command line:
+ *   [-s var=value] [-a var] [-A] [-g] infile outfile
+ * outfile "-" writes to the fd passed along with the line (SCM_RIGHTS).
+ * Reply: "ok <hit|miss> <usec>" or "error <msg>".
+ */
+class Server {
+public:
+    Server(const char *sock_path, unsigned workers, size_t lru_size);
+    ~Server();
+    void run();
+
+private:
+    /* Parsed input, keyed by path, inode & mtime */
+    struct Entry {
+        std::string path;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        std::mutex lock;
+        std::unique_ptr<Bintail> bintail;
+    };
+
+    std::shared_ptr<Entry> lookup(const std::string &path, bool &hit);
+    void worker();
+    void serve(int conn);
+    std::string handle(const std::string &line, std::vector<int> &fds);
+
+    std::string sock_path;
+    int sock;
+    unsigned workers;
+    size_t lru_size;
+
+    std::mutex lru_lock;
+    std::list<std::shared_ptr<Entry>> lru; // most recent first
+
+    std::mutex queue_lock;
+    std::condition_variable queue_cv;
+    std::queue<int> conns;
+};
+#endif
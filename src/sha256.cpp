@@ -0,0 +1,113 @@
+#include <stdexcept>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sha256.h"
+
+using namespace std;
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+Sha256::Sha256() :h{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}, buf_len{0}, total{0} { }
+
+void Sha256::block(const uint8_t *p) {
+    uint32_t w[64];
+    for (auto i=0; i < 16; i++)
+        w[i] = uint32_t(p[4*i]) << 24 | uint32_t(p[4*i+1]) << 16 | uint32_t(p[4*i+2]) << 8 | p[4*i+3];
+    for (auto i=16; i < 64; i++) {
+        auto s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+        auto s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (auto i=0; i < 64; i++) {
+        auto t1 = hh + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        auto t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+void Sha256::update(const void *data, size_t len) {
+    auto p = static_cast<const uint8_t*>(data);
+    total += len;
+    if (buf_len > 0) {
+        auto n = min(len, 64 - buf_len);
+        memcpy(buf + buf_len, p, n);
+        buf_len += n;
+        p += n;
+        len -= n;
+        if (buf_len < 64)
+            return;
+        block(buf);
+        buf_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        block(p);
+    memcpy(buf, p, len);
+    buf_len = len;
+}
+
+array<uint8_t, 32> Sha256::digest() {
+    uint64_t bits = total * 8;
+    uint8_t pad[72] = { 0x80 };
+    auto pad_len = (buf_len < 56 ? 56 : 120) - buf_len;
+    for (auto i=0; i < 8; i++)
+        pad[pad_len + i] = bits >> (56 - 8*i);
+    update(pad, pad_len + 8);
+
+    array<uint8_t, 32> out;
+    for (auto i=0; i < 8; i++)
+        for (auto j=0; j < 4; j++)
+            out[4*i+j] = h[i] >> (24 - 8*j);
+    return out;
+}
+
+string Sha256::hex() {
+    static const char digits[] = "0123456789abcdef";
+    string s;
+    for (auto b : digest()) {
+        s += digits[b >> 4];
+        s += digits[b & 0xf];
+    }
+    return s;
+}
+
+string Sha256::file(const char *path) {
+    int fd;
+    struct stat st;
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1)
+            close(fd);
+        throw std::runtime_error("open "s + path + " failed. " + strerror(errno));
+    }
+    Sha256 sha;
+    if (st.st_size > 0) {
+        auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap "s + path + " failed. " + strerror(errno));
+        }
+        sha.update(p, st.st_size);
+        munmap(p, st.st_size);
+    }
+    close(fd);
+    return sha.hex();
+}
@@ -0,0 +1,26 @@
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <array>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/* FIPS 180-4 SHA-256, for content addressing */
+class Sha256 {
+public:
+    Sha256();
+    void update(const void *data, size_t len);
+    std::array<uint8_t, 32> digest();
+    std::string hex();
+
+    static std::string file(const char *path); // hex digest
+private:
+    void block(const uint8_t *p);
+
+    uint32_t h[8];
+    uint8_t buf[64];
+    size_t buf_len;
+    uint64_t total;
+};
+#endif
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+#include "x86len.h"
+
+using namespace std;
+
+/**
+ * Calls & tail jumps from selected variants to the generic entry of a
+ * fixed function go straight to its variant, with constant/nop bodies
+ * inlined like patchpoints. Bodies reached that way are scanned too
+ * until nothing changes. Callsites not listed in
+ * __multiverse_callsite_ would take the entry jmp otherwise.
+ */
+void Bintail::specialize_calls() {
+    unordered_map<uint64_t, MVFn*> fixed_at;
+    deque<MVmvfn*> work;
+    unordered_set<uint64_t> seen;
+    for (auto& fn : fns) {
+        auto pfn = fn->select();
+        if (!fn->is_fixed() || pfn == nullptr)
+            continue;
+        fixed_at.emplace(fn->location(), fn.get());
+        if (seen.insert(pfn->location()).second)
+            work.push_back(pfn);
+    }
+
+    unsigned n = 0;
+    while (!work.empty()) {
+        auto body = work.front();
+        work.pop_front();
+        auto op = reinterpret_cast<uint8_t*>(text.out_buf(body->location()));
+        for (size_t off = 0; off < body->size();) {
+            x86_insn insn;
+            if (x86_insn_decode(op + off, body->size() - off, insn) == 0)
+                break; // data in text, stop here
+            auto at = body->location() + off;
+            auto opcode = op[off];
+            off += insn.len;
+            if ((opcode != 0xe8 && opcode != 0xe9) || insn.rel_size != 4)
+                continue;
+            auto it = fixed_at.find(at + insn.len + *reinterpret_cast<int32_t*>(op + off - 4));
+            if (it == fixed_at.end())
+                continue;
+            auto pfn = it->second->select();
+            if (opcode == 0xe8) {
+                mv_info_callsite cs{it->first, at};
+                MVPP{cs, &text}.patchpoint_apply(pfn, &text);
+            } else {
+                *reinterpret_cast<int32_t*>(op + off - 4) = pfn->location() - (at + insn.len);
+            }
+            specialized.push_back({at, it->second});
+            n++;
+            if (seen.insert(pfn->location()).second)
+                work.push_back(pfn);
+        }
+    }
+    if (n != 0)
+        cerr << " specialized=" << n << " ";
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <unordered_map>
+#include <gelf.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+/**
+ * Drop .symtab entries in code guarded by apply: variants not selected,
+ * folded duplicates and the inside of generic bodies. .strtab is rebuilt
+ * from the names left. Symbols of relocations against .symtab
+ * (--emit-relocs) stay, their indices are remapped.
+ */
+void Bintail::gc_syms() {
+    vector<pair<uint64_t, uint64_t>> dead;
+    for (auto& fn : fns) {
+        MVmvfn *pfn;
+        if (!fn->is_fixed() || (pfn = fn->select()) == nullptr)
+            continue;
+        for (auto& m : fn->variants())
+            if (m->location() != pfn->location())
+                dead.push_back({m->location(), m->location() + m->size()});
+        dead.push_back({fn->location() + 1, fn->location() + fn->size()});
+    }
+    for (auto& b : folded)
+        dead.push_back({b.location, b.location + b.size});
+    sort(dead.begin(), dead.end());
+    auto in_dead = [&](uint64_t addr) {
+        auto it = upper_bound(dead.cbegin(), dead.cend(), make_pair(addr, UINT64_MAX));
+        return it != dead.cbegin() && addr < prev(it)->second;
+    };
+
+    vector<bool> keep(syms.size(), true);
+    for (auto i=1u; i < syms.size(); i++) {
+        auto& s = syms[i].sym;
+        auto type = GELF_ST_TYPE(s.st_info);
+        if (type != STT_SECTION && type != STT_FILE && s.st_shndx != SHN_UNDEF
+                && s.st_shndx < SHN_LORESERVE && in_dead(s.st_value))
+            keep[i] = false;
+    }
+
+    GElf_Shdr shdr;
+    Elf_Scn *scn = nullptr;
+    auto symtab_ndx = elf_ndxscn(symtab_scn_out);
+    vector<Elf_Data*> sym_relocs;
+    while ((scn = elf_nextscn(e_out, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_type != SHT_RELA || shdr.sh_link != symtab_ndx)
+            continue;
+        auto d = elf_getdata(scn, nullptr);
+        for (auto i=0u; i < d->d_size / shdr.sh_entsize; i++) {
+            GElf_Rela rela;
+            gelf_getrela(d, i, &rela);
+            keep[GELF_R_SYM(rela.r_info)] = true;
+        }
+        sym_relocs.push_back(d);
+    }
+    if (find(keep.cbegin(), keep.cend(), false) == keep.cend())
+        return;
+
+    /* new indices, first global one in sh_info */
+    GElf_Shdr sym_shdr;
+    gelf_getshdr(symtab_scn_out, &sym_shdr);
+    vector<size_t> ndx(syms.size());
+    vector<symbol> live;
+    auto locals = 0u;
+    for (auto i=0u; i < syms.size(); i++) {
+        if (!keep[i])
+            continue;
+        ndx[i] = live.size();
+        locals += i < sym_shdr.sh_info;
+        live.push_back(syms[i]);
+    }
+    syms = move(live);
+    sym_shdr.sh_info = locals;
+    gelf_update_shdr(symtab_scn_out, &sym_shdr);
+
+    for (auto d : sym_relocs) {
+        for (auto i=0u; i < d->d_size / sizeof(GElf_Rela); i++) {
+            GElf_Rela rela;
+            gelf_getrela(d, i, &rela);
+            rela.r_info = GELF_R_INFO(ndx[GELF_R_SYM(rela.r_info)], GELF_R_TYPE(rela.r_info));
+            gelf_update_rela(d, i, &rela);
+        }
+        elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+    }
+
+    /* names, unless .strtab holds the section names too */
+    size_t shstrndx;
+    elf_getshdrstrndx(e_in, &shstrndx);
+    auto shstr = find_if(scn_map.cbegin(), scn_map.cend(), [&](auto &m) {
+        return elf_ndxscn(m.first) == shstrndx;
+    });
+    if (shstr != scn_map.cend() && shstr->second != nullptr
+            && elf_ndxscn(shstr->second) == sym_shdr.sh_link)
+        return;
+    /* suffixes share the tail of a longer name, like ld does */
+    vector<string> names;
+    for (auto& s : syms)
+        if (s.sym.st_name != 0)
+            names.push_back(s.name);
+    auto rev_greater = [](const string &a, const string &b) {
+        return lexicographical_compare(b.crbegin(), b.crend(), a.crbegin(), a.crend());
+    };
+    sort(names.begin(), names.end(), rev_greater);
+    names.erase(unique(names.begin(), names.end()), names.end());
+    vector<byte> strtab{byte{0}};
+    unordered_map<string, GElf_Word> name_at;
+    const string *prev = nullptr;
+    for (auto& n : names) {
+        if (prev != nullptr && prev->size() >= n.size()
+                && prev->compare(prev->size() - n.size(), n.size(), n) == 0) {
+            name_at[n] = name_at[*prev] + prev->size() - n.size();
+            continue;
+        }
+        name_at[n] = strtab.size();
+        auto b = reinterpret_cast<const byte*>(n.c_str());
+        strtab.insert(strtab.end(), b, b + n.size() + 1);
+        prev = &n;
+    }
+    auto str_scn = elf_getscn(e_out, sym_shdr.sh_link);
+    auto d = elf_getdata(str_scn, nullptr);
+    if (strtab.size() > d->d_size) // keep the file layout
+        return;
+    for (auto& s : syms)
+        if (s.sym.st_name != 0)
+            s.sym.st_name = name_at[s.name];
+    out_bufs.push_back(move(strtab));
+    d->d_buf = out_bufs.back().data();
+    d->d_size = out_bufs.back().size();
+    elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+    gelf_getshdr(str_scn, &shdr);
+    shdr.sh_size = d->d_size;
+    gelf_update_shdr(str_scn, &shdr);
+}
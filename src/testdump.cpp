@@ -0,0 +1,186 @@
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <bintail/bintail.h>
+#include "mvelem.h"
+#include "dump.h"
+
+using namespace std;
+
+/* Decoded CBOR */
+struct item {
+    enum { UINT, NINT, TEXT, ARRAY, MAP, BOOL, NUL } kind;
+    uint64_t u = 0; // value, -1-value for NINT, bool
+    string s;
+    vector<item> array;
+    vector<pair<string, item>> map;
+
+    const item* get(const string &k) const {
+        for (auto& [key, v] : map)
+            if (key == k)
+                return &v;
+        return nullptr;
+    }
+};
+
+static item decode(const uint8_t *&p, const uint8_t *end) {
+    if (p == end)
+        throw std::runtime_error("truncated");
+    auto major = *p >> 5, info = *p & 0x1f;
+    p++;
+    item it;
+    if (major == 7) {
+        if (info != 20 && info != 21 && info != 22)
+            throw std::runtime_error("unexpected simple value " + to_string(info));
+        it.kind = info == 22 ? item::NUL : item::BOOL;
+        it.u = info == 21;
+        return it;
+    }
+    uint64_t v = info;
+    if (info >= 24) {
+        if (info > 27)
+            throw std::runtime_error("indefinite length");
+        auto bytes = 1 << (info - 24);
+        if (end - p < bytes)
+            throw std::runtime_error("truncated");
+        v = 0;
+        for (auto i = 0; i < bytes; i++)
+            v = v << 8 | *p++;
+    }
+    switch (major) {
+    case 0: it.kind = item::UINT; it.u = v; break;
+    case 1: it.kind = item::NINT; it.u = v; break;
+    case 3:
+        if (uint64_t(end - p) < v)
+            throw std::runtime_error("truncated");
+        it.kind = item::TEXT;
+        it.s.assign(reinterpret_cast<const char*>(p), v);
+        p += v;
+        break;
+    case 4:
+        it.kind = item::ARRAY;
+        for (auto i = 0ul; i < v; i++)
+            it.array.push_back(decode(p, end));
+        break;
+    case 5:
+        it.kind = item::MAP;
+        for (auto i = 0ul; i < v; i++) {
+            auto k = decode(p, end);
+            if (k.kind != item::TEXT)
+                throw std::runtime_error("map key not a string");
+            it.map.emplace_back(k.s, decode(p, end));
+        }
+        break;
+    default:
+        throw std::runtime_error("unexpected major type " + to_string(major));
+    }
+    return it;
+}
+
+static void write(const item &it, ModelWriter &w) {
+    switch (it.kind) {
+    case item::UINT: w.unum(it.u); break;
+    case item::NINT: w.num(-1 - int64_t(it.u)); break;
+    case item::TEXT: w.str(it.s); break;
+    case item::BOOL: w.boolean(it.u); break;
+    case item::NUL: w.null(); break;
+    case item::ARRAY:
+        w.array(it.array.size());
+        for (auto& e : it.array)
+            write(e, w);
+        w.end();
+        break;
+    case item::MAP:
+        w.map(it.map.size());
+        for (auto& [k, v] : it.map) {
+            w.key(k);
+            write(v, w);
+        }
+        w.end();
+        break;
+    }
+}
+
+static string dump(Bintail &bintail, const string &format) {
+    auto f = tmpfile();
+    auto w = ModelWriter::create(format, fileno(f));
+    bintail.dump(*w);
+    string out;
+    char buf[4096];
+    rewind(f);
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+        out.append(buf, n);
+    fclose(f);
+    return out;
+}
+
+/*
+ * --dump=cbor decoded & written as JSON again equals --dump=json, its
+ * variables, functions, variants & patchpoints those of the model.
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "usage: testdump infile\n";
+        return 2;
+    }
+    Bintail bintail{argv[1]};
+    auto cbor = dump(bintail, "cbor");
+    auto json = dump(bintail, "json");
+
+    auto p = reinterpret_cast<const uint8_t*>(cbor.data());
+    auto end = p + cbor.size();
+    item model;
+    try {
+        model = decode(p, end);
+        if (p != end)
+            throw std::runtime_error("trailing bytes");
+    } catch (const std::exception &e) {
+        cerr << "cbor at " << cbor.size() - (end - p) << ": " << e.what() << "\n";
+        return 1;
+    }
+
+    auto failed = 0u;
+    auto check = [&](bool ok, const string &what) {
+        if (!ok) {
+            cerr << what << "\n";
+            failed++;
+        }
+    };
+    auto f = tmpfile();
+    {
+        JsonWriter w{fileno(f)};
+        write(model, w);
+        w.flush();
+    }
+    string again(json.size() + 1, '\0');
+    rewind(f);
+    again.resize(fread(&again[0], 1, again.size(), f));
+    fclose(f);
+    check(again == json, "cbor as json differs from the json dump");
+
+    auto vars = model.get("variables"), fns = model.get("functions");
+    check(vars && vars->array.size() == bintail.vars.size(), "variables");
+    check(fns && fns->array.size() == bintail.fns.size(), "functions");
+    for (auto i=0u; vars && i < min(vars->array.size(), bintail.vars.size()); i++) {
+        auto name = vars->array[i].get("name");
+        check(name && name->s == bintail.vars[i]->name(), "variable " + to_string(i) + " name");
+    }
+    for (auto i=0u; fns && i < min(fns->array.size(), bintail.fns.size()); i++) {
+        auto& fn = bintail.fns[i];
+        auto& d = fns->array[i];
+        auto name = d.get("name"), variants = d.get("variants"), pps = d.get("patchpoints");
+        check(name && name->s == fn->get_name(), "function " + to_string(i) + " name");
+        check(variants && variants->array.size() == fn->n_mvfns(), fn->get_name() + " variants");
+        check(pps && pps->array.size() == fn->n_pps(), fn->get_name() + " patchpoints");
+        for (auto j=0u; variants && j < min(variants->array.size(), fn->n_mvfns()); j++) {
+            auto loc = variants->array[j].get("location");
+            check(loc && loc->u == fn->variants()[j]->location(),
+                    fn->get_name() + " variant " + to_string(j) + " location");
+        }
+    }
+    cout << cbor.size() << " bytes cbor, " << json.size() << " bytes json, "
+         << failed << " mismatches\n";
+    return failed != 0;
+}
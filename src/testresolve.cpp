@@ -0,0 +1,71 @@
+#include <iostream>
+#include <algorithm>
+#include <bintail/bintail.h>
+#include "mvelem.h"
+
+using namespace std;
+
+/*
+ * DecisionTable against MVFn::select() for every configuration of the
+ * variables: not frozen, or frozen to a value at or next to the bounds
+ * of an assignment.
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "usage: testresolve infile\n";
+        return 2;
+    }
+    Bintail bintail{argv[1]};
+    auto& vars = bintail.vars;
+    auto& fns = bintail.fns;
+
+    /* values per var, -1 index: not frozen */
+    vector<vector<int64_t>> domains(vars.size());
+    for (auto& fn : fns)
+        for (auto& m : fn->variants())
+            for (auto& a : m->get_assigns()) {
+                auto it = find_if(vars.cbegin(), vars.cend(),
+                        [&](auto& v) { return v.get() == a->var; });
+                if (it == vars.cend())
+                    continue;
+                auto& d = domains[it - vars.cbegin()];
+                int64_t lower = a->lower(), upper = a->upper();
+                d.insert(d.end(), { lower - 1, lower, upper, upper + 1 });
+            }
+    uint64_t space = 1;
+    for (auto& d : domains) {
+        sort(d.begin(), d.end());
+        d.erase(unique(d.begin(), d.end()), d.end());
+        space *= d.size() + 1;
+        if (space > (1ul << 20)) {
+            cerr << "configuration space too large\n";
+            return 2;
+        }
+    }
+
+    auto failed = 0ul;
+    for (uint64_t index = 0; index < space; index++) {
+        auto rest = index;
+        for (auto i=0u; i < vars.size(); i++) {
+            auto& d = domains[i];
+            auto k = rest % (d.size() + 1);
+            rest /= d.size() + 1;
+            vars[i]->frozen = k != 0;
+            if (k != 0)
+                vars[i]->_value = d[k-1];
+        }
+        auto sel = bintail.resolve(Config{});
+        for (auto i=0u; i < fns.size(); i++) {
+            if (sel[i] == fns[i]->select())
+                continue;
+            failed++;
+            cerr << fns[i]->get_name() << " differs for";
+            for (auto& v : vars)
+                cerr << " " << v->name() << "=" << (v->frozen ? to_string(v->value()) : "?");
+            cerr << "\n";
+        }
+    }
+    cout << space << " configurations, " << fns.size() << " functions, "
+         << failed << " mismatches\n";
+    return failed != 0;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <vector>
+#include <iterator>
+#include "x86len.h"
+
+using namespace std;
+
+/*
+ * Known encodings against x86_insn_decode
+ */
+struct sample {
+    const char *asm_;
+    vector<uint8_t> bytes;
+    size_t len;
+    uint8_t rel_off, rel_size, rip_off;
+    bool call;
+};
+
+static const sample samples[] = {
+    { "nop",                       { 0x90 }, 1 },
+    { "ret",                       { 0xc3 }, 1 },
+    { "cli",                       { 0xfa }, 1 },
+    { "xchg ax,ax",                { 0x66, 0x90 }, 2 },
+    { "push es (invalid)",         { 0x06 }, 0 },
+    { "mov rbp,rsp",               { 0x48, 0x89, 0xe5 }, 3 },
+    { "sub rsp,8",                 { 0x48, 0x83, 0xec, 0x08 }, 4 },
+    { "movabs rax,imm64",          { 0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8 }, 10 },
+    { "mov rax,[rip+0]",           { 0x48, 0x8b, 0x05, 0, 0, 0, 0 }, 7, 0, 0, 3 },
+    { "mov dword [rip+0],imm32",   { 0xc7, 0x05, 0, 0, 0, 0, 1, 0, 0, 0 }, 10, 0, 0, 2 },
+    { "test byte [rip+0],1",       { 0xf6, 0x05, 0, 0, 0, 0, 1 }, 7, 0, 0, 2 },
+    { "nopl [rax+rax+0]",          { 0x0f, 0x1f, 0x44, 0x00, 0x00 }, 5 },
+    { "nopw [rax+rax+0]",          { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0, 0, 0, 0 }, 9 },
+    { "jmp rel8",                  { 0xeb, 0x05 }, 2, 1, 1 },
+    { "jmp rel32",                 { 0xe9, 0, 0, 0, 0 }, 5, 1, 4 },
+    { "call rel32",                { 0xe8, 0, 0, 0, 0 }, 5, 1, 4, 0, true },
+    { "call [rip+0]",              { 0xff, 0x15, 0, 0, 0, 0 }, 6, 0, 0, 2, true },
+    { "je rel32",                  { 0x0f, 0x84, 0, 0, 0, 0 }, 6, 2, 4 },
+    { "syscall",                   { 0x0f, 0x05 }, 2 },
+    { "movnti [rdi],eax",          { 0x0f, 0xc3, 0x07 }, 3 },
+    { "cmpps xmm0,xmm1,0",         { 0x0f, 0xc2, 0xc1, 0x00 }, 4 },
+    { "shufps xmm0,xmm1,0x1b",     { 0x0f, 0xc6, 0xc1, 0x1b }, 4 },
+    { "pfmul mm0,mm1",             { 0x0f, 0x0f, 0xc1, 0xb4 }, 4 },
+    { "pfmul mm0,[rax+8]",         { 0x0f, 0x0f, 0x40, 0x08, 0xb4 }, 5 },
+    { "palignr xmm0,xmm1,8",       { 0x66, 0x0f, 0x3a, 0x0f, 0xc1, 0x08 }, 6 },
+    { "pshufb xmm0,xmm1",          { 0x66, 0x0f, 0x38, 0x00, 0xc1 }, 5 },
+    { "vzeroupper",                { 0xc5, 0xf8, 0x77 }, 3 },
+    { "vpalignr xmm0,xmm0,xmm1,8", { 0xc4, 0xe3, 0x79, 0x0f, 0xc1, 0x08 }, 6 },
+    { "call rel32 (truncated)",    { 0xe8, 0, 0 }, 0 },
+};
+
+int main() {
+    int failed = 0;
+    for (auto& s : samples) {
+        x86_insn insn;
+        auto len = x86_insn_decode(s.bytes.data(), s.bytes.size(), insn);
+        bool ok = len == s.len;
+        if (ok && len != 0)
+            ok = insn.rel_off == s.rel_off && insn.rel_size == s.rel_size
+                && insn.rip_off == s.rip_off && insn.call == s.call;
+        if (!ok) {
+            cerr << s.asm_ << ": len " << len << ", expected " << s.len << "\n";
+            failed++;
+        }
+    }
+    cout << size(samples) - failed << "/" << size(samples) << " ok\n";
+    return failed != 0;
+}
@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <set>
+#include <stdexcept>
+
+#include "undo.h"
+
+using namespace std;
+
+template<typename T>
+static void put(vector<byte> &buf, const T &v) {
+    auto p = reinterpret_cast<const byte*>(&v);
+    buf.insert(buf.end(), p, p+sizeof(T));
+}
+
+static void put_bytes(vector<byte> &buf, const byte *p, size_t len) {
+    put(buf, static_cast<uint64_t>(len));
+    buf.insert(buf.end(), p, p+len);
+}
+
+static void put_str(vector<byte> &buf, const string &s) {
+    put_bytes(buf, reinterpret_cast<const byte*>(s.data()), s.size());
+}
+
+class Reader {
+public:
+    Reader(const byte *_p, size_t _sz) :p{_p}, sz{_sz}, pos{0} {}
+
+    template<typename T>
+    T get() {
+        T v;
+        memcpy(&v, take(sizeof(T)), sizeof(T));
+        return v;
+    }
+
+    vector<byte> get_bytes() {
+        auto len = get<uint64_t>();
+        auto b = take(len);
+        return {b, b+len};
+    }
+
+    string get_str() {
+        auto b = get_bytes();
+        return {reinterpret_cast<const char*>(b.data()), b.size()};
+    }
+private:
+    const byte* take(size_t len) {
+        if (len > sz - pos)
+            throw std::runtime_error("Undo note truncated");
+        auto b = p + pos;
+        pos += len;
+        return b;
+    }
+
+    const byte *p;
+    size_t sz;
+    size_t pos;
+};
+
+static bool rela_less(const GElf_Rela &a, const GElf_Rela &b) {
+    return tie(a.r_offset, a.r_info, a.r_addend) < tie(b.r_offset, b.r_info, b.r_addend);
+}
+
+static bool rela_same(const GElf_Rela &a, const GElf_Rela &b) {
+    return !rela_less(a, b) && !rela_less(b, a);
+}
+
+static vector<GElf_Rela> get_relas(Elf_Data *d) {
+    vector<GElf_Rela> v(d->d_size / sizeof(GElf_Rela));
+    for (auto i=0u; i < v.size(); i++)
+        gelf_getrela(d, i, &v[i]);
+    return v;
+}
+
+/* Indices in v of the entries of sub (a multiset), first ones first */
+static vector<uint64_t> find_relas(const vector<GElf_Rela> &v, const vector<GElf_Rela> &sub) {
+    multiset<GElf_Rela, decltype(&rela_less)> left(sub.cbegin(), sub.cend(), rela_less);
+    vector<uint64_t> ndx;
+    for (auto i=0u; i < v.size() && !left.empty(); i++) {
+        auto it = left.find(v[i]);
+        if (it == left.end())
+            continue;
+        left.erase(it);
+        ndx.push_back(i);
+    }
+    return ndx;
+}
+
+/* Input table from the output: added ones out, removed ones back at their index */
+template<typename R>
+static vector<GElf_Rela> unpatch_relas(const vector<GElf_Rela> &out,
+        const vector<uint64_t> &added, const vector<R> &removed) {
+    vector<GElf_Rela> in;
+    in.reserve(out.size() - added.size() + removed.size());
+    auto a = added.cbegin();
+    auto r = removed.cbegin();
+    for (auto i=0u; i < out.size(); i++) {
+        if (a != added.cend() && *a == i) {
+            a++;
+            continue;
+        }
+        for (; r != removed.cend() && r->ndx == in.size(); r++)
+            in.push_back(r->rela);
+        in.push_back(out[i]);
+    }
+    for (; r != removed.cend(); r++)
+        in.push_back(r->rela);
+    return in;
+}
+
+//------------------record---------------------------------------
+void UndoNote::record(Elf *e_in, const vector<pair<Elf_Scn*, Elf_Scn*>> &scn_map,
+        const string &_provenance) {
+    provenance = _provenance;
+    gelf_getehdr(e_in, &ehdr);
+
+    size_t phdr_num;
+    elf_getphdrnum(e_in, &phdr_num);
+    phdrs.resize(phdr_num);
+    for (auto i=0u; i<phdr_num; i++)
+        gelf_getphdr(e_in, i, &phdrs[i]);
+
+    size_t shstrndx;
+    elf_getshdrstrndx(e_in, &shstrndx);
+    for (auto& [scn_in, scn_out] : scn_map) {
+        scn s;
+        gelf_getshdr(scn_in, &s.shdr);
+        s.name = elf_strptr(e_in, shstrndx, s.shdr.sh_name);
+        if (scn_out == nullptr)
+            throw std::runtime_error("Undo note: section " + s.name + " removed");
+
+        auto d_in = elf_getdata(scn_in, nullptr);
+        auto d_out = elf_getdata(scn_out, nullptr);
+        auto in = d_in ? static_cast<const byte*>(d_in->d_buf) : nullptr;
+        if (s.shdr.sh_type == SHT_NOBITS || in == nullptr || d_in->d_size == 0) {
+            s.type = SCN_EMPTY;
+        } else if (d_in->d_size != d_out->d_size
+                && !(s.shdr.sh_type == SHT_STRTAB && d_in->d_size < d_out->d_size)) {
+            throw std::runtime_error("Undo note: section " + s.name + " changed size");
+        } else if (memcmp(in, d_out->d_buf, d_in->d_size) == 0) {
+            s.type = SCN_SAME; // string tables may only grow
+        } else if (s.shdr.sh_type == SHT_RELA) {
+            s.type = SCN_RELA;
+            auto r_in = get_relas(d_in);
+            auto r_out = get_relas(d_out);
+            auto in_sorted = r_in, out_sorted = r_out;
+            sort(in_sorted.begin(), in_sorted.end(), rela_less);
+            sort(out_sorted.begin(), out_sorted.end(), rela_less);
+            vector<GElf_Rela> removed, added;
+            set_difference(in_sorted.cbegin(), in_sorted.cend(), out_sorted.cbegin(),
+                    out_sorted.cend(), back_inserter(removed), rela_less);
+            set_difference(out_sorted.cbegin(), out_sorted.cend(), in_sorted.cbegin(),
+                    in_sorted.cend(), back_inserter(added), rela_less);
+            for (auto i : find_relas(r_in, removed))
+                s.removed.push_back({i, r_in[i]});
+            s.added = find_relas(r_out, added);
+
+            /* the rest reordered: whole table */
+            auto back = unpatch_relas(r_out, s.added, s.removed);
+            if (!equal(back.cbegin(), back.cend(), r_in.cbegin(), r_in.cend(), rela_same)) {
+                s.type = SCN_FULL;
+                s.removed.clear();
+                s.added.clear();
+                s.bytes.assign(in, in+d_in->d_size);
+            }
+        } else {
+            /* Changed ranges, close ones are merged */
+            const size_t gap = 16;
+            auto out = static_cast<const byte*>(d_out->d_buf);
+            auto sz = d_in->d_size;
+            s.type = SCN_PATCH;
+            for (auto i=0ul; i < sz; i++) {
+                if (in[i] == out[i])
+                    continue;
+                auto start = i, end = i+1;
+                for (; i < sz && i < end + gap; i++)
+                    if (in[i] != out[i])
+                        end = i+1;
+                s.ranges.push_back({start, {in+start, in+end}});
+                i = end;
+            }
+        }
+        scns.push_back(move(s));
+    }
+}
+
+vector<pair<uint64_t, uint64_t>> UndoNote::text_ranges() const {
+    vector<pair<uint64_t, uint64_t>> v;
+    for (auto& s : scns)
+        if (s.name == ".text")
+            for (auto& r : s.ranges)
+                v.push_back({s.shdr.sh_addr + r.offset, s.shdr.sh_addr + r.offset + r.bytes.size()});
+    return v;
+}
+
+vector<byte> UndoNote::serialize() {
+    vector<byte> desc;
+    put(desc, ehdr);
+    put(desc, static_cast<uint32_t>(phdrs.size()));
+    for (auto& p : phdrs)
+        put(desc, p);
+    put(desc, static_cast<uint32_t>(scns.size()));
+    for (auto& s : scns) {
+        put(desc, s.shdr);
+        put_str(desc, s.name);
+        put(desc, s.type);
+        switch (s.type) {
+        case SCN_PATCH:
+            put(desc, static_cast<uint32_t>(s.ranges.size()));
+            for (auto& r : s.ranges) {
+                put(desc, r.offset);
+                put_bytes(desc, r.bytes.data(), r.bytes.size());
+            }
+            break;
+        case SCN_FULL:
+            put_bytes(desc, s.bytes.data(), s.bytes.size());
+            break;
+        case SCN_RELA:
+            put(desc, static_cast<uint32_t>(s.removed.size()));
+            for (auto& r : s.removed) {
+                put(desc, r.ndx);
+                put(desc, r.rela);
+            }
+            put(desc, static_cast<uint32_t>(s.added.size()));
+            for (auto& i : s.added)
+                put(desc, i);
+            break;
+        default:
+            break;
+        }
+    }
+    put_str(desc, provenance);
+
+    put(desc, static_cast<uint8_t>(guard));
+    put(desc, static_cast<uint32_t>(vars.size()));
+    for (auto& v : vars)
+        put(desc, v);
+    put(desc, static_cast<uint32_t>(fixed.size()));
+    for (auto i : fixed)
+        put(desc, i);
+    put(desc, static_cast<uint32_t>(owners.size()));
+    for (auto& o : owners) {
+        put(desc, static_cast<uint32_t>(o.size()));
+        for (auto i : o)
+            put(desc, i);
+    }
+
+    /* Nhdr, name & desc 4 byte aligned */
+    vector<byte> note;
+    GElf_Nhdr nhdr;
+    nhdr.n_namesz = sizeof(UNDO_NOTE_NAME);
+    nhdr.n_descsz = desc.size();
+    nhdr.n_type = NT_BINTAIL_UNDO;
+    put(note, nhdr);
+    auto name = reinterpret_cast<const byte*>(UNDO_NOTE_NAME);
+    note.insert(note.end(), name, name+sizeof(UNDO_NOTE_NAME));
+    note.resize((note.size() + 3) & ~3ul);
+    note.insert(note.end(), desc.cbegin(), desc.cend());
+    note.resize((note.size() + 3) & ~3ul);
+    return note;
+}
+
+//------------------restore--------------------------------------
+bool UndoNote::parse(Elf_Scn *note_scn, UndoNote &note) {
+    auto d = elf_getdata(note_scn, nullptr);
+    if (d == nullptr)
+        return false;
+
+    GElf_Nhdr nhdr;
+    size_t off = 0, name_off, desc_off;
+    auto buf = static_cast<const byte*>(d->d_buf);
+    while ((off = gelf_getnote(d, off, &nhdr, &name_off, &desc_off)) > 0) {
+        if (nhdr.n_type != NT_BINTAIL_UNDO || nhdr.n_namesz != sizeof(UNDO_NOTE_NAME)
+                || memcmp(buf+name_off, UNDO_NOTE_NAME, sizeof(UNDO_NOTE_NAME)) != 0)
+            continue;
+
+        Reader r{buf+desc_off, nhdr.n_descsz};
+        note.ehdr = r.get<GElf_Ehdr>();
+        note.phdrs.resize(r.get<uint32_t>());
+        for (auto& p : note.phdrs)
+            p = r.get<GElf_Phdr>();
+        note.scns.resize(r.get<uint32_t>());
+        for (auto& s : note.scns) {
+            s.shdr = r.get<GElf_Shdr>();
+            s.name = r.get_str();
+            s.type = r.get<kind>();
+            switch (s.type) {
+            case SCN_PATCH:
+                s.ranges.resize(r.get<uint32_t>());
+                for (auto& rg : s.ranges) {
+                    rg.offset = r.get<uint64_t>();
+                    rg.bytes = r.get_bytes();
+                }
+                break;
+            case SCN_FULL:
+                s.bytes = r.get_bytes();
+                break;
+            case SCN_RELA:
+                s.removed.resize(r.get<uint32_t>());
+                for (auto& e : s.removed) {
+                    e.ndx = r.get<uint64_t>();
+                    e.rela = r.get<GElf_Rela>();
+                }
+                s.added.resize(r.get<uint32_t>());
+                for (auto& i : s.added)
+                    i = r.get<uint64_t>();
+                break;
+            default:
+                break;
+            }
+        }
+        note.provenance = r.get_str();
+
+        note.guard = r.get<uint8_t>();
+        note.vars.resize(r.get<uint32_t>());
+        for (auto& v : note.vars)
+            v = r.get<var_state>();
+        note.fixed.resize(r.get<uint32_t>());
+        for (auto& i : note.fixed)
+            i = r.get<uint32_t>();
+        note.owners.resize(r.get<uint32_t>());
+        for (auto& o : note.owners) {
+            o.resize(r.get<uint32_t>());
+            for (auto& i : o)
+                i = r.get<uint32_t>();
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Sections keep index, size & place with -u: only the recorded ranges
+ * and relocations are written back, headers replaced. The note section
+ * itself stays behind the restored ones.
+ */
+void UndoNote::restore(Elf *e_tail) {
+    auto mismatch = [](const string &what) {
+        return std::runtime_error("Undo note does not fit file: " + what);
+    };
+
+    size_t shnum;
+    elf_getshdrnum(e_tail, &shnum);
+    if (shnum < scns.size() + 1)
+        throw mismatch("sections missing");
+    size_t phdr_num;
+    elf_getphdrnum(e_tail, &phdr_num);
+    if (phdr_num != phdrs.size())
+        throw mismatch("program headers");
+
+    GElf_Shdr shdr;
+    for (auto i=0u; i < scns.size(); i++) {
+        auto& s = scns[i];
+        auto scn = elf_getscn(e_tail, i+1);
+        gelf_getshdr(scn, &shdr);
+        if (shdr.sh_type != s.shdr.sh_type || shdr.sh_name != s.shdr.sh_name)
+            throw mismatch(s.name);
+        if (s.type != SCN_EMPTY) {
+            auto d = elf_getdata(scn, nullptr);
+            if (d == nullptr || d->d_size < s.shdr.sh_size)
+                throw mismatch(s.name);
+            auto buf = static_cast<byte*>(d->d_buf);
+            switch (s.type) {
+            case SCN_PATCH:
+                for (auto& r : s.ranges) {
+                    if (r.offset + r.bytes.size() > s.shdr.sh_size)
+                        throw mismatch(s.name);
+                    if (s.name == ".text")
+                        tailored.emplace_back(buf + r.offset, buf + r.offset + r.bytes.size());
+                    copy(r.bytes.cbegin(), r.bytes.cend(), buf + r.offset);
+                }
+                break;
+            case SCN_FULL:
+                if (s.bytes.size() != d->d_size)
+                    throw mismatch(s.name);
+                copy(s.bytes.cbegin(), s.bytes.cend(), buf);
+                break;
+            case SCN_RELA: {
+                auto relas = unpatch_relas(get_relas(d), s.added, s.removed);
+                if (relas.size() * sizeof(GElf_Rela) != d->d_size)
+                    throw mismatch(s.name);
+                for (auto j=0u; j < relas.size(); j++)
+                    gelf_update_rela(d, j, &relas[j]);
+                break;
+            }
+            default:
+                break;
+            }
+            d->d_size = s.shdr.sh_size; // names of added sections
+        }
+        gelf_update_shdr(scn, &s.shdr);
+    }
+    for (auto i=0u; i < phdrs.size(); i++)
+        gelf_update_phdr(e_tail, i, &phdrs[i]);
+    gelf_update_ehdr(e_tail, &ehdr);
+    if (tailored.size() != owners.size())
+        throw mismatch("text ranges");
+}
@@ -0,0 +1,76 @@
+#ifndef __UNDO_H
+#define __UNDO_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <gelf.h>
+
+#define UNDO_NOTE_SCN  ".note.bintail"
+#define UNDO_NOTE_NAME "bintail"
+#define NT_BINTAIL_UNDO 1
+
+/*
+ * Undo note of a tailored executable.
+ *
+ * The output of -u keeps the input layout: same sections, sizes and
+ * addresses. The note holds the input ehdr, phdrs and shdrs, the
+ * original bytes of changed ranges and the relocations removed (by
+ * input index) and added (by output index). restore() puts them back in
+ * place, the tailored bytes of .text ranges are kept together with the
+ * functions owning them, see Bintail::keep_tailored.
+ */
+class UndoNote {
+public:
+    /* Record input scns against their output, all of them kept */
+    void record(Elf *e_in, const std::vector<std::pair<Elf_Scn*, Elf_Scn*>> &scn_map,
+            const std::string &provenance);
+    std::vector<std::byte> serialize(); // SHT_NOTE content
+
+    static bool parse(Elf_Scn *scn, UndoNote &note);
+    /* Input in place of e_tailored's (ELF_C_READ) buffers & headers */
+    void restore(Elf *e_tailored);
+
+    /* Changed .text by vaddr, [start, end) */
+    std::vector<std::pair<uint64_t, uint64_t>> text_ranges() const;
+
+    std::string provenance;
+
+    /* Tailoring the note was written with */
+    struct var_state {
+        uint8_t frozen;
+        int64_t value;
+    };
+    bool guard = false;
+    std::vector<var_state> vars;              // by index in Bintail::vars
+    std::vector<uint32_t> fixed;              // indices in Bintail::fns
+    std::vector<std::vector<uint32_t>> owners; // per text range, fns writing there
+    std::vector<std::vector<std::byte>> tailored; // per text range, by restore()
+private:
+    enum kind : uint8_t { SCN_EMPTY, SCN_SAME, SCN_PATCH, SCN_FULL, SCN_RELA };
+
+    struct range {
+        uint64_t offset;
+        std::vector<std::byte> bytes;
+    };
+
+    struct rela_at {
+        uint64_t ndx;
+        GElf_Rela rela;
+    };
+
+    struct scn {
+        std::string name;
+        GElf_Shdr shdr;
+        kind type;
+        std::vector<range> ranges;       // SCN_PATCH
+        std::vector<std::byte> bytes;    // SCN_FULL
+        std::vector<rela_at> removed;    // SCN_RELA, index in the input
+        std::vector<uint64_t> added;     // SCN_RELA, index in the output
+    };
+
+    GElf_Ehdr ehdr;
+    std::vector<GElf_Phdr> phdrs;
+    std::vector<scn> scns;
+};
+#endif
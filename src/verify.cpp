@@ -0,0 +1,452 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <bintail/bintail.h>
+#include "mvelem.h"
+#include "x86len.h"
+#include "undo.h"
+
+using namespace std;
+
+/* [start, end) */
+struct region {
+    uint64_t start;
+    uint64_t end;
+    MVFn *fn;
+};
+
+struct window {
+    uint64_t start;
+    uint64_t end;
+    MVPP *pp;
+};
+
+/* Output file, read only */
+struct out_elf {
+    int fd = -1;
+    Elf *e = nullptr;
+    GElf_Shdr text;
+    const uint8_t *text_buf = nullptr;
+    vector<GElf_Sym> syms;
+    vector<string> sym_names;
+    vector<GElf_Rela> relas;
+    bool undo = false; // -u, symbols kept
+
+    ~out_elf() {
+        if (e != nullptr)
+            elf_end(e);
+        if (fd != -1)
+            close(fd);
+    }
+    bool in_text(uint64_t addr, size_t len) {
+        return addr >= text.sh_addr && addr + len <= text.sh_addr + text.sh_size;
+    }
+    const uint8_t* at(uint64_t addr) {
+        return text_buf + (addr - text.sh_addr);
+    }
+};
+
+static string hexaddr(uint64_t addr) {
+    ostringstream s;
+    s << "0x" << hex << addr;
+    return s.str();
+}
+
+/* Run f(i, errors) for i in [0,n) on threads, errors are collected */
+template<class F>
+static void parallel(size_t n, unsigned threads, vector<string> &errors, F f) {
+    const size_t chunk = 64;
+    atomic<size_t> next{0};
+    vector<vector<string>> errs(max(1u, min<unsigned>(threads, (n + chunk-1) / chunk)));
+    auto work = [&](unsigned t) {
+        for (size_t start; (start = next.fetch_add(chunk)) < n;)
+            for (auto i = start; i < min(start + chunk, n); i++)
+                f(i, errs[t]);
+    };
+    vector<thread> pool;
+    for (auto t=1u; t < errs.size(); t++)
+        pool.emplace_back(work, t);
+    work(0);
+    for (auto& t : pool)
+        t.join();
+    for (auto& e : errs)
+        errors.insert(errors.end(), e.begin(), e.end());
+}
+
+static const region* find_region(const vector<region> &rs, uint64_t addr) {
+    auto it = upper_bound(rs.cbegin(), rs.cend(), addr, [](auto a, auto& r)
+            { return a < r.start; });
+    if (it == rs.cbegin() || addr >= prev(it)->end)
+        return nullptr;
+    return &*prev(it);
+}
+
+/* Remaining bytes of a patch window are nops */
+static bool nops(const uint8_t *op, size_t len) {
+    while (len > 0) {
+        auto l = x86_insn_len(op, len);
+        if (l == 0)
+            return false;
+        auto p = op;
+        while (*p == 0x66)
+            p++;
+        if (!(l == 1 && op[0] == 0x90) && !(p[0] == 0x0f && p[1] == 0x1f))
+            return false;
+        op += l;
+        len -= l;
+    }
+    return true;
+}
+
+/*
+ * Generic entry of a fixed function, decoded from the output: a jmp to
+ * the variant, the body of a simple variant or a copy of the variant
+ * whose relative operands reach the same targets.
+ */
+template<class E>
+static void check_entry(uint64_t loc, MVmvfn *pfn, out_elf &out, Section &text, E err) {
+    auto op = out.at(loc);
+    auto& mvfn = pfn->mvfn;
+    auto inline_err = "entry does not inline selected variant " + hexaddr(pfn->location());
+    if (op[0] == 0xe9 && loc + 5 + *reinterpret_cast<const int32_t*>(op + 1) == pfn->location())
+        return;
+    if (op[0] == 0xe9 && mvfn.type != MVFN_TYPE_NONE) { // else a copy of a tail call
+        err("entry does not jump to selected variant " + hexaddr(pfn->location()));
+        return;
+    }
+    switch (mvfn.type) {
+    case MVFN_TYPE_NOP:
+        if (op[0] != 0xc3)
+            err(inline_err + ", expected ret");
+        return;
+    case MVFN_TYPE_CONSTANT:
+        if (op[0] != 0xb8 || !out.in_text(loc, 6) || op[5] != 0xc3
+                || *reinterpret_cast<const uint32_t*>(op + 1) != mvfn.constant)
+            err(inline_err + ", expected mov $" + to_string(mvfn.constant) + ", %eax; ret");
+        return;
+    case MVFN_TYPE_CLI:
+    case MVFN_TYPE_STI:
+        if (op[0] != (mvfn.type == MVFN_TYPE_CLI ? 0xfa : 0xfb) || op[1] != 0xc3)
+            err(inline_err + (mvfn.type == MVFN_TYPE_CLI ? ", expected cli; ret" : ", expected sti; ret"));
+        return;
+    default:
+        break;
+    }
+
+    /* copy of the variant body */
+    auto size = pfn->size();
+    if (size == 0 || !out.in_text(loc, size)) {
+        err(inline_err);
+        return;
+    }
+    auto body = reinterpret_cast<const uint8_t*>(text.in_buf(pfn->location()));
+    for (size_t off = 0; off < size;) {
+        x86_insn insn;
+        auto len = x86_insn_decode(op + off, size - off, insn);
+        if (len == 0 || insn.call || x86_insn_len(body + off, size - off) != len) {
+            err(inline_err + ", at +" + to_string(off));
+            return;
+        }
+        auto fix = insn.rel_size ? insn.rel_off : insn.rip_off;
+        auto fix_sz = fix == 0 ? 0 : insn.rel_size == 1 ? 1 : 4;
+        auto same = equal(op + off, op + off + fix, body + off)
+            && equal(op + off + fix + fix_sz, op + off + len, body + off + fix + fix_sz);
+        if (fix != 0) {
+            auto disp = [&](const uint8_t *p) -> int64_t {
+                return fix_sz == 1 ? int8_t(p[off+fix]) : *reinterpret_cast<const int32_t*>(p + off + fix);
+            };
+            int64_t in_target = off + len + disp(body), out_target = off + len + disp(op);
+            auto inside = in_target >= 0 && in_target < int64_t(size);
+            same = same && (inside ? out_target == in_target
+                    : loc + out_target == pfn->location() + in_target);
+        }
+        if (!same) {
+            err(inline_err + ", at +" + to_string(off));
+            return;
+        }
+        off += len;
+    }
+}
+
+/* Written patchpoint against the variant of its function */
+static void check_pp(MVPP *pp, MVmvfn *pfn, out_elf &out, Section &text, vector<string> &errs) {
+    auto loc = pp->pp.location;
+    auto in = reinterpret_cast<const uint8_t*>(text.in_buf(loc));
+    size_t len = pp->pp.type == PP_TYPE_X86_CALL_INDIRECT ? 6 : 5;
+    auto err = [&](const string &msg) { errs.push_back(hexaddr(loc) + ": " + msg); };
+    if (!out.in_text(loc, len)) {
+        err("patchpoint outside of .text");
+        return;
+    }
+    auto op = out.at(loc);
+    if (pfn == nullptr) { // dynamic, unchanged
+        if (!equal(op, op + len, in))
+            err("patchpoint of dynamic function modified");
+        return;
+    }
+
+    auto target = [&]() { return loc + 5 + *reinterpret_cast<const int32_t*>(op + 1); };
+    if (pp->pp.type == PP_TYPE_X86_JUMP) {
+        check_entry(loc, pfn, out, text, err);
+        return;
+    }
+
+    switch (pfn->mvfn.type) {
+    case MVFN_TYPE_NOP:
+        if (!nops(op, len))
+            err("malformed nop");
+        break;
+    case MVFN_TYPE_CONSTANT:
+        if (op[0] != 0xb8 || *reinterpret_cast<const uint32_t*>(op + 1) != pfn->mvfn.constant)
+            err("expected mov $" + to_string(pfn->mvfn.constant) + ", %eax");
+        else if (!nops(op + 5, len - 5))
+            err("malformed nop after mov");
+        break;
+    case MVFN_TYPE_CLI:
+    case MVFN_TYPE_STI:
+        if (op[0] != (pfn->mvfn.type == MVFN_TYPE_CLI ? 0xfa : 0xfb))
+            err(pfn->mvfn.type == MVFN_TYPE_CLI ? "expected cli" : "expected sti");
+        else if (!nops(op + 1, len - 1))
+            err("malformed nop after cli/sti");
+        break;
+    default:
+        if (op[0] != 0xe8 || target() != pfn->location())
+            err("does not call selected variant " + hexaddr(pfn->location()));
+        else if (!nops(op + 5, len - 5))
+            err("malformed nop after call");
+    }
+}
+
+static bool read_out(const char *outfile, out_elf &out, Section &text) {
+    if ((out.fd = open(outfile, O_RDONLY)) == -1)
+        throw std::runtime_error("open "s + outfile + " failed. " + strerror(errno));
+    if ((out.e = elf_begin(out.fd, ELF_C_READ, nullptr)) == nullptr)
+        throw std::runtime_error("elf_begin "s + outfile + " failed.");
+
+    GElf_Shdr text_in;
+    gelf_getshdr(text.scn_in, &text_in);
+    size_t shstrndx;
+    elf_getshdrstrndx(out.e, &shstrndx);
+    Elf_Scn *scn = nullptr;
+    GElf_Shdr shdr;
+    auto found = false;
+    while ((scn = elf_nextscn(out.e, scn)) != nullptr) {
+        gelf_getshdr(scn, &shdr);
+        auto d = elf_getdata(scn, nullptr);
+        if (d == nullptr)
+            continue;
+        auto name = elf_strptr(out.e, shstrndx, shdr.sh_name);
+        if (shdr.sh_type == SHT_NOTE && name == UNDO_NOTE_SCN ""s)
+            out.undo = true;
+        if (name == ".text"s) {
+            out.text = shdr;
+            out.text_buf = static_cast<const uint8_t*>(d->d_buf);
+            found = shdr.sh_size == text_in.sh_size;
+        } else if (shdr.sh_type == SHT_SYMTAB) {
+            GElf_Sym sym;
+            for (size_t i=0; i < d->d_size / shdr.sh_entsize; i++) {
+                gelf_getsym(d, i, &sym);
+                out.syms.push_back(sym);
+                out.sym_names.push_back(elf_strptr(out.e, shdr.sh_link, sym.st_name));
+            }
+        } else if (shdr.sh_type == SHT_RELA) {
+            GElf_Rela rela;
+            for (size_t i=0; i < d->d_size / shdr.sh_entsize; i++) {
+                gelf_getrela(d, i, &rela);
+                out.relas.push_back(rela);
+            }
+        }
+    }
+    if (!found)
+        return false;
+
+    /* moved as a whole by -H: back to input addresses */
+    auto delta = out.text.sh_addr - text_in.sh_addr;
+    out.text.sh_addr -= delta;
+    for (auto& s : out.syms)
+        if (s.st_shndx != SHN_UNDEF && s.st_shndx < SHN_LORESERVE && GELF_ST_TYPE(s.st_info) != STT_TLS)
+            s.st_value -= delta;
+    for (auto& r : out.relas) {
+        r.r_offset -= delta;
+        if (GELF_R_TYPE(r.r_info) == R_X86_64_RELATIVE)
+            r.r_addend -= delta;
+    }
+    return true;
+}
+
+/**
+ * Check a tailored outfile against this input and the configuration it
+ * was tailored with: every patchpoint, guarded regions and references
+ * into them. Works on the model only, the input stays untouched.
+ */
+VerifyReport Bintail::verify(const Config &cfg, const char *outfile, unsigned threads) {
+    VerifyReport rep;
+    out_elf out;
+    if (!read_out(outfile, out, text)) {
+        rep.errors.push_back(".text missing or moved");
+        return rep;
+    }
+
+    /* selected variants as apply_config would */
+    freeze(cfg);
+    map<MVFn*, MVmvfn*> selected;
+    for (auto& v : vars) {
+        if (!v->frozen)
+            continue;
+        for (auto fn : v->functions()) {
+            auto pfn = fn->select();
+            if (pfn != nullptr)
+                selected[fn] = pfn;
+        }
+    }
+    auto variant = [&](MVFn *fn) -> MVmvfn* {
+        auto it = selected.find(fn);
+        return it == selected.end() ? nullptr : it->second;
+    };
+
+    /* patch windows may not overlap, entries with inlined variants are longer */
+    vector<window> windows;
+    map<MVFn*, size_t> entry_len;
+    for (auto& pp : pps) {
+        if (pp->_fn == nullptr || pp->pp.type == PP_TYPE_INVALID)
+            continue;
+        auto loc = pp->pp.location;
+        size_t len = pp->pp.type == PP_TYPE_X86_CALL_INDIRECT ? 6 : 5;
+        if (pp->pp.type == PP_TYPE_X86_JUMP && variant(pp->_fn) != nullptr)
+            len = entry_len[pp->_fn] = pp->entry(variant(pp->_fn), &text).size();
+        windows.push_back({loc, loc + len, pp.get()});
+    }
+    sort(windows.begin(), windows.end(), [](auto& a, auto& b) { return a.start < b.start; });
+    for (auto i=1u; i < windows.size(); i++)
+        if (windows[i].start < windows[i-1].end)
+            rep.errors.push_back(hexaddr(windows[i].start) + ": patchpoint overlaps "
+                    + hexaddr(windows[i-1].start));
+    auto in_window = [&](uint64_t addr) {
+        auto it = upper_bound(windows.cbegin(), windows.cend(), addr, [](auto a, auto& w)
+                { return a < w.start; });
+        return it != windows.cbegin() && addr < prev(it)->end;
+    };
+
+    /* guarded: other variants & generic body after the entry */
+    vector<region> guarded;
+    if (cfg.guard) {
+        for (auto& [fn, pfn] : selected) {
+            set<uint64_t> bodies{pfn->location()};
+            for (auto& m : fn->variants())
+                if (m->size() > 0 && bodies.insert(m->location()).second)
+                    guarded.push_back({m->location(), m->location() + m->size(), fn});
+            auto entry = entry_len.count(fn) ? entry_len[fn] : 5;
+            if (fn->size() > entry)
+                guarded.push_back({fn->location() + entry, fn->location() + fn->size(), fn});
+        }
+        for (auto& b : folded)
+            guarded.push_back({b.location, b.location + b.size, b.fn});
+        sort(guarded.begin(), guarded.end(), [](auto& a, auto& b) { return a.start < b.start; });
+    }
+
+    /* patchpoints */
+    rep.pps = windows.size();
+    parallel(windows.size(), threads, rep.errors, [&](size_t i, vector<string> &errs) {
+            auto pp = windows[i].pp;
+            check_pp(pp, variant(pp->_fn), out, text, errs);
+    });
+
+    /* guard bytes, patched callsites in dead code are fine */
+    for (auto& g : guarded)
+        rep.guarded += g.end - g.start;
+    parallel(guarded.size(), threads, rep.errors, [&](size_t i, vector<string> &errs) {
+            auto& g = guarded[i];
+            if (!out.in_text(g.start, g.end - g.start)) {
+                errs.push_back(hexaddr(g.start) + ": guarded region outside of .text");
+                return;
+            }
+            for (auto a = g.start; a < g.end; a++)
+                if (*out.at(a) != 0xcc && !in_window(a)) {
+                    errs.push_back(hexaddr(a) + ": not guarded (" + g.fn->get_name() + ")");
+                    return;
+                }
+    });
+
+    /* patched instructions end on instruction boundaries of the live code */
+    map<uint64_t, vector<const window*>> by_sym; // function start -> windows
+    map<uint64_t, uint64_t> fn_end;
+    for (auto& s : out.syms)
+        if (GELF_ST_TYPE(s.st_info) == STT_FUNC && s.st_size > 0)
+            fn_end[s.st_value] = max(fn_end[s.st_value], s.st_value + s.st_size);
+    for (auto& w : windows) {
+        if (w.pp->pp.type == PP_TYPE_X86_JUMP || find_region(guarded, w.start) != nullptr)
+            continue;
+        auto it = fn_end.upper_bound(w.start);
+        if (it == fn_end.begin() || w.start >= prev(it)->second)
+            continue;
+        by_sym[prev(it)->first].push_back(&w);
+    }
+    vector<pair<uint64_t, vector<const window*>>> walks(by_sym.begin(), by_sym.end());
+    parallel(walks.size(), threads, rep.errors, [&](size_t i, vector<string> &errs) {
+            auto& [start, ws] = walks[i];
+            auto end = fn_end[start];
+            if (!out.in_text(start, end - start))
+                return;
+            auto w = ws.cbegin();
+            for (auto a = start; a < end && w != ws.cend();) {
+                if (a == (*w)->start) {
+                    /* window must decode on its own */
+                    auto e = a;
+                    while (e < (*w)->end) {
+                        auto l = x86_insn_len(out.at(e), end - e);
+                        if (l == 0)
+                            break;
+                        e += l;
+                    }
+                    if (e != (*w)->end)
+                        errs.push_back(hexaddr(a) + ": patched instruction straddles "
+                                + hexaddr((*w)->end));
+                    a = e;
+                    w++;
+                    continue;
+                }
+                if (a > (*w)->start) {
+                    errs.push_back(hexaddr((*w)->start) + ": patchpoint not on an instruction boundary");
+                    w++;
+                    continue;
+                }
+                auto l = x86_insn_len(out.at(a), end - a);
+                if (l == 0) {
+                    errs.push_back(hexaddr(a) + ": undecodable instruction");
+                    return;
+                }
+                a += l;
+            }
+    });
+
+    /* references into guarded code */
+    parallel(out.relas.size(), threads, rep.errors, [&](size_t i, vector<string> &errs) {
+            auto& r = out.relas[i];
+            if (find_region(guarded, r.r_offset) != nullptr)
+                errs.push_back(hexaddr(r.r_offset) + ": relocation inside guarded code");
+            auto g = find_region(guarded, r.r_addend);
+            if (GELF_R_TYPE(r.r_info) == R_X86_64_RELATIVE && g != nullptr)
+                errs.push_back(hexaddr(r.r_offset) + ": relocation to guarded "
+                        + hexaddr(r.r_addend) + " (" + g->fn->get_name() + ")");
+    });
+    for (auto i=0u; !out.undo && i < out.syms.size(); i++) {
+        auto& s = out.syms[i];
+        if (s.st_shndx == SHN_UNDEF || s.st_shndx >= SHN_LORESERVE)
+            continue;
+        if (find_region(guarded, s.st_value) != nullptr) // dropped on write
+            rep.errors.push_back(hexaddr(s.st_value) + ": symbol "
+                    + out.sym_names[i] + " in guarded code");
+    }
+
+    sort(rep.errors.begin(), rep.errors.end());
+    reset();
+    return rep;
+}
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "sha256.h"
+
+using namespace std;
+
+static pair<string, string> split_path(const string &path) {
+    auto pos = path.rfind('/');
+    if (pos == string::npos)
+        return {".", path};
+    return {pos == 0 ? "/" : path.substr(0, pos), path.substr(pos+1)};
+}
+
+Watcher::Watcher(const Config &_base, const char *_config, const char *_infile, const char *_outfile)
+    :base{_base}, config{_config}, infile{_infile}, outfile{_outfile} {
+    if ((inotify = inotify_init1(IN_CLOEXEC)) == -1)
+        throw std::runtime_error("inotify_init failed. "s + strerror(errno));
+    /* directories: linkers write in place or rename a temporary */
+    for (auto& path : {infile, config}) {
+        auto dir = split_path(path).first;
+        if (inotify_add_watch(inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+            close(inotify);
+            throw std::runtime_error("inotify_add_watch "s + dir + " failed. " + strerror(errno));
+        }
+    }
+}
+
+Watcher::~Watcher() {
+    close(inotify);
+}
+
+Config Watcher::read_config() {
+    ifstream in{config};
+    if (!in)
+        throw std::runtime_error("open "s + config + " failed.");
+    auto cfg = base;
+    string line;
+    while (getline(in, line))
+        if (!cfg.parse(line.substr(0, line.find('#'))).empty())
+            throw std::runtime_error(config + ": only options expected");
+    return cfg;
+}
+
+void Watcher::tailor(const string &reason) {
+    auto start = chrono::steady_clock::now();
+    auto tmp = outfile + ".bintail-tmp";
+    auto out = cout.rdbuf(cerr.rdbuf()); // stdout: one line per run
+    string note;
+    try {
+        auto cfg = read_config();
+        auto sha = Sha256::file(infile.c_str());
+        if (sha != in_sha && bintail != nullptr && bintail->relink(infile.c_str())) {
+            note = "model kept";
+        } else if (sha != in_sha) {
+            auto prev = move(bintail); // fold results of unchanged functions
+            bintail = make_unique<Bintail>(infile.c_str(), prev.get());
+            if (prev != nullptr)
+                note = "reused " + to_string(bintail->reused_fns) + "/"
+                    + to_string(bintail->fns.size()) + " functions";
+        }
+        in_sha = sha;
+
+        bintail->init_write(tmp.c_str(), cfg.drops_info());
+        bintail->apply_config(cfg);
+        bintail->write(cfg.undo, cfg.huge_text);
+        bintail->reset();
+        if (rename(tmp.c_str(), outfile.c_str()) == -1)
+            throw std::runtime_error("rename "s + tmp + " failed. " + strerror(errno));
+    } catch (const std::exception &e) {
+        bintail = nullptr; // may be half relinked
+        in_sha.clear();
+        unlink(tmp.c_str());
+        cout.rdbuf(out);
+        auto usec = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+        cout << "error " << usec << " " << reason << " " << e.what() << endl;
+        return;
+    }
+    cout.rdbuf(out);
+    auto usec = chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - start).count();
+    cout << "ok " << usec << " " << reason << (note.empty() ? "" : " " + note) << endl;
+}
+
+void Watcher::run() {
+    tailor("start");
+    auto in_name = split_path(infile).second;
+    auto cfg_name = split_path(config).second;
+    alignas(struct inotify_event) char buf[4096];
+    for (;;) {
+        auto n = read(inotify, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error("inotify read failed. "s + strerror(errno));
+        /* one run per batch of events */
+        string reason;
+        for (char *p = buf; p < buf + n;) {
+            auto ev = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->len == 0)
+                continue;
+            if (ev->name == in_name)
+                reason = "relinked";
+            else if (ev->name == cfg_name && reason.empty())
+                reason = "config";
+        }
+        if (!reason.empty())
+            tailor(reason);
+    }
+}
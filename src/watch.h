@@ -0,0 +1,37 @@
+#ifndef __WATCH_H
+#define __WATCH_H
+
+#include <memory>
+#include <string>
+
+#include <bintail/bintail.h>
+
+/*
+ * Tailor infile to outfile again whenever the linker is done with it or
+ * the config file (options in daemon syntax) changes, via inotify.
+ *
+ * An identical input keeps its parsed model, a config change then only
+ * re-applies. A relinked one keeps it too if its model is unchanged
+ * (Bintail::relink), else it is parsed anew, reusing the fold results of
+ * unchanged functions. Outputs are renamed into place, one line per run:
+ *   ok <usec> <reason> [model kept|reused k/n functions]
+ *   error <usec> <reason> message
+ */
+class Watcher {
+public:
+    Watcher(const Config &base, const char *config, const char *infile, const char *outfile);
+    ~Watcher();
+    void run(); // until killed
+
+private:
+    void tailor(const std::string &reason);
+    Config read_config();
+
+    Config base;
+    std::string config, infile, outfile;
+    int inotify;
+
+    std::unique_ptr<Bintail> bintail;
+    std::string in_sha;
+};
+#endif
@@ -0,0 +1,185 @@
+#include "x86len.h"
+
+/* Operand kinds of the 1-byte opcode map */
+enum : uint8_t {
+    BAD  = 0x80,  // invalid in long mode
+    MRM  = 0x40,  // ModRM follows
+    I8   = 0x01,  // imm8
+    I16  = 0x02,  // imm16
+    IZ   = 0x03,  // imm16/32 by operand size
+    IV   = 0x04,  // imm16/32/64 by operand size & REX.W
+    MOFF = 0x05,  // moffs, 64/32 by address size
+    ENTR = 0x06,  // imm16 + imm8
+    GRP3 = 0x07,  // imm8/z depending on ModRM.reg
+    REL  = 0x08,  // rel32, operand size fixed in long mode
+    IMM  = 0x0f,
+};
+
+static const uint8_t map1[256] = {
+    /* 00 */ MRM, MRM, MRM, MRM, I8, IZ, BAD, BAD, MRM, MRM, MRM, MRM, I8, IZ, BAD, 0,
+    /* 10 */ MRM, MRM, MRM, MRM, I8, IZ, BAD, BAD, MRM, MRM, MRM, MRM, I8, IZ, BAD, BAD,
+    /* 20 */ MRM, MRM, MRM, MRM, I8, IZ, 0, BAD, MRM, MRM, MRM, MRM, I8, IZ, 0, BAD,
+    /* 30 */ MRM, MRM, MRM, MRM, I8, IZ, 0, BAD, MRM, MRM, MRM, MRM, I8, IZ, 0, BAD,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ BAD, BAD, 0, MRM, 0, 0, 0, 0, IZ, MRM|IZ, I8, MRM|I8, 0, 0, 0, 0,
+    /* 70 */ I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8,
+    /* 80 */ MRM|I8, MRM|IZ, BAD, MRM|I8, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, BAD, 0, 0, 0, 0, 0,
+    /* a0 */ MOFF, MOFF, MOFF, MOFF, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+    /* b0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+    /* c0 */ MRM|I8, MRM|I8, I16, 0, 0, 0, MRM|I8, MRM|IZ, ENTR, 0, I16, 0, 0, I8, BAD, 0,
+    /* d0 */ MRM, MRM, MRM, MRM, BAD, BAD, BAD, 0, MRM, MRM, MRM, MRM, MRM, MRM, MRM, MRM,
+    /* e0 */ I8, I8, I8, I8, I8, I8, I8, I8, REL, REL, BAD, I8, 0, 0, 0, 0,
+    /* f0 */ 0, 0, 0, 0, 0, 0, MRM|GRP3, MRM|GRP3, 0, 0, 0, 0, 0, 0, MRM, MRM,
+};
+
+/* 0F map: no ModRM, imm8 */
+static bool map2_no_modrm(uint8_t op) {
+    return (op >= 0x05 && op <= 0x09) || op == 0x0b || op == 0x0e
+        || (op >= 0x30 && op <= 0x37) || op == 0x77
+        || (op >= 0x80 && op <= 0x8f) || (op >= 0xa0 && op <= 0xa2)
+        || (op >= 0xa8 && op <= 0xaa) || (op >= 0xc8 && op <= 0xcf);
+}
+
+static bool map2_imm8(uint8_t op) {
+    return (op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac
+        || op == 0xba || op == 0xc2 || (op >= 0xc4 && op <= 0xc6);
+}
+
+/* Bytes following the ModRM byte: SIB & displacement */
+static size_t modrm_len(const uint8_t *p, size_t left) {
+    if (left < 1)
+        return 0;
+    uint8_t mod = p[0] >> 6, rm = p[0] & 7;
+    size_t n = 1;
+    if (mod == 3)
+        return n;
+    if (rm == 4) {
+        if (left < 2)
+            return 0;
+        if (mod == 0 && (p[1] & 7) == 5)
+            n += 4;
+        n++;
+    } else if (mod == 0 && rm == 5) {
+        n += 4; // rip relative
+    }
+    if (mod == 1)
+        n += 1;
+    else if (mod == 2)
+        n += 4;
+    return n;
+}
+
+size_t x86_insn_len(const uint8_t *op, size_t max) {
+    x86_insn insn;
+    return x86_insn_decode(op, max, insn);
+}
+
+size_t x86_insn_decode(const uint8_t *op, size_t max, x86_insn &insn) {
+    insn = {};
+    if (max > 15)
+        max = 15;
+    size_t i = 0;
+    bool opsize = false, adsize = false, rex_w = false;
+
+    /* legacy prefixes */
+    for (; i < max; i++) {
+        auto b = op[i];
+        if (b == 0x66)
+            opsize = true;
+        else if (b == 0x67)
+            adsize = true;
+        else if (!(b == 0xf0 || b == 0xf2 || b == 0xf3 || b == 0x2e || b == 0x36
+                    || b == 0x3e || b == 0x26 || b == 0x64 || b == 0x65))
+            break;
+    }
+    if (i < max && (op[i] & 0xf0) == 0x40)
+        rex_w = op[i++] & 0x08;
+    if (i >= max)
+        return 0;
+
+    auto b = op[i++];
+    size_t imm = 0;
+    bool modrm = true;
+    if (b == 0x8f && i + 3 < max && (op[i] & 0x1f) >= 8) {
+        /* AMD XOP: 2 byte payload, opcode, ModRM */
+        uint8_t map = op[i] & 0x1f;
+        i += 3;
+        imm = map == 8 ? 1 : map == 10 ? 4 : 0;
+    } else if (b == 0xc4 || b == 0xc5 || b == 0x62) {
+        /* VEX / EVEX: payload, opcode, ModRM */
+        size_t payload = b == 0xc5 ? 1 : b == 0xc4 ? 2 : 3;
+        if (i + payload + 1 > max)
+            return 0;
+        uint8_t map = b == 0xc5 ? 1 : op[i] & (b == 0x62 ? 0x07 : 0x1f);
+        i += payload;
+        auto o = op[i++];
+        if (map == 3 || (map == 1 && map2_imm8(o)))
+            imm = 1;
+        else if (map < 1 || map > 7)
+            return 0;
+        if (map == 1 && o == 0x77)
+            modrm = false; // vzeroupper/vzeroall
+    } else if (b == 0x0f) {
+        if (i >= max)
+            return 0;
+        auto o = op[i++];
+        if (o == 0x38) {
+            if (i++ >= max)
+                return 0;
+        } else if (o == 0x3a) {
+            if (i++ >= max)
+                return 0;
+            imm = 1;
+        } else if (o == 0x0f) {
+            imm = 1; // 3DNow!: ModRM, opcode suffix as imm8
+        } else {
+            modrm = !map2_no_modrm(o);
+            if (map2_imm8(o))
+                imm = 1;
+            if (o >= 0x80 && o <= 0x8f) {
+                imm = 4; // jcc rel32
+                insn.rel_size = 4;
+            }
+        }
+    } else {
+        auto kind = map1[b];
+        if (kind & BAD)
+            return 0;
+        modrm = kind & MRM;
+        switch (kind & IMM) {
+        case I8:   imm = 1; break;
+        case I16:  imm = 2; break;
+        case IZ:   imm = opsize ? 2 : 4; break;
+        case IV:   imm = rex_w ? 8 : opsize ? 2 : 4; break;
+        case MOFF: imm = adsize ? 4 : 8; break;
+        case ENTR: imm = 3; break;
+        case REL:  imm = 4; insn.rel_size = 4; insn.call = b == 0xe8; break;
+        case GRP3:
+            if (i >= max)
+                return 0;
+            if (((op[i] >> 3) & 7) < 2)
+                imm = b == 0xf6 ? 1 : opsize ? 2 : 4;
+            break;
+        }
+        if ((b >= 0x70 && b <= 0x7f) || (b >= 0xe0 && b <= 0xe3) || b == 0xeb)
+            insn.rel_size = 1; // jcc/loop/jmp rel8
+        if (b == 0xff && i < max && ((op[i] >> 3) & 7) >= 2 && ((op[i] >> 3) & 7) <= 3)
+            insn.call = true;
+    }
+
+    if (modrm) {
+        auto n = modrm_len(op + i, max - i);
+        if (n == 0)
+            return 0;
+        if ((op[i] & 0xc7) == 0x05)
+            insn.rip_off = i + 1;
+        i += n;
+    }
+    if (insn.rel_size)
+        insn.rel_off = i;
+    i += imm;
+    insn.len = i <= max ? i : 0;
+    return insn.len;
+}
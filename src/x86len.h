@@ -0,0 +1,23 @@
+#ifndef __X86LEN_H
+#define __X86LEN_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Length of the x86-64 (long mode) instruction at op, 0 if it is
+ * invalid in long mode or longer than max bytes. Decodes legacy/REX
+ * prefixes, the 1-byte, 0F, 0F38 & 0F3A maps and VEX/EVEX encodings.
+ */
+size_t x86_insn_len(const uint8_t *op, size_t max);
+
+/* Operands that depend on the instruction address, offsets into it */
+struct x86_insn {
+    size_t len;
+    uint8_t rel_off, rel_size; // jmp/jcc/call displacement, size 0 if none
+    uint8_t rip_off;           // disp32 of rip relative ModRM, 0 if none
+    bool call;                 // direct or indirect call
+};
+size_t x86_insn_decode(const uint8_t *op, size_t max, x86_insn &insn);
+
+#endif
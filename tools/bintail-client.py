@@ -0,0 +1,29 @@
+#!/usr/bin/python3
+# Send one tailoring request to a `bintail --serve` daemon.
+#   bintail-client.py socket [--fd] [-s var=value] [-a var] [-A] [-g] infile outfile
+# --fd opens outfile here and passes the fd, the request names outfile "-".
+import os
+import socket
+import sys
+
+if len(sys.argv) < 4:
+    raise SystemExit(__doc__ or "usage: bintail-client.py socket [--fd] args...")
+
+path = sys.argv[1]
+args = sys.argv[2:]
+fds = []
+if args[0] == "--fd":
+    args = args[1:]
+    fds.append(os.open(args[-1], os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o700))
+    args[-1] = "-"
+
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.connect(path)
+line = (" ".join(args) + "\n").encode()
+if fds:
+    socket.send_fds(s, [line], fds)
+else:
+    s.sendall(line)
+reply = s.makefile().readline().strip()
+print(reply)
+sys.exit(0 if reply.startswith("ok") else 1)
@@ -7,11 +7,9 @@ rm *-patched
 
 for f in ./*
 do
-    echo "$f & $(../bintail -A $f $f-patched)"
-done
+    echo "-A $f $f-patched"
+done > ../_measure.manifest
+../bintail --fleet ../_measure.manifest -j $(nproc)
 
 echo " === Check Guard === "
-for g in ./*-patched
-do
-    echo "$g $(../callsite-check.py $g)"
-done
+../bintail --verify -A $(for g in ./*-patched; do echo "${g%-patched}" "$g"; done)
@@ -21,3 +21,17 @@ echo "Samples: $samples"
 test_flags "-d" $samples
 test_flags "-a config_first" $samples
 test_flags "-A" $samples
+
+echo "============================================================="
+echo "   TEST:  --serve"
+echo "============================================================="
+./bintail --serve test.sock &
+SERVER=$!
+trap "kill $SERVER" EXIT
+sleep 1
+for i in $samples
+do
+    ./tools/bintail-client.py test.sock -A $i test-serve-`basename $i`
+    ./tools/bintail-client.py test.sock --fd -A $i test-serve-`basename $i`
+    ./test-serve-`basename $i`
+done